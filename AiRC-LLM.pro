@@ -1,5 +1,5 @@
 # AiRC-LLC.pro
-QT += core gui network widgets
+QT += core gui network widgets sql
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -16,37 +16,73 @@ DEFINES += QT_DEPRECATED_WARNINGS
 # DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    src/chat_delegate.cpp \
+    src/chat_journal.cpp \
+    src/chat_model.cpp \
+    src/code_highlighter.cpp \
     src/deepseek_api.cpp \
     src/huggingface_agent.cpp \
     src/huggingface_api.cpp \
+    src/lexical_index.cpp \
     src/main.cpp \
     src/mainwindow.cpp \
     src/mainwindow_helpers.cpp \
+    src/markdown_renderer.cpp \
+    src/message_compressor.cpp \
     src/ollama_agent.cpp \
     src/ollama_api.cpp \
+    src/persistence_worker.cpp \
+    src/shard_protocol.cpp \
+    src/shard_self_test.cpp \
+    src/shard_worker.cpp \
+    src/sharded_index.cpp \
+    src/text_arena.cpp \
     src/workspace.cpp \
-    src/workspace_manager.cpp
+    src/workspace_manager.cpp \
+    src/workspace_search.cpp \
+    src/workspace_store.cpp
 
 HEADERS += \
+    headers/chat_delegate.h \
+    headers/chat_journal.h \
+    headers/chat_model.h \
+    headers/code_highlighter.h \
     headers/deepseek_api.h \
     headers/huggingface_agent.h \
     headers/huggingface_api.h \
+    headers/lexical_index.h \
     headers/llm_agent_interface.h \
     headers/llm_api_interface.h \
     headers/mainwindow.h \
     headers/mainwindow_helpers.h \
+    headers/markdown_renderer.h \
+    headers/message_compressor.h \
     \  # include/Ollama.h # Update the path to Ollama.h
     headers/ollama_agent.h \
     headers/ollama_api.h \
+    headers/persistence_worker.h \
+    headers/shard_protocol.h \
+    headers/shard_self_test.h \
+    headers/shard_worker.h \
+    headers/sharded_index.h \
+    headers/text_arena.h \
     headers/workspace.h \
     headers/workspace_manager.h \
+    headers/workspace_search.h \
+    headers/workspace_store.h \
     include/Ollama.hpp \
     include/hnswlib/bruteforce.h \
+    include/hnswlib/ef_tuner.h \
+    include/hnswlib/exact_scan.h \
     include/hnswlib/hnswalg.h \
     include/hnswlib/hnswlib.h \
+    include/hnswlib/ivfpq.h \
+    include/hnswlib/label_lookup.h \
+    include/hnswlib/quantization.h \
     include/hnswlib/space_ip.h \
     include/hnswlib/space_l2.h \
     include/hnswlib/stop_condition.h \
+    include/hnswlib/vamana.h \
     include/hnswlib/visited_list_pool.h
 
 FORMS += \
@@ -65,6 +101,12 @@ INCLUDEPATH += /usr/local/include
 # Link against the cmark library
 LIBS += -L/usr/local/lib -lcmark
 
+# Link against zstd, which compresses archived chat messages
+LIBS += -lzstd
+
+# POSIX AIO, which batches the disk index reads, is in librt before glibc 2.34
+unix:!macx: LIBS += -lrt
+
 # Set the application name
 TARGET = AiRC-LLC
 
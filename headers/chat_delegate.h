@@ -0,0 +1,76 @@
+// chat_delegate.h
+#ifndef CHAT_DELEGATE_H
+#define CHAT_DELEGATE_H
+
+#include <QAbstractItemView>
+#include <QCache>
+#include <QHash>
+#include <QPersistentModelIndex>
+#include <QStyledItemDelegate>
+#include <QTextDocument>
+#include <QTextCursor>
+#include <QTimer>
+#include <memory>
+#include "code_highlighter.h"
+#include "markdown_renderer.h"
+
+// Paints ChatModel rows as rich text. Only rows being painted are laid out; their documents
+// are kept for the next repaint and their heights for the next layout of the view, which
+// estimates the heights of rows never painted. A row that turns out to differ from its
+// estimate makes the view lay out again, once per event loop pass. Messages show as plain
+// text until the renderer has their markdown rendered, and their code uncolored until the
+// highlighter has it tokenized. The reply streaming in keeps one document, into which the
+// blocks it closes are inserted once; each update replaces only its trailing block.
+class ChatDelegate : public QStyledItemDelegate {
+    Q_OBJECT
+
+public:
+    ChatDelegate(QAbstractItemView* view, MarkdownRenderer* renderer, CodeHighlighter* highlighter);
+
+    void paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const override;
+    QSize sizeHint(const QStyleOptionViewItem& option, const QModelIndex& index) const override;
+
+private:
+    struct CachedDocument {
+        QString text; // Keeps the text alive, so its data pointer cannot be reused as a key
+        int kind;
+        bool rendered; // False while the markdown of a message waits for the renderer
+        QStringList languages; // Of the code blocks, in order
+        bool highlighted;
+        QTextDocument document;
+    };
+    // Keyed by the text's data pointer: hashing long messages on every layout would cost more
+    // than the layout. A reused pointer at worst gives a wrong estimate until the row is painted.
+    struct MeasuredHeight {
+        int textSize;
+        int width;
+        int height;
+    };
+    struct PendingDocument {
+        QString closedHtml;    // Of the closed blocks inserted so far
+        QString trailingHtml;  // Of the trailing block inserted after them
+        int trailingStart = 0; // Document position where the closed blocks end
+        QStringList closedLanguages;
+        QStringList languages;
+        bool highlighted = false;
+        QTextDocument document;
+    };
+
+    QTextDocument* document(const QString& text, int kind, int width, const QFont& font) const;
+    QTextDocument* pendingDocument(const QString& html, int closedLength, int width, const QFont& font) const;
+    static void insertBlocks(QTextCursor& cursor, const QString& html);
+    int textWidth() const;
+    int estimateHeight(const QString& text, int kind, int width, const QStyleOptionViewItem& option) const;
+    void rememberHeight(const QModelIndex& index, const QString& text, int width, int height) const;
+
+    QAbstractItemView* view;
+    MarkdownRenderer* renderer;
+    CodeHighlighter* highlighter;
+    mutable QCache<const void*, CachedDocument> documents;
+    mutable QHash<const void*, MeasuredHeight> heights;
+    mutable std::unique_ptr<PendingDocument> pending; // Of the last reply streamed in
+    mutable QTimer relayoutTimer;
+    mutable QPersistentModelIndex relayoutIndex;
+};
+
+#endif // CHAT_DELEGATE_H
@@ -0,0 +1,29 @@
+// chat_journal.h
+#ifndef CHAT_JOURNAL_H
+#define CHAT_JOURNAL_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <utility>
+#include <vector>
+
+// Reads the per-workspace chat journals written by older versions, which logged the messages
+// appended since the last workspaces.json snapshot. Only WorkspaceStore uses it, to import
+// them; nothing writes journals anymore.
+class ChatJournal {
+public:
+    explicit ChatJournal(const QString& directory);
+
+    // Messages after afterSequence, in order; a torn last record is skipped
+    QVector<QString> replay(int workspaceId, quint64 afterSequence) const;
+
+private:
+    QString pathFor(int workspaceId) const;
+    // Parses records from data; returns the length of the valid prefix
+    static qint64 decodeRecords(const QByteArray& data, std::vector<std::pair<quint64, QByteArray>>& records);
+
+    QString directory;
+};
+
+#endif // CHAT_JOURNAL_H
@@ -0,0 +1,49 @@
+// chat_model.h
+#ifndef CHAT_MODEL_H
+#define CHAT_MODEL_H
+
+#include <QAbstractListModel>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// Rows of the chat view: an optional title and a hint that older messages can be paged in,
+// then the loaded messages of the workspace, the reply streaming in, if any, and notices added
+// since (progress, errors). Messages are markdown; the streaming reply is rendered HTML.
+// The messages are the workspace's own implicitly shared vector, so showing a workspace costs
+// the same for any history length; the view only lays out the rows it paints.
+class ChatModel : public QAbstractListModel {
+    Q_OBJECT
+
+public:
+    // ClosedLengthRole: how much of the pending reply's HTML belongs to blocks it has closed
+    enum Role { KindRole = Qt::UserRole + 1, ClosedLengthRole };
+    enum Kind { Message, PendingReply, Notice };
+
+    explicit ChatModel(QObject* parent = nullptr);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+
+    void setConversation(const QString& title, const QVector<QString>& messages, bool hasOlderMessages);
+    void prependMessages(const QVector<QString>& olderMessages, bool hasOlderMessages);
+    void appendMessage(const QString& message); // Also drops the pending reply and notices, which led up to it
+    void setPendingReply(const QString& closedBlocksHtml, const QString& trailingHtml);
+    QModelIndex messageIndex(int message) const; // Of the message'th loaded message
+    void addNotice(const QString& notice);
+    void clear();
+
+private:
+    int headerRows() const;
+    int pendingReplyRows() const { return pendingReply.isEmpty() ? 0 : 1; }
+    void setHasOlderMessages(bool hasOlderMessages);
+
+    QString title;
+    bool olderMessagesHint = false;
+    QVector<QString> messages;
+    QString pendingReply;
+    int pendingClosedLength = 0;
+    QStringList notices;
+};
+
+#endif // CHAT_MODEL_H
@@ -0,0 +1,67 @@
+// code_highlighter.h
+#ifndef CODE_HIGHLIGHTER_H
+#define CODE_HIGHLIGHTER_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QList>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QTextBlock>
+#include <QTextDocument>
+#include <QThreadPool>
+#include <QVector>
+
+// Syntax highlighting of the code blocks in chat messages. Code is tokenized on a private
+// thread pool and the tokens are cached per block under a hash of its text and language, so
+// a document shows its code plain at first and colored once the tokens arrive. A block that
+// grows while a reply streams in is tokenized again only from its last line.
+class CodeHighlighter : public QObject {
+    Q_OBJECT
+
+public:
+    enum TokenKind { Keyword, String, Comment, Number };
+    struct Token {
+        int start;
+        int length;
+        TokenKind kind;
+    };
+    using Tokens = QVector<Token>;
+
+    explicit CodeHighlighter(QObject* parent = nullptr);
+
+    // Colors the code blocks of a document set from HTML, taking their languages in order.
+    // False while some block waits for its tokens; highlighted() follows once they are cached.
+    bool highlight(QTextDocument* document, const QStringList& languages);
+
+    // Languages of the code blocks in HTML rendered from markdown, empty where none was given
+    static QStringList codeLanguages(const QString& html);
+
+signals:
+    void highlighted();
+
+private:
+    // Tokens of a block, with where tokenizing resumes when the block has grown
+    struct Tokenized {
+        QString language;
+        QString code;
+        Tokens tokens;
+        int resumeOffset = 0; // Start of the last line, which may still be incomplete
+        int resumeTokens = 0; // Tokens before that line
+        int resumeState = 0;  // Open comment or string at the start of that line
+    };
+
+    const Tokens* tokens(const QString& code, const QString& language);
+    void apply(QTextDocument* document, const QVector<QTextBlock>& lines, const Tokens& tokens) const;
+    static QByteArray key(const QString& code, const QString& language);
+    static Tokenized tokenize(const QString& code, const QString& language, const Tokenized* previous);
+
+    QCache<QByteArray, Tokens> cache;
+    QSet<QByteArray> pending;
+    QList<Tokenized> recent; // Latest blocks tokenized, which a streaming block may extend
+    QThreadPool pool;
+};
+
+#endif // CODE_HIGHLIGHTER_H
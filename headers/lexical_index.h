@@ -0,0 +1,56 @@
+// lexical_index.h
+#ifndef LEXICAL_INDEX_H
+#define LEXICAL_INDEX_H
+
+#include <QString>
+#include <QStringList>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <hnswlib/hnswlib.h>
+
+// One BM25 hit
+struct LexicalMatch {
+    hnswlib::labeltype label;
+    float score;         // Higher is better
+    size_t matchedTerms; // Distinct query terms that occur in the text
+};
+
+// In-memory BM25 inverted index over workspace texts, keyed by the same labels as the vector
+// index. Posting lists are varint-encoded (label gap, term frequency) pairs, so labels are
+// expected to be added in increasing order like in TextArena.
+class LexicalIndex {
+public:
+    void add(hnswlib::labeltype label, const QString& text);
+    // text must be the one the label was added with, so its terms lose the document
+    bool remove(hnswlib::labeltype label, const QString& text);
+    void clear();
+    size_t size() const;
+    size_t postingBytes() const;
+    // Best first; terms are scored on up to numThreads threads when their postings are long
+    std::vector<LexicalMatch> search(const QString& query, size_t k, size_t numThreads = 1) const;
+    // Lowercased words; identifiers also yield their snake_case and camelCase parts
+    static QStringList tokenize(const QString& text);
+
+private:
+    struct PostingList {
+        std::string bytes;
+        hnswlib::labeltype lastLabel = 0;
+        size_t count = 0;     // Postings, including those of removed documents
+        size_t liveCount = 0; // Document frequency of the term
+    };
+    using ScoreMap = std::unordered_map<hnswlib::labeltype, std::pair<float, size_t>>; // label -> (score, matched terms)
+
+    static void appendVarint(std::string& bytes, quint64 value);
+    static quint64 readVarint(const std::string& bytes, size_t& pos);
+    void scoreTerm(const PostingList& list, float idf, float averageLength, ScoreMap& scores) const;
+    void compactIfNeeded();
+
+    std::unordered_map<std::string, PostingList> postings;
+    std::unordered_map<hnswlib::labeltype, quint32> documentLengths; // Live documents only, in tokens
+    hnswlib::labeltype nextLabel = 0; // Every added label is below this
+    quint64 totalLength = 0;
+    size_t removedDocuments = 0; // Still in the postings until the next compaction
+};
+
+#endif // LEXICAL_INDEX_H
@@ -5,6 +5,7 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <QJsonArray>
 #include <QJsonObject>
 
 class LlmAgentInterface {
@@ -14,10 +15,25 @@ public:
     virtual std::vector<std::string> list_models() = 0;
     virtual std::vector<std::string> list_running_models() = 0;
     virtual bool load_model(const std::string& modelName) = 0;
+    // May return before callback receives the reply, which can then arrive on another thread
     virtual void generate(const std::string& modelName, const std::string& prompt, std::function<void(const std::string&)> callback) = 0;
+    // Receives the HTML of the blocks a streaming reply has closed, which only ever grows, and of
+    // the trailing block, which may still change
+    using ProgressCallback = std::function<void(const std::string& closedBlocksHtml, const std::string& trailingHtml)>;
+    // Like generate(), also passing the reply so far to progress while it streams in;
+    // APIs that answer in one piece report no progress
+    virtual void generateStreaming(const std::string& modelName, const std::string& prompt, ProgressCallback progress,
+                                   std::function<void(const std::string&)> callback) {
+        (void)progress;
+        generate(modelName, prompt, callback);
+    }
     virtual QJsonObject getSettings() const = 0;
     virtual void setSettings(const QJsonObject& settings) = 0;
     virtual std::string getAgentType() const = 0; // New method to get the agent type
+    // Server-side state of the conversation after the last reply, sent along with the next
+    // prompt; empty for APIs that keep none
+    virtual QJsonArray getContext() const { return QJsonArray(); }
+    virtual void setContext(const QJsonArray& context) { (void)context; }
 };
 
 #endif // LLM_AGENT_INTERFACE_H
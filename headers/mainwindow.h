@@ -10,7 +10,7 @@
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QFile>
-#include <QTextBrowser>
+#include <QListView>
 #include <QLineEdit>
 #include <QPushButton>
 #include <QListWidget>
@@ -24,8 +24,14 @@
 #include <QInputDialog>
 #include <QMenu>
 #include <QTimer>
+#include <set>
 #include <unordered_map>
+#include "chat_model.h"
+#include "code_highlighter.h"
+#include "markdown_renderer.h"
+#include "persistence_worker.h"
 #include "workspace.h"
+#include "workspace_search.h"
 #include "huggingface_agent.h"
 #include "ollama_agent.h"
 
@@ -48,11 +54,14 @@ private slots:
     void openSettings(QListWidgetItem *item = nullptr);
     void renameWorkspace();
     void deleteWorkspace();
+    void forkWorkspace();
     void showContextMenu(const QPoint& pos);
     void deleteAllWorkspaces(); // Declare the deleteAllWorkspaces method
     void editUrlAndRepollModels(); // Declare the editUrlAndRepollModels method
     void repollModels(); // Declare the repollModels method
     void streamSendMessage(); // Declare the streamSendMessage method
+    void searchConversations(const QString& text);
+    void openSearchResult(QListWidgetItem *item);
 
 private:
     Ui::MainWindow *ui;
@@ -62,7 +71,16 @@ private:
     QVBoxLayout *rightLayout;
     QPushButton *addWorkspaceButton;
     QListWidget *workspacesList;
-    QTextBrowser *chatTextBrowser;
+    QLineEdit *searchLineEdit;
+    // Entries related to the query, then message matches across all workspaces, newest first
+    QListWidget *searchResultsList;
+    quint64 searchGeneration = 0; // Results of older searches are dropped
+    WorkspaceSearch workspaceSearch; // Embedding search across the workspaces' indexes
+    QListView *chatView;
+    ChatModel *chatModel; // Rows of the selected workspace
+    MarkdownRenderer *markdownRenderer;
+    CodeHighlighter *codeHighlighter;
+    bool chatFollowsEnd = true; // Scrolled to the newest message, so new rows keep it in view
     QLineEdit *inputLineEdit;
     QPushButton *sendButton;
     QPushButton *clearButton;
@@ -70,9 +88,23 @@ private:
     std::map<int, Workspace*> workspaceMap;
     QNetworkAccessManager *networkManager;
     std::unordered_map<std::string, bool> modelStatusMap;
+    PersistenceWorker *persistence; // Owns the workspace database
+    std::set<int> historyLoads; // Workspaces with a history page being read
+    int scrollTargetWorkspace = -1; // Message to show once its history page is loaded, if any
+    qint64 scrollTargetPosition = 0;
+    QTimer *idleTimer;
 
     void loadWorkspaces();
     void saveWorkspaces();
+    void onWorkspacesSaved(quint64 generation, bool ok);
+    void showChatHistory(int workspaceId);
+    void loadOlderHistory(int workspaceId, qint64 count = 0); // At least a page, or count messages
+    void revealScrollTarget();
+    void onChatScrolled(int value);
+    void copySelectedMessages();
+    void releaseIdleWorkspaces();
+    void showRelatedEntries(const QString& query);
+    void detachBranches(const Workspace* parent); // Before parent is deleted
     bool verifyModelStartup(const QString& modelName);
     bool loadModel(const QString& modelName);
     int getNextWorkspaceId() const;
@@ -4,16 +4,20 @@
 #include <QString>
 #include <QJsonObject>
 #include <QListWidgetItem>
-#include <QTextBrowser>  // Include QTextBrowser
 #include <QException>    // Include QException
 #include <QMessageBox>   // Include QMessageBox
+#include "chat_model.h"
 #include "workspace.h"
+#include "workspace_store.h"
 
 namespace MainWindowHelpers {
-void updateChatWithMarkdown(QTextBrowser* chatTextBrowser, const QString& markdownText);
+void updateChatWithMarkdown(ChatModel* chatModel, const QString& markdownText);
 LlmAgentInterface* createAgent(const QString& apiType);
-void loadWorkspaces(QMap<int, Workspace*>& workspaceMap, QListWidget* workspacesList);
-void saveWorkspaces(const QMap<int, Workspace*>& workspaceMap);
+QString dataDirectory();
+void loadWorkspaces(QMap<int, Workspace*>& workspaceMap, QListWidget* workspacesList, const std::vector<WorkspaceRecord>& records);
+WorkspaceRecord workspaceRecord(const Workspace* workspace);
+// Settings and index metadata of every workspace, without chat histories
+std::vector<WorkspaceRecord> workspaceRecords(const QMap<int, Workspace*>& workspaceMap);
 bool verifyModelStartup(const QString& modelName, std::unordered_map<std::string, bool>& modelStatusMap);
 bool loadModel(const QString& modelName);
 int getNextWorkspaceId(const QMap<int, Workspace*>& workspaceMap);
@@ -0,0 +1,66 @@
+// markdown_renderer.h
+#ifndef MARKDOWN_RENDERER_H
+#define MARKDOWN_RENDERER_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+// Renders the markdown of chat messages to HTML with cmark. Rendering runs on a private thread
+// pool and the HTML is cached per message under a hash of its text, so a message is rendered
+// once however often it is painted or its workspace shown again. The cache is shared by the
+// process, so a reply rendered while it streamed in is not rendered again once it is complete.
+class MarkdownRenderer : public QObject {
+    Q_OBJECT
+
+public:
+    explicit MarkdownRenderer(QObject* parent = nullptr);
+
+    // The cached HTML of the markdown, or a null string after queueing it for rendering;
+    // rendered() follows once it is cached
+    QString html(const QString& markdown);
+
+    // Thread safe; raw HTML in the markdown is left out
+    static QString toHtml(const QString& markdown);
+    static void insert(const QString& markdown, const QString& html);
+
+signals:
+    void rendered();
+
+private:
+    static QByteArray key(const QString& markdown);
+    static void store(const QByteArray& key, const QString& html);
+
+    QSet<QByteArray> pending;
+    QThreadPool pool;
+};
+
+// Renders a reply while it streams in. Text up to the last block the reply has closed is
+// rendered once into closedBlocksHtml(), which only ever grows; trailingHtml() renders the
+// trailing block, which may still change.
+// A blank line ends a block when the next line starts a new one outside any fenced code,
+// list or quote, so splitting there renders the same as the whole text would, short of link
+// references defined further down.
+class MarkdownStream {
+public:
+    void append(const QString& text);
+    QString html() const; // closedBlocksHtml() followed by trailingHtml()
+    const QString& closedBlocksHtml() const { return closedHtml; }
+    QString trailingHtml() const;
+    const QString& markdown() const { return source; }
+
+private:
+    void closeBlocks();
+    static bool startsBlock(const QString& line);
+
+    QString source;
+    QString closedHtml;
+    int closedEnd = 0; // Source before this offset is rendered into closedHtml
+    int scanned = 0;   // Start of the first line not examined yet
+    bool afterBlank = false;
+    QString fence;     // Opening marker of the fenced code being scanned, if any
+};
+
+#endif // MARKDOWN_RENDERER_H
@@ -0,0 +1,51 @@
+// message_compressor.h
+#ifndef MESSAGE_COMPRESSOR_H
+#define MESSAGE_COMPRESSOR_H
+
+#include <QByteArray>
+#include <map>
+#include <vector>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+// Compresses single chat messages with zstd. Messages are too short to compress well on their
+// own, so a dictionary is trained on a sample of them and shared by all; each compressed message
+// records the id of the dictionary it was written with. Compressed messages are
+// [format byte][dictionary id, 4 bytes little-endian][zstd frame].
+// Keeps its compression contexts, so one instance must not be used by two threads at once.
+class MessageCompressor {
+public:
+    static constexpr size_t defaultDictionarySize = 64 * 1024;
+
+    MessageCompressor();
+    ~MessageCompressor();
+    MessageCompressor(const MessageCompressor&) = delete;
+    MessageCompressor& operator=(const MessageCompressor&) = delete;
+
+    // Empty if there are too few samples to train on
+    static QByteArray trainDictionary(const std::vector<QByteArray>& samples, size_t dictionarySize = defaultDictionarySize);
+    // New messages are compressed with the dictionary added last
+    void addDictionary(quint32 id, const QByteArray& dictionary);
+    bool hasDictionary() const;
+
+    // Empty if compressing would not save anything
+    QByteArray compress(const QByteArray& text);
+    bool decompress(const QByteArray& compressed, QByteArray& text);
+    static bool isCompressed(const QByteArray& data);
+
+private:
+    struct Dictionary {
+        ZSTD_CDict_s* compression = nullptr;
+        ZSTD_DDict_s* decompression = nullptr;
+    };
+
+    ZSTD_CCtx_s* compressionContext;
+    ZSTD_DCtx_s* decompressionContext;
+    std::map<quint32, Dictionary> dictionaries;
+    quint32 activeDictionary = 0; // 0 compresses without a dictionary
+};
+
+#endif // MESSAGE_COMPRESSOR_H
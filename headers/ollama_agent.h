@@ -5,6 +5,9 @@
 #include "llm_agent_interface.h"
 #include "ollama_api.h"
 #include <QString>
+#include <future>
+#include <list>
+#include <mutex>
 
 class OllamaAgent : public LlmAgentInterface {
 public:
@@ -16,13 +19,20 @@ public:
     std::vector<std::string> list_running_models() override;
     bool load_model(const std::string& modelName) override;
     void generate(const std::string& modelName, const std::string& prompt, std::function<void(const std::string&)> callback) override;
+    void generateStreaming(const std::string& modelName, const std::string& prompt, ProgressCallback progress,
+                           std::function<void(const std::string&)> callback) override;
     QJsonObject getSettings() const override;
     void setSettings(const QJsonObject& settings) override;
     std::string getAgentType() const override { return "Ollama"; }
+    QJsonArray getContext() const override;
+    void setContext(const QJsonArray& context) override;
 
 private:
     std::string serverURL;
-    static QString markdownToHtml(const QString& markdownText);
+    mutable std::mutex contextMutex; // The context is replaced from the generating thread
+    QJsonArray context;
+    // Replies being generated; declared last so they are joined before the members they use go
+    std::list<std::future<void>> generations;
 };
 
 #endif // OLLAMA_AGENT_H
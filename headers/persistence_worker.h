@@ -0,0 +1,74 @@
+// persistence_worker.h
+#ifndef PERSISTENCE_WORKER_H
+#define PERSISTENCE_WORKER_H
+
+#include <QObject>
+#include <QThread>
+#include <QTimer>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "workspace_store.h"
+
+// Moves all workspace disk I/O off the GUI thread. The store lives on a worker thread: chat
+// messages are inserted as they arrive and settings changes are coalesced for a short window,
+// after which the changed workspace rows are written in one transaction. Only the snapshot
+// provider runs on the GUI thread, and it does not touch the disk.
+class PersistenceWorker : public QObject {
+    Q_OBJECT
+
+public:
+    using SnapshotProvider = std::function<std::vector<WorkspaceRecord>()>;
+    using HistoryCallback = std::function<void(const QVector<QString>& messages)>;
+    using SearchCallback = std::function<void(const std::vector<MessageMatch>& matches, bool finished)>;
+
+    // Takes ownership of store, which is opened on the worker thread by start()
+    PersistenceWorker(WorkspaceStore* store, SnapshotProvider snapshotProvider, QObject* parent = nullptr);
+    ~PersistenceWorker() override; // Drains queued writes, but takes no new snapshot
+
+    void start();
+    std::vector<WorkspaceRecord> loadWorkspaces(); // Blocks until the store has read them
+    void appendMessage(int workspaceId, const QString& message);
+    // Reads up to limit messages before beforePosition on the worker; onLoaded runs on this object's thread
+    void loadHistoryPage(int workspaceId, qint64 beforePosition, int limit, HistoryCallback onLoaded);
+    void forkWorkspace(const WorkspaceRecord& record); // Queued before the branch's first message
+    void removeWorkspace(int workspaceId);
+    void archiveHistory(int workspaceId); // Compresses the workspace's messages on disk
+    // Reads matches newest first on the worker and hands them to onMatches on this object's
+    // thread in batches as they come; starting another search stops this one
+    void streamSearch(const QString& query, int limit, SearchCallback onMatches);
+    void requestSave();
+    // Takes a snapshot now if one is requested and blocks until everything so far is on disk
+    void flush();
+
+signals:
+    // A snapshot's transaction committed, or failed. The store runs in WAL mode with
+    // synchronous = NORMAL, so the last commits before a power loss can still be rolled back;
+    // flush() checkpoints, which syncs them.
+    void saved(quint64 generation, bool ok);
+
+private:
+    struct PendingSnapshot {
+        quint64 generation;
+        std::vector<WorkspaceRecord> records;
+    };
+
+    void takeSnapshot();
+    void writePendingSnapshot(); // Worker thread
+    // Runs task on the worker thread, or right here before start()
+    void runBlocking(const std::function<void()>& task);
+
+    WorkspaceStore* store; // Lives in the worker thread once started
+    SnapshotProvider snapshotProvider;
+    QThread thread;
+    QTimer coalesceTimer;
+    bool saveRequested = false;
+    quint64 generation = 0;
+    std::atomic<quint64> latestSearch{0};
+    std::mutex pendingMutex;
+    std::unique_ptr<PendingSnapshot> pending; // Only the newest unwritten snapshot is kept
+};
+
+#endif // PERSISTENCE_WORKER_H
@@ -0,0 +1,45 @@
+// shard_protocol.h
+#ifndef SHARD_PROTOCOL_H
+#define SHARD_PROTOCOL_H
+
+#include <QByteArray>
+#include <vector>
+#include <hnswlib/hnswlib.h>
+
+// Messages exchanged between ShardedIndex and its ShardWorker processes. Every message is a
+// quint32 payload length followed by a QDataStream payload; vectors travel as raw floats,
+// so all processes must share the same float layout.
+namespace ShardProtocol {
+
+enum class Op : quint8 { Add = 1, Remove = 2, Search = 3, Count = 4 };
+enum class Status : quint8 { Ok = 0, Error = 1 };
+
+// Longest payload accepted; vectors and search results stay far below it
+constexpr quint32 maxPayloadSize = 64 * 1024 * 1024;
+
+struct Request {
+    quint32 id = 0;
+    Op op = Op::Count;
+    quint64 label = 0;         // Add, Remove
+    quint32 k = 0;             // Search
+    std::vector<float> vector; // Add, Search
+};
+
+struct Response {
+    quint32 id = 0;
+    Status status = Status::Ok;
+    quint64 count = 0;                                           // Count
+    std::vector<std::pair<float, hnswlib::labeltype>> neighbors; // Search, closest first
+};
+
+QByteArray encode(const Request& request);
+QByteArray encode(const Response& response);
+// Remove one complete message from the front of buffer; false while it is still incomplete
+bool takeRequest(QByteArray& buffer, Request& request);
+bool takeResponse(QByteArray& buffer, Response& response);
+// True once the message at the front of buffer announces a payload over maxPayloadSize. Nothing
+// can be taken past it, so the connection has to be dropped.
+bool isMalformed(const QByteArray& buffer);
+}
+
+#endif // SHARD_PROTOCOL_H
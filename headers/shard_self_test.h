@@ -0,0 +1,15 @@
+// shard_self_test.h
+#ifndef SHARD_SELF_TEST_H
+#define SHARD_SELF_TEST_H
+
+// Exercises ShardedIndex against real ShardWorker processes of this executable and checks its
+// results against an exact search. Run as
+// "AiRC-LLM --shard-self-test [--shards <n>] [--dim <n>] [--count <n>]"; exits with 0 if every
+// check passed.
+namespace ShardSelfTest {
+
+bool isRequested(int argc, char* argv[]);
+int run(int argc, char* argv[]);
+}
+
+#endif // SHARD_SELF_TEST_H
@@ -0,0 +1,41 @@
+// shard_worker.h
+#ifndef SHARD_WORKER_H
+#define SHARD_WORKER_H
+
+#include <QObject>
+#include <QHash>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <memory>
+#include <hnswlib/hnswlib.h>
+#include "shard_protocol.h"
+
+// Serves one HNSW shard of a ShardedIndex over a local socket. Runs in its own process,
+// started as
+// "AiRC-LLM --shard-worker <server name> [--dim <n>] [--ef <n>] [--exit-with-client]".
+class ShardWorker : public QObject {
+    Q_OBJECT
+
+public:
+    ShardWorker(const QString& serverName, int dim, int ef, QObject* parent = nullptr);
+
+    bool listen();
+
+    static bool isRequested(int argc, char* argv[]);
+    static int run(int argc, char* argv[]);
+
+private:
+    void onNewConnection();
+    void onReadyRead(QLocalSocket* socket);
+    ShardProtocol::Response handle(const ShardProtocol::Request& request);
+
+    QString serverName;
+    int dim;
+    bool exitWithClient = false;
+    QLocalServer server;
+    QHash<QLocalSocket*, QByteArray> buffers;
+    std::unique_ptr<hnswlib::L2Space> space; // Must outlive index
+    std::unique_ptr<hnswlib::HierarchicalNSW<float>> index;
+};
+
+#endif // SHARD_WORKER_H
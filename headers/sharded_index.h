@@ -0,0 +1,69 @@
+// sharded_index.h
+#ifndef SHARDED_INDEX_H
+#define SHARDED_INDEX_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QLocalSocket>
+#include <QProcess>
+#include <QStringList>
+#include <memory>
+#include <vector>
+#include <hnswlib/hnswlib.h>
+#include "shard_protocol.h"
+
+struct ShardedSearchResult {
+    std::vector<std::pair<float, hnswlib::labeltype>> neighbors; // Closest first
+    int answeredShards = 0;
+    int failedShards = 0; // Timed out, disconnected or reported an error
+};
+
+// Splits a vector corpus over ShardWorker processes by label and searches them with
+// scatter-gather. Blocking; use it from one thread.
+class ShardedIndex {
+public:
+    explicit ShardedIndex(int dim);
+    ~ShardedIndex();
+
+    // Starts shardCount worker processes of this executable and connects to them
+    bool startWorkers(int shardCount, int timeoutMs = 5000);
+    // Connects to workers that are already running, e.g. started by hand for testing
+    bool connectToWorkers(const QStringList& serverNames, int timeoutMs = 1000);
+    int getShardCount() const;
+
+    bool addEmbedding(hnswlib::labeltype label, const std::vector<float>& embedding, int timeoutMs = 1000);
+    bool removeEmbedding(hnswlib::labeltype label, int timeoutMs = 1000);
+    ShardedSearchResult search(const std::vector<float>& queryEmbedding, size_t k, int timeoutMs);
+    quint64 getEmbeddingCount(int timeoutMs = 1000);
+
+private:
+    struct Shard {
+        QString serverName;
+        std::unique_ptr<QProcess> process; // Only for workers started by this index
+        std::unique_ptr<QLocalSocket> socket;
+        QByteArray buffer;
+    };
+
+    enum class Poll { Pending, Received, Failed };
+
+    // Polls a waiting shard every few milliseconds while no reply arrives
+    static constexpr int pollIntervalMs = 2;
+
+    bool connectShard(Shard& shard, const QElapsedTimer& timer, int timeoutMs);
+    size_t shardFor(hnswlib::labeltype label) const;
+    quint32 send(Shard& shard, ShardProtocol::Request& request);
+    // Sends request to every shard and collects the replies in any order; each shard is given
+    // timeoutMs from when its request went out. Returns which shards replied.
+    std::vector<bool> scatterGather(ShardProtocol::Request& request, int timeoutMs,
+                                    std::vector<ShardProtocol::Response>& responses);
+    // Takes the reply to requestId if it has arrived, without blocking
+    Poll poll(Shard& shard, quint32 requestId, ShardProtocol::Response& response);
+    bool receive(Shard& shard, quint32 requestId, const QElapsedTimer& timer, int timeoutMs, ShardProtocol::Response& response);
+    void stopWorkers();
+
+    int dim;
+    std::vector<Shard> shards;
+    quint32 nextRequestId = 1;
+};
+
+#endif // SHARDED_INDEX_H
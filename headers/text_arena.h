@@ -0,0 +1,42 @@
+// text_arena.h
+#ifndef TEXT_ARENA_H
+#define TEXT_ARENA_H
+
+#include <QString>
+#include <deque>
+#include <string>
+#include <vector>
+#include <hnswlib/hnswlib.h>
+
+// Stores the texts of a workspace as UTF-8 in one contiguous buffer, addressed by
+// index label. Labels are expected to be handed out in increasing order, which keeps
+// the label -> span table a dense deque instead of a per-entry hash map.
+class TextArena {
+public:
+    void append(hnswlib::labeltype label, const QString& text);
+    bool remove(hnswlib::labeltype label);
+    bool contains(hnswlib::labeltype label) const;
+    QString get(hnswlib::labeltype label) const;
+    std::vector<hnswlib::labeltype> labels() const; // Live labels, oldest first
+    size_t size() const;
+    size_t byteSize() const;
+    void clear();
+
+private:
+    struct Span {
+        size_t offset;
+        unsigned int length;
+        bool live;
+    };
+
+    const Span* findSpan(hnswlib::labeltype label) const;
+    void compactIfNeeded();
+
+    std::string arena;
+    std::deque<Span> spans;
+    hnswlib::labeltype labelBase = 0; // Label of spans.front()
+    size_t liveCount = 0;
+    size_t garbageBytes = 0;
+};
+
+#endif // TEXT_ARENA_H
@@ -8,13 +8,59 @@
 #include <memory>
 #include <vector>
 #include <queue>
+#include <future>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <QStringList>
 #include <hnswlib/hnswlib.h>
+#include "lexical_index.h"
 #include "llm_agent_interface.h"
+#include "text_arena.h"
+
+// One entry returned by Workspace::searchHybrid()
+struct HybridMatch {
+    hnswlib::labeltype label;
+    float score; // Reciprocal-rank fusion score, higher is better
+    QString text;
+};
+
+// One document returned by Workspace::searchDocuments()
+struct DocumentMatch {
+    hnswlib::labeltype documentId;
+    float distance; // Distance of the document's closest chunk
+    QString chunk;  // Text of that chunk
+};
 
 class Workspace {
 public:
+    // Receives range query results in increasing distance; returning false ends the query
+    using RangeResultCallback = std::function<bool(hnswlib::labeltype label, float distance, const QString& text)>;
+    // Computes the query embedding only when searchHybrid() needs it; empty on failure
+    using EmbeddingProvider = std::function<std::vector<float>()>;
+    // How embeddings are indexed; IvfPq keeps compressed codes only, for archives that can give up some recall.
+    // DiskVamana keeps the entries written by saveIndex() in a graph on disk with only their codes in
+    // memory; newer entries wait in the in-memory graph until the next save merges them into the disk one
+    enum class IndexType { Hnsw, IvfPq, DiskVamana };
+
     Workspace(const QString& name, int id, LlmAgentInterface* agent, const QString& apiType);
 
+    // A branch that shares this workspace's history before position and every embedding added so
+    // far; only what is added afterwards is its own. The embeddings are not copied: this workspace's
+    // own entries move into a read-only snapshot that both sides then build on, so later changes on
+    // either side leave the other alone. Takes ownership of agent like the constructor, and starts
+    // it from the server-side context of the reply at the fork point.
+    Workspace fork(const QString& name, int id, LlmAgentInterface* agent, qint64 position);
+    // Whether a fork at position can resume that context; it is only kept for the last few replies
+    bool hasReplyContext(qint64 position) const;
+    // Called before parent, which this workspace was forked from, is deleted; moves the fork
+    // point to the parent's own, whose history the store copies into this workspace
+    void detachFrom(const Workspace& parent);
+    void setForkOrigin(int parentId, qint64 forkPosition);
+    int getParentId() const; // -1 unless this workspace is a branch
+    qint64 getForkPosition() const;
+
     QString getName() const;
     void setName(const QString& name);
     QString getModel() const;
@@ -23,32 +69,154 @@ public:
     QString getApiType() const;
     void setApiType(const QString& apiType);
     void addChatMessage(const QString& message);
-    QVector<QString> getChatHistory() const;
-    QJsonObject toJson() const;
+    QVector<QString> getChatHistory() const; // Only the messages loaded so far, oldest first
+    // The history is paged in from the store, newest first; positions count from the oldest message
+    void setStoredHistorySize(qint64 size);
+    void prependChatHistory(const QVector<QString>& olderMessages, bool reachedOldest = false);
+    qint64 getHistorySize() const;
+    qint64 getLoadedHistoryStart() const; // Position of the oldest loaded message
+    bool hasUnloadedHistory() const;
+    void unloadChatHistory(); // Drops the loaded messages; they are paged in again when needed
+    void markActive();
+    qint64 getLastActive() const; // Milliseconds since the epoch
+    void markArchived();
+    qint64 getArchivedAt() const; // When the history was last compressed on disk, 0 if never
+    QJsonObject toJson(bool includeChatHistory = true) const;
     static Workspace fromJson(const QJsonObject& json, LlmAgentInterface* agent);
     LlmAgentInterface* getAgent() const;
-    void addEmbedding(const std::vector<float>& embedding, const QString& text);
+    hnswlib::labeltype addEmbedding(const std::vector<float>& embedding, const QString& text);
+    bool removeEmbedding(hnswlib::labeltype label);
+    size_t pruneEmbeddings(size_t keepNewest);
+    void clearEmbeddings();
+    size_t getEmbeddingCount() const;
+    const float* getStoredEmbedding(hnswlib::labeltype label) const; // embeddingDim floats owned by the index, nullptr with IvfPq or on disk
+    void setIndexType(IndexType type);
+    IndexType getIndexType() const;
+    QString getText(hnswlib::labeltype label) const;
+    void setCompactionThreshold(double threshold);
+    void setTargetRecall(double recall, size_t k);
+    size_t getSearchEf() const;
+    void setExactSearchThreshold(size_t threshold);
+    // Lets graph searches stop once their best matches have not improved for patience expansions;
+    // 0 (the default) always explores the whole tuned ef
+    void setAdaptiveSearch(size_t patience);
     QString getNearestText(const std::vector<float>& queryEmbedding);
-    void saveIndex(const std::string& filename);
+    // Closest first; safe to call from several threads as long as no entries are added to this
+    // workspace meanwhile
+    std::vector<std::pair<float, hnswlib::labeltype>> searchNearest(const std::vector<float>& queryEmbedding, size_t k,
+                                                                    size_t numThreads = 1) const;
+    size_t searchRange(const std::vector<float>& queryEmbedding, float maxDistance, size_t maxCount,
+                       size_t tokenBudget, const RangeResultCallback& onResult);
+    static size_t estimateTokens(const QString& text);
+    std::vector<LexicalMatch> searchLexical(const QString& query, size_t k) const;
+    std::vector<HybridMatch> searchHybrid(const QString& query, size_t k, const EmbeddingProvider& embedQuery);
+    hnswlib::labeltype addDocument(const std::vector<std::vector<float>>& chunkEmbeddings, const QStringList& chunkTexts);
+    bool removeDocument(hnswlib::labeltype documentId);
+    size_t getDocumentCount() const;
+    std::vector<DocumentMatch> searchDocuments(const std::vector<float>& queryEmbedding, size_t numDocuments);
+    void saveIndex(const std::string& filename); // With DiskVamana, merges the entries added since into the disk graph
     void loadIndex(const std::string& filename);
     std::vector<float> getEmbedding(const std::string& text);
     void saveToFile(const QString& filename) const;
     void loadFromFile(const QString& filename);
     void setUseEmbedding(bool useEmbedding);
     void setEnableStreaming(bool enableStreaming);
-    void streamAddEmbedding(const std::vector<float>& embedding, const QString& text);
+    hnswlib::labeltype streamAddEmbedding(const std::vector<float>& embedding, const QString& text);
 
 private:
+    // Lets the base index of a branch only yield entries that were added before the fork and
+    // not removed in the branch since; chained through every ancestor
+    class InheritedEntryFilter : public hnswlib::BaseFilterFunctor {
+    public:
+        InheritedEntryFilter(hnswlib::labeltype limit, const std::unordered_set<hnswlib::labeltype>& hidden,
+                             hnswlib::BaseFilterFunctor* outer);
+        bool operator()(hnswlib::labeltype label) override;
+
+    private:
+        hnswlib::labeltype limit;
+        const std::unordered_set<hnswlib::labeltype>& hidden;
+        hnswlib::BaseFilterFunctor* outer;
+    };
+
+    Workspace(const QString& name, int id, LlmAgentInterface* agent, const QString& apiType, size_t indexCapacity);
+    std::vector<std::pair<float, hnswlib::labeltype>> searchFiltered(const std::vector<float>& queryEmbedding, size_t k,
+                                                                     size_t numThreads, hnswlib::BaseFilterFunctor* filter) const;
+    bool isInherited(hnswlib::labeltype label) const;
+    bool hasEntry(hnswlib::labeltype label) const;
+    std::vector<hnswlib::labeltype> visibleLabels(hnswlib::labeltype limit) const; // Own and inherited, oldest first
+    bool readEmbedding(hnswlib::labeltype label, float* vector) const;
+    void freezeEntries();
+    // Copies the inherited entries into this workspace's own stores and drops base; moveVectors
+    // is false when they are indexed already, e.g. in a disk graph just written over all of them
+    void detachBase(bool moveVectors = true);
+    void writeDiskIndex(const std::string& filename);
+    void resetIndex(); // An empty graph with the default capacity and the tuned ef
+    static void ensureIndexCapacity(hnswlib::HierarchicalNSW<float>& target, size_t incoming = 1);
+    void scheduleCompaction();
+    void scheduleTuning();
+    void applyTuningResult();
+    void waitForBackgroundTasks();
+    bool useExactSearch() const;
+    static bool lexicalHitsSuffice(const QString& query, const std::vector<LexicalMatch>& hits);
+
     QString name;
     QString model;
     int id;
     LlmAgentInterface* agent;
     QString apiType;
     QVector<QString> chatHistory;
-    std::vector<std::vector<float>> embeddings;
-    std::vector<QString> texts;
+    qint64 historyStart = 0; // Messages before this position are only in the store
+    qint64 lastActive;
+    qint64 archivedAt = 0;
+    int parentId = -1;
+    qint64 forkPosition = 0; // Messages before this are read from the parent's history
+    // Agent context after each of the last few replies, by history position, for forks to resume from
+    std::map<qint64, QJsonArray> replyContexts;
+    // Vectors live only in the index; texts are keyed by the same label, which is never reused
+    TextArena texts;
+    LexicalIndex lexicalIndex; // BM25 over texts, same labels
+    hnswlib::labeltype nextLabel = 0;
+    std::unique_ptr<hnswlib::L2Space> space; // Must outlive index, which keeps a pointer to its parameters
     std::unique_ptr<hnswlib::HierarchicalNSW<float>> index;
+    IndexType indexType = IndexType::Hnsw;
+    std::unique_ptr<hnswlib::IvfPqIndex> archiveIndex; // Holds the entries instead of index with IvfPq
+    std::unique_ptr<hnswlib::DiskVamana> diskIndex; // Entries written by the last saveIndex() with DiskVamana
+    // Entries below baseLabelLimit, frozen when this workspace or its parent was forked and shared
+    // with the other side; never changed once frozen, though a deep chain is folded back into the
+    // own entries before the next fork. Own labels start at the limit
+    std::shared_ptr<const Workspace> base;
+    hnswlib::labeltype baseLabelLimit = 0;
+    // Inherited entries removed in this branch; shared with branches forked from it until either side changes it
+    std::shared_ptr<std::unordered_set<hnswlib::labeltype>> hiddenBaseLabels = std::make_shared<std::unordered_set<hnswlib::labeltype>>();
+    size_t baseDepth = 0; // Frozen layers below this workspace
+    size_t baseEntryCount = 0; // Visible inherited entries
+    // Document chunks are indexed separately, each vector tagged with its document id
+    TextArena documentTexts;
+    hnswlib::labeltype nextChunkLabel = 0;
+    hnswlib::labeltype nextDocumentId = 0;
+    std::unordered_map<hnswlib::labeltype, std::pair<hnswlib::labeltype, hnswlib::labeltype>> documentChunks; // [first, last) chunk labels
+    std::unique_ptr<hnswlib::MultiVectorL2Space<hnswlib::labeltype>> documentSpace;
+    std::unique_ptr<hnswlib::HierarchicalNSW<float>> documentIndex; // Created with the first document
+    size_t deletionsSinceCompaction = 0;
+    double compactionThreshold = 0.2; // Fraction of the index deleted before neighborhoods are rebuilt
+    std::future<void> compactionTask; // Declared after index so it is joined before the index is destroyed
+    // Search ef is re-tuned in the background whenever the index doubles; 0 means not tuned yet
+    size_t searchEf = 0;
+    size_t efConstruction = 200;
+    size_t tunedElementCount = 0;
+    double targetRecall = 0.95;
+    size_t recallK = 10;
+    std::future<hnswlib::EfTuner<float>::Result> tuningTask; // Also searches index, so declared after it
+    // Below this many entries a blocked exact scan is about as fast as the graph and has perfect recall
+    size_t exactSearchThreshold = 8192;
+    size_t adaptivePatience = 0;
+    size_t searchThreads;
     static constexpr int embeddingDim = 128; // Example dimension, adjust as needed
+    static constexpr size_t archiveLists = 256;
+    static constexpr size_t defaultIndexCapacity = 100000;
+    static constexpr size_t branchIndexCapacity = 1024; // Grows like any index; most branches add little
+    static constexpr size_t maxBaseDepth = 4; // Frozen layers before forking folds them into one
+    static constexpr size_t keptReplyContexts = 8;
     bool useEmbedding = true; // Default to true
     bool enableStreaming = true; // Default to true
 };
@@ -0,0 +1,41 @@
+// workspace_search.h
+#ifndef WORKSPACE_SEARCH_H
+#define WORKSPACE_SEARCH_H
+
+#include <QString>
+#include <QThread>
+#include <QThreadPool>
+#include <vector>
+#include "workspace.h"
+
+// One entry of a search across workspaces, attributed to the workspace it came from
+struct WorkspaceSearchHit {
+    int workspaceId;
+    QString workspaceName;
+    hnswlib::labeltype label;
+    float distance;
+    QString text;
+};
+
+struct WorkspaceSearchResult {
+    std::vector<WorkspaceSearchHit> hits; // Closest first
+    size_t searchedWorkspaces = 0;
+    size_t skippedWorkspaces = 0; // Not started before the latency budget ran out
+};
+
+// Fans a query out to many workspace indexes on a thread pool and merges their top-k lists.
+// The workspaces are only read while search() runs, so the caller keeps them alive for that long.
+class WorkspaceSearch {
+public:
+    explicit WorkspaceSearch(int maxThreads = QThread::idealThreadCount());
+
+    // Must be called from the thread that adds entries to the workspaces, which it blocks until
+    // every workspace has answered, or the budget runs out and the searches under way are done
+    WorkspaceSearchResult search(const std::vector<Workspace*>& workspaces, const std::vector<float>& queryEmbedding,
+                                 size_t k, int latencyBudgetMs);
+
+private:
+    QThreadPool pool;
+};
+
+#endif // WORKSPACE_SEARCH_H
@@ -0,0 +1,122 @@
+// workspace_store.h
+#ifndef WORKSPACE_STORE_H
+#define WORKSPACE_STORE_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QJsonObject>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QString>
+#include <QVariant>
+#include <QVector>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include "message_compressor.h"
+
+// One workspace as stored: its settings and index metadata as Workspace::toJson() writes them
+// without the chat history, which is kept one row per message
+struct WorkspaceRecord {
+    int id = 0;
+    QString agentType;
+    QJsonObject json;
+    qint64 messageCount = 0;
+    int parentId = -1;       // Workspace this one was forked from, -1 if none
+    qint64 forkPosition = 0; // Messages before this position are the parent's
+    QVector<QString> messages; // Only used while importing workspaces.json; histories are paged in
+};
+
+// One message found by WorkspaceStore::searchNewestMessages()
+struct MessageMatch {
+    int workspaceId;
+    qint64 position; // Index of the message in the workspace's chat history
+    QString snippet; // Matching terms are wrapped in [ and ]
+};
+
+// SQLite database holding all workspaces, in WAL mode so appending a message is one small
+// transaction instead of a rewrite of every history. Messages are indexed by workspace and
+// mirrored into an FTS5 table for search. A connection can only be used from the thread that
+// opened it, so everything after open() must be called from that thread; PersistenceWorker
+// runs the store on its own thread. A forked workspace stores only the messages added after its
+// fork point and reads the ones before it from its parent, so workspaces form a tree.
+class WorkspaceStore : public QObject {
+    Q_OBJECT
+
+public:
+    // Workspaces found in legacyDirectory (workspaces.json and its journal) are imported once
+    WorkspaceStore(const QString& path, const QString& legacyDirectory, QObject* parent = nullptr);
+    ~WorkspaceStore() override;
+
+    bool open();
+    void close();
+    bool isOpen() const;
+
+    std::vector<WorkspaceRecord> loadWorkspaces(); // Metadata and message counts only
+    // Up to limit messages right before beforePosition, oldest first; those before the fork
+    // point of a branch are read from its ancestors
+    QVector<QString> loadMessages(int workspaceId, qint64 beforePosition, int limit);
+    // Writes the records that changed since they were last saved or loaded, in one transaction
+    bool saveWorkspaces(const std::vector<WorkspaceRecord>& records);
+    // Stores a new branch of record.parentId; nothing of the parent's history is copied
+    bool forkWorkspace(const WorkspaceRecord& record);
+    // Branches of the workspace get a copy of the messages they shared with it
+    bool removeWorkspace(int workspaceId);
+    bool appendMessage(int workspaceId, const QString& message);
+    // Words, "quoted phrases" and prefixes ending in *, all of which must occur. Matches come newest
+    // first, handed to onMatches in batches as they are read; the last batch has fewer than
+    // batchSize matches, possibly none. Returning false stops the search.
+    void searchNewestMessages(const QString& query, int limit, int batchSize,
+                              const std::function<bool(const std::vector<MessageMatch>&)>& onMatches);
+    // Compresses the workspace's plain messages in place; returns the bytes saved. Their search
+    // entries are kept, and loading or searching decompresses them transparently.
+    qint64 archiveHistory(int workspaceId);
+    bool checkpoint(); // Moves the WAL into the database file and syncs it
+
+private:
+    struct ForkOrigin {
+        int parentId;
+        qint64 position;
+    };
+
+    bool createSchema();
+    void createSearchIndex();
+    bool indexStoredMessages(); // Fills a new search index from the messages table
+    bool convertHtmlMessages(); // Rewrites the replies stored as HTML as markdown, in the open transaction
+    static QString markdownFromLegacy(const QString& message); // Unchanged unless it is legacy HTML
+    bool importLegacyWorkspaces();
+    // Upserts the changed rows into the open transaction; written receives their JSON
+    bool writeWorkspaceRows(const std::vector<WorkspaceRecord>& records, std::map<int, QByteArray>& written);
+    // Copies what branchId shares with its parent below the parent's own fork point into it and
+    // hangs it under the grandparent, in the open transaction
+    bool reparentBranch(int branchId, int parentId, const ForkOrigin& parentOrigin, ForkOrigin& moved);
+    // False if onMatch stopped the search
+    bool runSearch(const QString& query, int limit, const std::function<bool(MessageMatch&)>& onMatch);
+    bool exec(const QString& statement);
+    bool prepare(QSqlQuery& query, const QString& statement);
+    bool trainDictionary();
+    QString decodeMessage(const QVariant& value);
+    static bool isCompressedValue(const QVariant& value);
+    static QString makeSnippet(const QString& text, const QStringList& terms);
+    static QByteArray encodeJson(const QJsonObject& json);
+    static QString ftsQuery(const QString& query);
+
+    QString path;
+    QString legacyDirectory;
+    QString connectionName;
+    QSqlDatabase database;
+    bool fullTextSearch = false;
+    // Prepared once; SQLite re-plans nothing on the hot paths
+    std::unique_ptr<QSqlQuery> insertMessage;
+    std::unique_ptr<QSqlQuery> upsertWorkspace;
+    std::unique_ptr<QSqlQuery> selectMessages;
+    std::map<int, qint64> nextPosition;  // Next message position per workspace
+    std::map<int, QByteArray> savedJson; // Last stored JSON per workspace, to skip unchanged rows
+    std::map<int, ForkOrigin> forkOrigins; // Branches only
+    MessageCompressor compressor; // Dictionaries are read on open()
+    bool dictionaryFailed = false; // Retried once enough messages are added since
+    int messagesSinceDictionaryFailure = 0;
+};
+
+#endif // WORKSPACE_STORE_H
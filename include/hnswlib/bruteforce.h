@@ -91,9 +91,9 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
             return;
         }
 
+        size_t cur_c = found->second;
         dict_external_to_internal.erase(found);
 
-        size_t cur_c = found->second;
         labeltype label = *((labeltype*)(data_ + size_per_element_ * (cur_element_count-1) + data_size_));
         dict_external_to_internal[label] = cur_c;
         memcpy(data_ + size_per_element_ * cur_c,
@@ -118,7 +118,7 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
         dist_t lastdist = topResults.empty() ? std::numeric_limits<dist_t>::max() : topResults.top().first;
         for (int i = k; i < cur_element_count; i++) {
             dist_t dist = fstdistfunc_(query_data, data_ + size_per_element_ * i, dist_func_param_);
-            if (dist <= lastdist) {
+            if (dist <= lastdist || topResults.size() < k) {
                 labeltype label = *((labeltype *) (data_ + size_per_element_ * i + data_size_));
                 if ((!isIdAllowed) || (*isIdAllowed)(label)) {
                     topResults.emplace(dist, label);
@@ -135,6 +135,20 @@ class BruteforceSearch : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Exact k-NN for a batch of queries laid out back to back, scanned in cache-sized blocks
+    * on num_threads threads. Like searchKnn, it must not overlap addPoint or removePoint.
+    */
+    std::vector<std::priority_queue<std::pair<dist_t, labeltype >>>
+    searchKnnBatch(const void *queries, size_t num_queries, size_t k, size_t num_threads = 1,
+                   BaseFilterFunctor* isIdAllowed = nullptr) const {
+        std::vector<ElementRun> runs(1, ElementRun{data_, size_per_element_, cur_element_count});
+        return blockedExactSearch<dist_t>(
+            runs, data_size_, queries, num_queries, k, fstdistfunc_, dist_func_param_,
+            [](const char *) { return true; }, isIdAllowed, num_threads);
+    }
+
+
     void saveIndex(const std::string &location) {
         std::ofstream output(location, std::ios::binary);
         std::streampos position;
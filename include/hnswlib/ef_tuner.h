@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+namespace hnswlib {
+///////////////////////////////////////////////////////////
+//
+// Picks the smallest search ef for which an HNSW index reaches
+// a target recall@k. Queries are sampled from the index itself
+// and held out of both the approximate and the exact search;
+// exact neighbors come from a BruteforceSearch over a snapshot
+// of the live elements.
+//
+/////////////////////////////////////////////////////////
+
+template<typename dist_t>
+class EfTuner {
+    class ExcludeLabel : public BaseFilterFunctor {
+        labeltype label_;
+
+     public:
+        explicit ExcludeLabel(labeltype label) : label_(label) {}
+
+        bool operator()(labeltype id) override {
+            return id != label_;
+        }
+    };
+
+    size_t k_;
+    size_t data_size_;
+    size_t ef_construction_;
+    size_t num_elements_;
+    std::unique_ptr<BruteforceSearch<dist_t>> exact_;
+    std::vector<char> queries_;
+    std::vector<labeltype> query_labels_;
+
+ public:
+    struct Result {
+        size_t ef;               // smallest probed ef meeting the target, or the largest probed
+        size_t ef_construction;  // suggested ef_construction for rebuilds of this index
+        float recall;            // recall@k measured at ef
+        size_t num_elements;     // live elements the index had when sampled
+    };
+
+
+    /*
+    * Takes the snapshot of the fully inserted elements, so it may run on another thread while
+    * inserts continue. A deleted element replaced meanwhile can be copied halfway through its
+    * update, which only blurs the ground truth of the queries near it.
+    */
+    EfTuner(const HierarchicalNSW<dist_t> &index, SpaceInterface<dist_t> *space,
+            size_t k = 10, size_t num_queries = 100, unsigned int seed = 100)
+        : k_(k), data_size_(space->get_data_size()), ef_construction_(index.ef_construction_), num_elements_(0) {
+        std::vector<tableint> live;
+        size_t count = index.inserted_count_;
+        live.reserve(count);
+        for (tableint i = 0; i < count; i++) {
+            if (!index.isMarkedDeleted(i))
+                live.push_back(i);
+        }
+        num_elements_ = live.size();
+        if (num_elements_ <= k_)
+            return;
+
+        exact_.reset(new BruteforceSearch<dist_t>(space, num_elements_));
+        for (tableint id : live)
+            exact_->addPoint(index.getDataByInternalId(id), index.getExternalLabel(id));
+
+        // partial Fisher-Yates shuffle picks distinct query elements
+        std::mt19937 rng(seed);
+        num_queries = std::min(num_queries, num_elements_);
+        queries_.resize(num_queries * data_size_);
+        query_labels_.resize(num_queries);
+        for (size_t i = 0; i < num_queries; i++) {
+            std::uniform_int_distribution<size_t> pick(i, live.size() - 1);
+            std::swap(live[i], live[pick(rng)]);
+            memcpy(queries_.data() + i * data_size_, index.getDataByInternalId(live[i]), data_size_);
+            query_labels_[i] = index.getExternalLabel(live[i]);
+        }
+    }
+
+
+    /*
+    * Probes ef = k, then grows it by half each step up to max_ef, and returns the first
+    * value whose recall@k reaches target_recall. With a nonzero patience every probe searches
+    * through an AdaptiveSearchStopCondition capped at that ef, as adaptive searches do.
+    */
+    Result tune(const HierarchicalNSW<dist_t> &index, float target_recall = 0.95f, size_t max_ef = 1024,
+                size_t patience = 0) const {
+        Result result{k_, std::max(ef_construction_, k_), 1.0f, num_elements_};
+        if (!exact_)
+            return result;  // every element is a neighbor, any ef >= k is exact
+
+        size_t num_queries = query_labels_.size();
+        std::vector<std::unordered_set<labeltype>> ground_truth(num_queries);
+        size_t total = 0;
+        for (size_t i = 0; i < num_queries; i++) {
+            ExcludeLabel held_out(query_labels_[i]);
+            auto exact = exact_->searchKnn(queries_.data() + i * data_size_, k_, &held_out);
+            while (!exact.empty()) {
+                ground_truth[i].insert(exact.top().second);
+                exact.pop();
+            }
+            total += ground_truth[i].size();
+        }
+        if (total == 0)
+            return result;
+
+        for (size_t ef = k_; ; ef = std::min(max_ef, ef + std::max<size_t>(1, ef / 2))) {
+            size_t found = 0;
+            for (size_t i = 0; i < num_queries; i++) {
+                ExcludeLabel held_out(query_labels_[i]);
+                const void *query = queries_.data() + i * data_size_;
+                if (patience != 0) {
+                    AdaptiveSearchStopCondition<dist_t> stop_condition(k_, ef, patience);
+                    for (const auto &approx : index.searchStopConditionClosest(query, stop_condition, &held_out))
+                        found += ground_truth[i].count(approx.second);
+                    continue;
+                }
+                auto approx = index.searchKnnEf(query, k_, ef, &held_out);
+                while (!approx.empty()) {
+                    found += ground_truth[i].count(approx.top().second);
+                    approx.pop();
+                }
+            }
+            result.ef = ef;
+            result.recall = (float) found / total;
+            if (result.recall >= target_recall || ef >= max_ef)
+                break;
+        }
+        // Rebuilt graphs should be explored at construction at least as widely as searches need
+        result.ef_construction = std::max(ef_construction_, result.ef);
+        return result;
+    }
+};
+}  // namespace hnswlib
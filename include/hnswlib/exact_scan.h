@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <queue>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+namespace hnswlib {
+///////////////////////////////////////////////////////////
+//
+// Blocked exact k-NN scan shared by the indexes.
+// Elements are visited in blocks small enough to stay in
+// cache while a whole batch of queries is compared against
+// them, so each block is read from memory once per batch.
+// Blocks are handed out to worker threads that keep their
+// own result heaps, merged once at the end.
+//
+/////////////////////////////////////////////////////////
+
+/*
+* A run of equally spaced elements: the vector of element i starts at data + i * stride and
+* is directly followed by its label.
+*/
+struct ElementRun {
+    const char *data;
+    size_t stride;
+    size_t count;
+};
+
+
+/*
+* is_live(const char *element_data) tells whether an element takes part in the search; it is
+* only asked for elements that would enter a result heap.
+*/
+template<typename dist_t, typename IsLive>
+std::vector<std::priority_queue<std::pair<dist_t, labeltype>>>
+blockedExactSearch(
+    const std::vector<ElementRun> &runs,
+    size_t data_size,
+    const void *queries,
+    size_t num_queries,
+    size_t k,
+    DISTFUNC<dist_t> dist_func,
+    const void *dist_func_param,
+    IsLive is_live,
+    BaseFilterFunctor *isIdAllowed = nullptr,
+    size_t num_threads = 1,
+    size_t block_size = 256,
+    size_t query_batch = 8) {
+    typedef std::priority_queue<std::pair<dist_t, labeltype>> ResultHeap;
+    // below this many elements per worker, starting threads costs more than it saves
+    const size_t MIN_ELEMENTS_PER_THREAD = 4096;
+
+    struct Block {
+        const ElementRun *run;
+        size_t begin;
+        size_t end;
+    };
+    std::vector<Block> blocks;
+    size_t total = 0;
+    for (const ElementRun &run : runs) {
+        for (size_t begin = 0; begin < run.count; begin += block_size)
+            blocks.push_back({&run, begin, std::min(run.count, begin + block_size)});
+        total += run.count;
+    }
+
+    const char *query_data = (const char *) queries;
+    std::atomic<size_t> next_block{0};
+    auto worker = [&](std::vector<ResultHeap> &heaps) {
+        size_t b;
+        while ((b = next_block.fetch_add(1)) < blocks.size()) {
+            const Block &block = blocks[b];
+            for (size_t q0 = 0; q0 < num_queries; q0 += query_batch) {
+                size_t q1 = std::min(num_queries, q0 + query_batch);
+                for (size_t i = block.begin; i < block.end; i++) {
+                    const char *element = block.run->data + i * block.run->stride;
+                    for (size_t q = q0; q < q1; q++) {
+                        ResultHeap &heap = heaps[q];
+                        dist_t dist = dist_func(query_data + q * data_size, element, dist_func_param);
+                        if (heap.size() >= k && dist >= heap.top().first)
+                            continue;
+                        if (!is_live(element))
+                            continue;
+                        labeltype label;
+                        memcpy(&label, element + data_size, sizeof(labeltype));
+                        if (isIdAllowed && !(*isIdAllowed)(label))
+                            continue;
+                        heap.emplace(dist, label);
+                        if (heap.size() > k)
+                            heap.pop();
+                    }
+                }
+            }
+        }
+    };
+
+    num_threads = std::max<size_t>(1, std::min(num_threads, total / MIN_ELEMENTS_PER_THREAD));
+    std::vector<std::vector<ResultHeap>> partial(num_threads, std::vector<ResultHeap>(num_queries));
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; t++)
+        threads.emplace_back(worker, std::ref(partial[t]));
+    worker(partial[0]);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    std::vector<ResultHeap> &result = partial[0];
+    for (size_t t = 1; t < num_threads; t++) {
+        for (size_t q = 0; q < num_queries; q++) {
+            ResultHeap &heap = partial[t][q];
+            while (!heap.empty()) {
+                result[q].push(heap.top());
+                heap.pop();
+                if (result[q].size() > k)
+                    result[q].pop();
+            }
+        }
+    }
+    return std::move(result);
+}
+}  // namespace hnswlib
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "visited_list_pool.h"
+#include "label_lookup.h"
 #include "hnswlib.h"
 #include <atomic>
 #include <random>
@@ -9,6 +10,7 @@
 #include <unordered_set>
 #include <list>
 #include <memory>
+#include <thread>
 
 namespace hnswlib {
 typedef unsigned int tableint;
@@ -19,9 +21,14 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
  public:
     static const tableint MAX_LABEL_OPERATION_LOCKS = 65536;
     static const unsigned char DELETE_MARK = 0x01;
+    static const size_t MIN_SEGMENT_BITS = 10;
+    static const size_t MAX_SEGMENT_BITS = 14;
 
-    size_t max_elements_{0};
+    std::atomic<size_t> max_elements_{0};
     mutable std::atomic<size_t> cur_element_count{0};  // current number of elements
+    // Elements below this id are fully inserted. Ids are reserved in cur_element_count before
+    // their data, label and links are written, so code walking elements while inserts run stops here.
+    std::atomic<size_t> inserted_count_{0};
     size_t size_data_per_element_{0};
     size_t size_links_per_element_{0};
     mutable std::atomic<size_t> num_deleted_{0};  // number of deleted elements
@@ -40,24 +47,58 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     mutable std::vector<std::mutex> label_op_locks_;
 
     std::mutex global;
-    std::vector<std::mutex> link_list_locks_;
 
     tableint enterpoint_node_{0};
 
     size_t size_links_level0_{0};
     size_t offsetData_{0}, offsetLevel0_{0}, label_offset_{ 0 };
 
-    char *data_level0_memory_{nullptr};
-    char **linkLists_{nullptr};
-    std::vector<int> element_levels_;  // keeps level of each element
+    /*
+    * Storage for a contiguous range of 2^segment_bits_ internal ids. Segments are
+    * allocated on demand and never move, so growing the index does not invalidate
+    * anything held by concurrent searches and inserts.
+    */
+    struct ElementSegment {
+        char *data_level0{nullptr};  // level 0 links, data and label of each element
+        std::unique_ptr<char *[]> link_lists;  // upper level link lists of each element
+        std::unique_ptr<int[]> element_levels;  // keeps level of each element
+        std::unique_ptr<std::mutex[]> link_list_locks;
+
+        // Per-element sequence counters guarding the link lists for lock-free readers.
+        // A writer (holding the element's link list lock) makes the counter odd while it
+        // rewrites the lists of that element and even again when done, so readers can
+        // copy a list optimistically and retry if the counter moved underneath them.
+        std::unique_ptr<std::atomic<unsigned int>[]> link_list_versions;
+
+        // Set once an element is fully inserted, see publishElement()
+        std::unique_ptr<std::atomic<bool>[]> element_inserted;
+
+        ~ElementSegment() {
+            free(data_level0);
+        }
+    };
+
+    /*
+    * Fixed-capacity table of segment pointers. When it fills up a larger copy is
+    * published and the old one is kept alive until clear(), so readers never need a lock.
+    */
+    struct SegmentDirectory {
+        size_t capacity{0};
+        std::unique_ptr<std::atomic<ElementSegment *>[]> segments;
+    };
+
+    size_t segment_bits_{0};
+    size_t segment_mask_{0};
+    std::mutex segments_lock_;  // serializes segment and directory allocation
+    std::atomic<SegmentDirectory *> segment_directory_{nullptr};
+    std::vector<std::unique_ptr<SegmentDirectory>> segment_directories_;  // current and retired directories
 
     size_t data_size_{0};
 
     DISTFUNC<dist_t> fstdistfunc_;
     void *dist_func_param_{nullptr};
 
-    mutable std::mutex label_lookup_lock;  // lock for label_lookup_
-    std::unordered_map<labeltype, tableint> label_lookup_;
+    ShardedLabelMap<labeltype, tableint> label_lookup_;  // internally locked per shard
 
     std::default_random_engine level_generator_;
     std::default_random_engine update_probability_generator_;
@@ -94,8 +135,6 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         size_t random_seed = 100,
         bool allow_replace_deleted = false)
         : label_op_locks_(MAX_LABEL_OPERATION_LOCKS),
-            link_list_locks_(max_elements),
-            element_levels_(max_elements),
             allow_replace_deleted_(allow_replace_deleted) {
         max_elements_ = max_elements;
         num_deleted_ = 0;
@@ -123,11 +162,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         label_offset_ = size_links_level0_ + data_size_;
         offsetLevel0_ = 0;
 
-        data_level0_memory_ = (char *) malloc(max_elements_ * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory");
+        initSegments(max_elements);
 
         cur_element_count = 0;
+        inserted_count_ = 0;
 
         visited_list_pool_ = std::unique_ptr<VisitedListPool>(new VisitedListPool(1, max_elements));
 
@@ -135,9 +173,6 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         enterpoint_node_ = -1;
         maxlevel_ = -1;
 
-        linkLists_ = (char **) malloc(sizeof(void *) * max_elements_);
-        if (linkLists_ == nullptr)
-            throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate linklists");
         size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
         mult_ = 1 / log(1.0 * M_);
         revSize_ = 1.0 / mult_;
@@ -149,19 +184,161 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
     void clear() {
-        free(data_level0_memory_);
-        data_level0_memory_ = nullptr;
-        for (tableint i = 0; i < cur_element_count; i++) {
-            if (element_levels_[i] > 0)
-                free(linkLists_[i]);
+        SegmentDirectory *directory = segment_directory_.load();
+        if (directory) {
+            // walks the segments rather than the ids, so a load or insert that failed halfway is freed too
+            size_t segment_size = segment_mask_ + 1;
+            for (size_t i = 0; i < directory->capacity; i++) {
+                ElementSegment *segment = directory->segments[i].load();
+                if (segment == nullptr)
+                    continue;
+                for (size_t j = 0; j < segment_size; j++)
+                    free(segment->link_lists[j]);
+                delete segment;
+            }
         }
-        free(linkLists_);
-        linkLists_ = nullptr;
+        segment_directory_ = nullptr;
+        segment_directories_.clear();
         cur_element_count = 0;
+        inserted_count_ = 0;
         visited_list_pool_.reset(nullptr);
     }
 
 
+    /*
+    * Sets up an empty segment directory sized for max_elements. Segment size is picked
+    * so small indexes do not over-allocate and large ones do not need many segments.
+    */
+    void initSegments(size_t max_elements) {
+        segment_bits_ = MIN_SEGMENT_BITS;
+        while (segment_bits_ < MAX_SEGMENT_BITS && ((size_t) 1 << segment_bits_) < max_elements)
+            segment_bits_++;
+        segment_mask_ = ((size_t) 1 << segment_bits_) - 1;
+
+        std::unique_ptr<SegmentDirectory> directory(new SegmentDirectory());
+        directory->capacity = std::max<size_t>(1, (max_elements + segment_mask_) >> segment_bits_);
+        directory->segments.reset(new std::atomic<ElementSegment *>[directory->capacity]);
+        for (size_t i = 0; i < directory->capacity; i++)
+            directory->segments[i] = nullptr;
+        segment_directory_ = directory.get();
+        segment_directories_.clear();
+        segment_directories_.push_back(std::move(directory));
+    }
+
+
+    /*
+    * Makes sure the segment holding internal_id exists, growing the directory if needed.
+    * Cheap when the segment is already there; allocation only serializes with other allocations.
+    */
+    void ensureSegment(tableint internal_id) {
+        size_t segment_id = internal_id >> segment_bits_;
+        SegmentDirectory *directory = segment_directory_.load(std::memory_order_acquire);
+        if (segment_id < directory->capacity && directory->segments[segment_id].load(std::memory_order_acquire))
+            return;
+
+        std::unique_lock <std::mutex> lock(segments_lock_);
+        directory = segment_directory_.load(std::memory_order_acquire);
+        if (segment_id >= directory->capacity) {
+            std::unique_ptr<SegmentDirectory> grown(new SegmentDirectory());
+            grown->capacity = std::max(directory->capacity * 2, segment_id + 1);
+            grown->segments.reset(new std::atomic<ElementSegment *>[grown->capacity]);
+            for (size_t i = 0; i < grown->capacity; i++)
+                grown->segments[i] = i < directory->capacity ? directory->segments[i].load() : nullptr;
+            directory = grown.get();
+            segment_directories_.push_back(std::move(grown));
+            segment_directory_.store(directory, std::memory_order_release);
+        }
+        if (directory->segments[segment_id].load(std::memory_order_acquire))
+            return;
+
+        size_t segment_size = segment_mask_ + 1;
+        std::unique_ptr<ElementSegment> segment(new ElementSegment());
+        segment->data_level0 = (char *) malloc(segment_size * size_data_per_element_);
+        if (segment->data_level0 == nullptr)
+            throw std::runtime_error("Not enough memory: HierarchicalNSW failed to allocate segment");
+        segment->link_lists.reset(new char *[segment_size]());
+        segment->element_levels.reset(new int[segment_size]());
+        segment->link_list_locks.reset(new std::mutex[segment_size]);
+        segment->link_list_versions.reset(new std::atomic<unsigned int>[segment_size]());
+        segment->element_inserted.reset(new std::atomic<bool>[segment_size]());
+        directory->segments[segment_id].store(segment.release(), std::memory_order_release);
+    }
+
+
+    inline ElementSegment &getSegment(tableint internal_id) const {
+        return *segment_directory_.load(std::memory_order_acquire)->segments[internal_id >> segment_bits_].load(std::memory_order_acquire);
+    }
+
+
+    inline char *getElementBlock(tableint internal_id) const {
+        return getSegment(internal_id).data_level0 + (internal_id & segment_mask_) * size_data_per_element_;
+    }
+
+
+    inline int getElementLevel(tableint internal_id) const {
+        return getSegment(internal_id).element_levels[internal_id & segment_mask_];
+    }
+
+
+    inline void setElementLevel(tableint internal_id, int level) const {
+        getSegment(internal_id).element_levels[internal_id & segment_mask_] = level;
+    }
+
+
+    inline char *&getLinkLists(tableint internal_id) const {
+        return getSegment(internal_id).link_lists[internal_id & segment_mask_];
+    }
+
+
+    inline std::mutex &getLinkListMutex(tableint internal_id) const {
+        return getSegment(internal_id).link_list_locks[internal_id & segment_mask_];
+    }
+
+
+    inline std::atomic<unsigned int> &getLinkListVersion(tableint internal_id) const {
+        return getSegment(internal_id).link_list_versions[internal_id & segment_mask_];
+    }
+
+
+    inline bool isInserted(tableint internal_id) const {
+        return getSegment(internal_id).element_inserted[internal_id & segment_mask_].load();
+    }
+
+
+    /*
+    * Marks an element as fully inserted and moves inserted_count_ past every inserted id
+    * that follows it. Inserts finish out of order, so whichever of them completes the run
+    * advances the count; the flag is stored before the count is read, so none is left behind.
+    */
+    void publishElement(tableint internal_id) {
+        getSegment(internal_id).element_inserted[internal_id & segment_mask_].store(true);
+        size_t count = inserted_count_.load();
+        while (count < cur_element_count.load() && isInserted(count)) {
+            if (inserted_count_.compare_exchange_weak(count, count + 1))
+                count++;
+        }
+    }
+
+
+    /*
+    * Publishes an element when its insert returns or throws, so an insert that failed
+    * halfway does not hold back inserted_count_ for every element after it.
+    */
+    class InsertGuard {
+     public:
+        InsertGuard(HierarchicalNSW &index, tableint internal_id) : index_(index), internal_id_(internal_id) {
+        }
+
+        ~InsertGuard() {
+            index_.publishElement(internal_id_);
+        }
+
+     private:
+        HierarchicalNSW &index_;
+        tableint internal_id_;
+    };
+
+
     struct CompareByFirst {
         constexpr bool operator()(std::pair<dist_t, tableint> const& a,
             std::pair<dist_t, tableint> const& b) const noexcept {
@@ -184,23 +361,67 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     inline labeltype getExternalLabel(tableint internal_id) const {
         labeltype return_label;
-        memcpy(&return_label, (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), sizeof(labeltype));
+        memcpy(&return_label, (getElementBlock(internal_id) + label_offset_), sizeof(labeltype));
         return return_label;
     }
 
 
     inline void setExternalLabel(tableint internal_id, labeltype label) const {
-        memcpy((data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_), &label, sizeof(labeltype));
+        memcpy((getElementBlock(internal_id) + label_offset_), &label, sizeof(labeltype));
     }
 
 
     inline labeltype *getExternalLabeLp(tableint internal_id) const {
-        return (labeltype *) (data_level0_memory_ + internal_id * size_data_per_element_ + label_offset_);
+        return (labeltype *) (getElementBlock(internal_id) + label_offset_);
     }
 
 
     inline char *getDataByInternalId(tableint internal_id) const {
-        return (data_level0_memory_ + internal_id * size_data_per_element_ + offsetData_);
+        return (getElementBlock(internal_id) + offsetData_);
+    }
+
+
+    /*
+    * Marks the link lists of an element as being rewritten for the duration of its scope.
+    * Must be used while holding the link list mutex of the element, so writers never overlap.
+    */
+    class LinkListWriteGuard {
+     public:
+        explicit LinkListWriteGuard(std::atomic<unsigned int> &version) : version_(version) {
+            version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        ~LinkListWriteGuard() {
+            version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+     private:
+        std::atomic<unsigned int> &version_;
+    };
+
+
+    /*
+    * Copies the link list of an element at the given level into buffer without taking
+    * the link list mutex. Retries while a writer is active or if the list changed during the copy.
+    * buffer must hold maxM0_ entries for level 0 and maxM_ otherwise. Returns the number of neighbors copied.
+    */
+    size_t readLinkListOptimistic(tableint internal_id, int level, tableint *buffer) const {
+        const std::atomic<unsigned int> &version = getLinkListVersion(internal_id);
+        size_t max_size = level ? maxM_ : maxM0_;
+        while (true) {
+            unsigned int version_before = version.load(std::memory_order_acquire);
+            if (version_before & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            linklistsizeint *ll = get_linklist_at_level(internal_id, level);
+            size_t size = std::min<size_t>(getListCount(ll), max_size);
+            memcpy(buffer, ll + 1, size * sizeof(tableint));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) == version_before)
+                return size;
+        }
     }
 
 
@@ -230,6 +451,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidateSet;
+        std::vector<tableint> neighbors(maxM0_ + 1);
 
         dist_t lowerBound;
         if (!isMarkedDeleted(ep_id)) {
@@ -252,20 +474,14 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
             tableint curNodeNum = curr_el_pair.second;
 
-            std::unique_lock <std::mutex> lock(link_list_locks_[curNodeNum]);
-
-            int *data;  // = (int *)(linkList0_ + curNodeNum * size_links_per_element0_);
-            if (layer == 0) {
-                data = (int*)get_linklist0(curNodeNum);
-            } else {
-                data = (int*)get_linklist(curNodeNum, layer);
-//                    data = (int *) (linkLists_[curNodeNum] + (layer - 1) * size_links_per_element_);
-            }
-            size_t size = getListCount((linklistsizeint*)data);
-            tableint *datal = (tableint *) (data + 1);
+            size_t size = readLinkListOptimistic(curNodeNum, layer, neighbors.data());
+            if (size == 0)
+                continue;
+            tableint *datal = neighbors.data();
+            datal[size] = datal[size - 1];
 #ifdef USE_SSE
-            _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-            _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
+            _mm_prefetch((char *) (visited_array + *datal), _MM_HINT_T0);
+            _mm_prefetch((char *) (visited_array + *datal + 64), _MM_HINT_T0);
             _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
             _mm_prefetch(getDataByInternalId(*(datal + 1)), _MM_HINT_T0);
 #endif
@@ -277,6 +493,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 _mm_prefetch((char *) (visited_array + *(datal + j + 1)), _MM_HINT_T0);
                 _mm_prefetch(getDataByInternalId(*(datal + j + 1)), _MM_HINT_T0);
 #endif
+                if (candidate_id >= vl->numelements) continue;  // inserted after a concurrent resizeIndex
                 if (visited_array[candidate_id] == visited_array_tag) continue;
                 visited_array[candidate_id] = visited_array_tag;
                 char *currObj1 = (getDataByInternalId(candidate_id));
@@ -320,6 +537,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> top_candidates;
         std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> candidate_set;
+        std::vector<tableint> neighbors(maxM0_ + 1);
 
         dist_t lowerBound;
         if (bare_bone_search || 
@@ -359,29 +577,31 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             candidate_set.pop();
 
             tableint current_node_id = current_node_pair.second;
-            int *data = (int *) get_linklist0(current_node_id);
-            size_t size = getListCount((linklistsizeint*)data);
+            size_t size = readLinkListOptimistic(current_node_id, 0, neighbors.data());
 //                bool cur_node_deleted = isMarkedDeleted(current_node_id);
             if (collect_metrics) {
                 metric_hops++;
                 metric_distance_computations+=size;
             }
+            if (size == 0)
+                continue;
+            tableint *data = neighbors.data();
+            data[size] = data[size - 1];
 
 #ifdef USE_SSE
-            _mm_prefetch((char *) (visited_array + *(data + 1)), _MM_HINT_T0);
-            _mm_prefetch((char *) (visited_array + *(data + 1) + 64), _MM_HINT_T0);
-            _mm_prefetch(data_level0_memory_ + (*(data + 1)) * size_data_per_element_ + offsetData_, _MM_HINT_T0);
-            _mm_prefetch((char *) (data + 2), _MM_HINT_T0);
+            _mm_prefetch((char *) (visited_array + *data), _MM_HINT_T0);
+            _mm_prefetch((char *) (visited_array + *data + 64), _MM_HINT_T0);
+            _mm_prefetch(getDataByInternalId(*data), _MM_HINT_T0);
 #endif
 
-            for (size_t j = 1; j <= size; j++) {
-                int candidate_id = *(data + j);
+            for (size_t j = 0; j < size; j++) {
+                tableint candidate_id = *(data + j);
 //                    if (candidate_id == 0) continue;
 #ifdef USE_SSE
                 _mm_prefetch((char *) (visited_array + *(data + j + 1)), _MM_HINT_T0);
-                _mm_prefetch(data_level0_memory_ + (*(data + j + 1)) * size_data_per_element_ + offsetData_,
-                                _MM_HINT_T0);  ////////////
+                _mm_prefetch(getDataByInternalId(*(data + j + 1)), _MM_HINT_T0);  ////////////
 #endif
+                if (candidate_id >= vl->numelements) continue;  // inserted after a concurrent resizeIndex
                 if (!(visited_array[candidate_id] == visited_array_tag)) {
                     visited_array[candidate_id] = visited_array_tag;
 
@@ -398,9 +618,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     if (flag_consider_candidate) {
                         candidate_set.emplace(-dist, candidate_id);
 #ifdef USE_SSE
-                        _mm_prefetch(data_level0_memory_ + candidate_set.top().second * size_data_per_element_ +
-                                        offsetLevel0_,  ///////////
-                                        _MM_HINT_T0);  ////////////////////////
+                        _mm_prefetch((char *) get_linklist0(candidate_set.top().second), _MM_HINT_T0);  ////////////////////////
 #endif
 
                         if (bare_bone_search || 
@@ -484,17 +702,12 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
 
     linklistsizeint *get_linklist0(tableint internal_id) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
-    }
-
-
-    linklistsizeint *get_linklist0(tableint internal_id, char *data_level0_memory_) const {
-        return (linklistsizeint *) (data_level0_memory_ + internal_id * size_data_per_element_ + offsetLevel0_);
+        return (linklistsizeint *) (getElementBlock(internal_id) + offsetLevel0_);
     }
 
 
     linklistsizeint *get_linklist(tableint internal_id, int level) const {
-        return (linklistsizeint *) (linkLists_[internal_id] + (level - 1) * size_links_per_element_);
+        return (linklistsizeint *) (getLinkLists(internal_id) + (level - 1) * size_links_per_element_);
     }
 
 
@@ -526,10 +739,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         {
             // lock only during the update
             // because during the addition the lock for cur_c is already acquired
-            std::unique_lock <std::mutex> lock(link_list_locks_[cur_c], std::defer_lock);
+            std::unique_lock <std::mutex> lock(getLinkListMutex(cur_c), std::defer_lock);
             if (isUpdate) {
                 lock.lock();
             }
+            LinkListWriteGuard write_guard(getLinkListVersion(cur_c));
             linklistsizeint *ll_cur;
             if (level == 0)
                 ll_cur = get_linklist0(cur_c);
@@ -544,7 +758,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
                 if (data[idx] && !isUpdate)
                     throw std::runtime_error("Possible memory corruption");
-                if (level > element_levels_[selectedNeighbors[idx]])
+                if (level > getElementLevel(selectedNeighbors[idx]))
                     throw std::runtime_error("Trying to make a link on a non-existent level");
 
                 data[idx] = selectedNeighbors[idx];
@@ -552,7 +766,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         }
 
         for (size_t idx = 0; idx < selectedNeighbors.size(); idx++) {
-            std::unique_lock <std::mutex> lock(link_list_locks_[selectedNeighbors[idx]]);
+            std::unique_lock <std::mutex> lock(getLinkListMutex(selectedNeighbors[idx]));
+            LinkListWriteGuard write_guard(getLinkListVersion(selectedNeighbors[idx]));
 
             linklistsizeint *ll_other;
             if (level == 0)
@@ -566,7 +781,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 throw std::runtime_error("Bad value of sz_link_list_other");
             if (selectedNeighbors[idx] == cur_c)
                 throw std::runtime_error("Trying to connect an element to itself");
-            if (level > element_levels_[selectedNeighbors[idx]])
+            if (level > getElementLevel(selectedNeighbors[idx]))
                 throw std::runtime_error("Trying to make a link on a non-existent level");
 
             tableint *data = (tableint *) (ll_other + 1);
@@ -630,28 +845,18 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Changes the element limit. Storage is appended segment by segment as elements are
+    * added, so nothing is reallocated here and it is safe to call while searches and
+    * inserts are running.
+    */
     void resizeIndex(size_t new_max_elements) {
         if (new_max_elements < cur_element_count)
             throw std::runtime_error("Cannot resize, max element is less than the current number of elements");
 
-        visited_list_pool_.reset(new VisitedListPool(1, new_max_elements));
-
-        element_levels_.resize(new_max_elements);
-
-        std::vector<std::mutex>(new_max_elements).swap(link_list_locks_);
-
-        // Reallocate base layer
-        char * data_level0_memory_new = (char *) realloc(data_level0_memory_, new_max_elements * size_data_per_element_);
-        if (data_level0_memory_new == nullptr)
-            throw std::runtime_error("Not enough memory: resizeIndex failed to allocate base layer");
-        data_level0_memory_ = data_level0_memory_new;
-
-        // Reallocate all other layers
-        char ** linkLists_new = (char **) realloc(linkLists_, sizeof(void *) * new_max_elements);
-        if (linkLists_new == nullptr)
-            throw std::runtime_error("Not enough memory: resizeIndex failed to allocate other layers");
-        linkLists_ = linkLists_new;
-
+        std::unique_lock <std::mutex> lock(segments_lock_);
+        // visited lists must cover every id below the new limit before inserts can use it
+        visited_list_pool_->setNumElements(new_max_elements);
         max_elements_ = new_max_elements;
     }
 
@@ -672,10 +877,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         size += sizeof(mult_);
         size += sizeof(ef_construction_);
 
-        size += cur_element_count * size_data_per_element_;
+        size_t element_count = inserted_count_;
+        size += element_count * size_data_per_element_;
 
-        for (size_t i = 0; i < cur_element_count; i++) {
-            unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
+        for (size_t i = 0; i < element_count; i++) {
+            unsigned int linkListSize = getElementLevel(i) > 0 ? size_links_per_element_ * getElementLevel(i) : 0;
             size += sizeof(linkListSize);
             size += linkListSize;
         }
@@ -687,8 +893,9 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         std::streampos position;
 
         writeBinaryPOD(output, offsetLevel0_);
+        size_t element_count = inserted_count_;
         writeBinaryPOD(output, max_elements_);
-        writeBinaryPOD(output, cur_element_count);
+        writeBinaryPOD(output, element_count);
         writeBinaryPOD(output, size_data_per_element_);
         writeBinaryPOD(output, label_offset_);
         writeBinaryPOD(output, offsetData_);
@@ -701,13 +908,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         writeBinaryPOD(output, mult_);
         writeBinaryPOD(output, ef_construction_);
 
-        output.write(data_level0_memory_, cur_element_count * size_data_per_element_);
+        // level 0 is stored contiguously on disk, one chunk per segment
+        for (size_t i = 0; i < element_count; i += segment_mask_ + 1) {
+            size_t chunk = std::min(segment_mask_ + 1, element_count - i);
+            output.write(getElementBlock(i), chunk * size_data_per_element_);
+        }
 
-        for (size_t i = 0; i < cur_element_count; i++) {
-            unsigned int linkListSize = element_levels_[i] > 0 ? size_links_per_element_ * element_levels_[i] : 0;
+        for (size_t i = 0; i < element_count; i++) {
+            unsigned int linkListSize = getElementLevel(i) > 0 ? size_links_per_element_ * getElementLevel(i) : 0;
             writeBinaryPOD(output, linkListSize);
             if (linkListSize)
-                output.write(linkLists_[i], linkListSize);
+                output.write(getLinkLists(i), linkListSize);
         }
         output.close();
     }
@@ -774,40 +985,41 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
         input.seekg(pos, input.beg);
 
-        data_level0_memory_ = (char *) malloc(max_elements * size_data_per_element_);
-        if (data_level0_memory_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate level0");
-        input.read(data_level0_memory_, cur_element_count * size_data_per_element_);
+        initSegments(max_elements);
+        for (size_t i = 0; i < cur_element_count; i += segment_mask_ + 1) {
+            size_t chunk = std::min<size_t>(segment_mask_ + 1, cur_element_count - i);
+            ensureSegment(i);
+            input.read(getElementBlock(i), chunk * size_data_per_element_);
+        }
 
         size_links_per_element_ = maxM_ * sizeof(tableint) + sizeof(linklistsizeint);
 
         size_links_level0_ = maxM0_ * sizeof(tableint) + sizeof(linklistsizeint);
-        std::vector<std::mutex>(max_elements).swap(link_list_locks_);
         std::vector<std::mutex>(MAX_LABEL_OPERATION_LOCKS).swap(label_op_locks_);
 
         visited_list_pool_.reset(new VisitedListPool(1, max_elements));
 
-        linkLists_ = (char **) malloc(sizeof(void *) * max_elements);
-        if (linkLists_ == nullptr)
-            throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklists");
-        element_levels_ = std::vector<int>(max_elements);
+        label_lookup_.clear();
+        label_lookup_.reserve(cur_element_count);
         revSize_ = 1.0 / mult_;
         ef_ = 10;
         for (size_t i = 0; i < cur_element_count; i++) {
-            label_lookup_[getExternalLabel(i)] = i;
+            label_lookup_.insertOrAssign(getExternalLabel(i), i);
             unsigned int linkListSize;
             readBinaryPOD(input, linkListSize);
             if (linkListSize == 0) {
-                element_levels_[i] = 0;
-                linkLists_[i] = nullptr;
+                setElementLevel(i, 0);
+                getLinkLists(i) = nullptr;
             } else {
-                element_levels_[i] = linkListSize / size_links_per_element_;
-                linkLists_[i] = (char *) malloc(linkListSize);
-                if (linkLists_[i] == nullptr)
+                setElementLevel(i, linkListSize / size_links_per_element_);
+                getLinkLists(i) = (char *) malloc(linkListSize);
+                if (getLinkLists(i) == nullptr)
                     throw std::runtime_error("Not enough memory: loadIndex failed to allocate linklist");
-                input.read(linkLists_[i], linkListSize);
+                input.read(getLinkLists(i), linkListSize);
             }
+            getSegment(i).element_inserted[i & segment_mask_] = true;
         }
+        inserted_count_ = cur_element_count.load();
 
         for (size_t i = 0; i < cur_element_count; i++) {
             if (isMarkedDeleted(i)) {
@@ -827,13 +1039,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
         
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end() || isMarkedDeleted(search->second)) {
+        tableint internalId;
+        if (!label_lookup_.find(label, internalId) || isMarkedDeleted(internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         char* data_ptrv = getDataByInternalId(internalId);
         size_t dim = *((size_t *) dist_func_param_);
@@ -847,6 +1056,19 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Returns the stored data of a label in place, without copying, or nullptr if the label
+    * is unknown or deleted. Segments never move, so the pointer stays valid until the
+    * element is replaced or the index is cleared.
+    */
+    const char *getDataPointerByLabel(labeltype label) const {
+        tableint internalId;
+        if (!label_lookup_.find(label, internalId) || isMarkedDeleted(internalId))
+            return nullptr;
+        return getDataByInternalId(internalId);
+    }
+
+
     /*
     * Marks an element with the given label deleted, does NOT really change the current graph.
     */
@@ -854,13 +1076,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId;
+        if (!label_lookup_.find(label, internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         markDeletedInternal(internalId);
     }
@@ -896,13 +1115,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         // lock all operations with element by label
         std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
 
-        std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-        auto search = label_lookup_.find(label);
-        if (search == label_lookup_.end()) {
+        tableint internalId;
+        if (!label_lookup_.find(label, internalId)) {
             throw std::runtime_error("Label not found");
         }
-        tableint internalId = search->second;
-        lock_table.unlock();
 
         unmarkDeletedInternal(internalId);
     }
@@ -981,10 +1197,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
             labeltype label_replaced = getExternalLabel(internal_id_replaced);
             setExternalLabel(internal_id_replaced, label);
 
-            std::unique_lock <std::mutex> lock_table(label_lookup_lock);
             label_lookup_.erase(label_replaced);
-            label_lookup_[label] = internal_id_replaced;
-            lock_table.unlock();
+            label_lookup_.insertOrAssign(label, internal_id_replaced);
 
             unmarkDeletedInternal(internal_id_replaced);
             updatePoint(data_point, internal_id_replaced, 1.0);
@@ -1002,7 +1216,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         if (entryPointCopy == internalId && cur_element_count == 1)
             return;
 
-        int elemLevel = element_levels_[internalId];
+        int elemLevel = getElementLevel(internalId);
         std::uniform_real_distribution<float> distribution(0.0, 1.0);
         for (int layer = 0; layer <= elemLevel; layer++) {
             std::unordered_set<tableint> sCand;
@@ -1053,7 +1267,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 getNeighborsByHeuristic2(candidates, layer == 0 ? maxM0_ : maxM_);
 
                 {
-                    std::unique_lock <std::mutex> lock(link_list_locks_[neigh]);
+                    std::unique_lock <std::mutex> lock(getLinkListMutex(neigh));
+                    LinkListWriteGuard write_guard(getLinkListVersion(neigh));
                     linklistsizeint *ll_cur;
                     ll_cur = get_linklist_at_level(neigh, layer);
                     size_t candSize = candidates.size();
@@ -1071,6 +1286,11 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Relinks an existing element at each of its levels. Elements still being inserted are never
+    * picked as neighbors: they are linked top down, and linking one early at a level it has not
+    * reached yet lets two concurrent inserts each wait for the other's link list lock.
+    */
     void repairConnectionsForUpdate(
         const void *dataPoint,
         tableint entryPointInternalId,
@@ -1079,16 +1299,17 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         int maxLevel) {
         tableint currObj = entryPointInternalId;
         if (dataPointLevel < maxLevel) {
+            std::vector<tableint> neighbors(maxM0_ + 1);
             dist_t curdist = fstdistfunc_(dataPoint, getDataByInternalId(currObj), dist_func_param_);
             for (int level = maxLevel; level > dataPointLevel; level--) {
                 bool changed = true;
                 while (changed) {
                     changed = false;
-                    unsigned int *data;
-                    std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
-                    data = get_linklist_at_level(currObj, level);
-                    int size = getListCount(data);
-                    tableint *datal = (tableint *) (data + 1);
+                    int size = readLinkListOptimistic(currObj, level, neighbors.data());
+                    if (size == 0)
+                        break;
+                    tableint *datal = neighbors.data();
+                    datal[size] = datal[size - 1];
 #ifdef USE_SSE
                     _mm_prefetch(getDataByInternalId(*datal), _MM_HINT_T0);
 #endif
@@ -1097,6 +1318,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                         _mm_prefetch(getDataByInternalId(*(datal + i + 1)), _MM_HINT_T0);
 #endif
                         tableint cand = datal[i];
+                        if (!isInserted(cand))
+                            continue;
                         dist_t d = fstdistfunc_(dataPoint, getDataByInternalId(cand), dist_func_param_);
                         if (d < curdist) {
                             curdist = d;
@@ -1117,13 +1340,13 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
             std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> filteredTopCandidates;
             while (topCandidates.size() > 0) {
-                if (topCandidates.top().second != dataPointInternalId)
+                if (topCandidates.top().second != dataPointInternalId && isInserted(topCandidates.top().second))
                     filteredTopCandidates.push(topCandidates.top());
 
                 topCandidates.pop();
             }
 
-            // Since element_levels_ is being used to get `dataPointLevel`, there could be cases where `topCandidates` could just contains entry point itself.
+            // Since element levels are being used to get `dataPointLevel`, there could be cases where `topCandidates` could just contains entry point itself.
             // To prevent self loops, the `topCandidates` is filtered and thus can be empty.
             if (filteredTopCandidates.size() > 0) {
                 bool epDeleted = isMarkedDeleted(entryPointInternalId);
@@ -1139,8 +1362,56 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Reconnects live elements whose link lists still point at deleted elements, so search
+    * quality does not degrade as deletions accumulate. Deleted elements stay in place and
+    * can still be reused by addPoint with replace_deleted. Safe to run alongside searches
+    * and inserts, see repairConnectionsForUpdate. Returns the number of elements that were reconnected.
+    */
+    size_t repairDeletedConnections() {
+        size_t repaired = 0;
+        if (num_deleted_ == 0)
+            return repaired;
+
+        std::vector<tableint> neighbors(maxM0_);
+        size_t element_count = inserted_count_;
+        for (tableint internalId = 0; internalId < element_count; internalId++) {
+            if (isMarkedDeleted(internalId))
+                continue;
+
+            int elemLevel = getElementLevel(internalId);
+            bool degraded = false;
+            for (int level = 0; level <= elemLevel && !degraded; level++) {
+                size_t size = readLinkListOptimistic(internalId, level, neighbors.data());
+                for (size_t j = 0; j < size; j++) {
+                    if (isMarkedDeleted(neighbors[j])) {
+                        degraded = true;
+                        break;
+                    }
+                }
+            }
+            if (!degraded)
+                continue;
+
+            // lock all operations with element by label, the element may have been replaced meanwhile
+            labeltype label = getExternalLabel(internalId);
+            std::unique_lock <std::mutex> lock_label(getLabelOpMutex(label));
+            if (isMarkedDeleted(internalId) || getExternalLabel(internalId) != label)
+                continue;
+
+            int maxLevelCopy = maxlevel_;
+            tableint entryPointCopy = enterpoint_node_;
+            if (elemLevel > maxLevelCopy)  // still being inserted
+                continue;
+            repairConnectionsForUpdate(getDataByInternalId(internalId), entryPointCopy, internalId, elemLevel, maxLevelCopy);
+            repaired++;
+        }
+        return repaired;
+    }
+
+
     std::vector<tableint> getConnectionsWithLock(tableint internalId, int level) {
-        std::unique_lock <std::mutex> lock(link_list_locks_[internalId]);
+        std::unique_lock <std::mutex> lock(getLinkListMutex(internalId));
         unsigned int *data = get_linklist_at_level(internalId, level);
         int size = getListCount(data);
         std::vector<tableint> result(size);
@@ -1155,16 +1426,14 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         {
             // Checking if the element with the same label already exists
             // if so, updating it *instead* of creating a new element.
-            std::unique_lock <std::mutex> lock_table(label_lookup_lock);
-            auto search = label_lookup_.find(label);
-            if (search != label_lookup_.end()) {
-                tableint existingInternalId = search->second;
+            // The caller holds the label operation lock, so no other thread can insert this label meanwhile.
+            tableint existingInternalId;
+            if (label_lookup_.find(label, existingInternalId)) {
                 if (allow_replace_deleted_) {
                     if (isMarkedDeleted(existingInternalId)) {
                         throw std::runtime_error("Can't use addPoint to update deleted elements if replacement of deleted elements is enabled.");
                     }
                 }
-                lock_table.unlock();
 
                 if (isMarkedDeleted(existingInternalId)) {
                     unmarkDeletedInternal(existingInternalId);
@@ -1174,21 +1443,27 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                 return existingInternalId;
             }
 
-            if (cur_element_count >= max_elements_) {
-                throw std::runtime_error("The number of elements exceeds the specified limit");
-            }
+            // reserve an internal id without a global lock; its storage is allocated before the
+            // id is counted, so every counted id has a segment even if the allocation throws
+            size_t count = cur_element_count.load();
+            do {
+                if (count >= max_elements_) {
+                    throw std::runtime_error("The number of elements exceeds the specified limit");
+                }
+                ensureSegment(count);
+            } while (!cur_element_count.compare_exchange_weak(count, count + 1));
 
-            cur_c = cur_element_count;
-            cur_element_count++;
-            label_lookup_[label] = cur_c;
+            cur_c = count;
+            label_lookup_.insertOrAssign(label, cur_c);
         }
 
-        std::unique_lock <std::mutex> lock_el(link_list_locks_[cur_c]);
+        InsertGuard insert_guard(*this, cur_c);
+        std::unique_lock <std::mutex> lock_el(getLinkListMutex(cur_c));
         int curlevel = getRandomLevel(mult_);
         if (level > 0)
             curlevel = level;
 
-        element_levels_[cur_c] = curlevel;
+        setElementLevel(cur_c, curlevel);
 
         std::unique_lock <std::mutex> templock(global);
         int maxlevelcopy = maxlevel_;
@@ -1197,36 +1472,42 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         tableint currObj = enterpoint_node_;
         tableint enterpoint_copy = enterpoint_node_;
 
-        memset(data_level0_memory_ + cur_c * size_data_per_element_ + offsetLevel0_, 0, size_data_per_element_);
+        {
+            LinkListWriteGuard write_guard(getLinkListVersion(cur_c));
+            memset(getElementBlock(cur_c) + offsetLevel0_, 0, size_data_per_element_);
+        }
 
         // Initialisation of the data and label
         memcpy(getExternalLabeLp(cur_c), &label, sizeof(labeltype));
         memcpy(getDataByInternalId(cur_c), data_point, data_size_);
 
         if (curlevel) {
-            linkLists_[cur_c] = (char *) malloc(size_links_per_element_ * curlevel + 1);
-            if (linkLists_[cur_c] == nullptr)
+            char *&link_lists = getLinkLists(cur_c);
+            link_lists = (char *) malloc(size_links_per_element_ * curlevel + 1);
+            if (link_lists == nullptr) {
+                setElementLevel(cur_c, 0);  // published as an unlinked level 0 element
                 throw std::runtime_error("Not enough memory: addPoint failed to allocate linklist");
-            memset(linkLists_[cur_c], 0, size_links_per_element_ * curlevel + 1);
+            }
+            memset(link_lists, 0, size_links_per_element_ * curlevel + 1);
         }
 
         if ((signed)currObj != -1) {
             if (curlevel < maxlevelcopy) {
+                std::vector<tableint> neighbors(maxM_);
                 dist_t curdist = fstdistfunc_(data_point, getDataByInternalId(currObj), dist_func_param_);
                 for (int level = maxlevelcopy; level > curlevel; level--) {
                     bool changed = true;
                     while (changed) {
                         changed = false;
-                        unsigned int *data;
-                        std::unique_lock <std::mutex> lock(link_list_locks_[currObj]);
-                        data = get_linklist(currObj, level);
-                        int size = getListCount(data);
+                        int size = readLinkListOptimistic(currObj, level, neighbors.data());
 
-                        tableint *datal = (tableint *) (data + 1);
+                        tableint *datal = neighbors.data();
                         for (int i = 0; i < size; i++) {
                             tableint cand = datal[i];
                             if (cand < 0 || cand > max_elements_)
                                 throw std::runtime_error("cand error");
+                            if (!isInserted(cand))
+                                continue;
                             dist_t d = fstdistfunc_(data_point, getDataByInternalId(cand), dist_func_param_);
                             if (d < curdist) {
                                 curdist = d;
@@ -1250,7 +1531,20 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
                     if (top_candidates.size() > ef_construction_)
                         top_candidates.pop();
                 }
-                currObj = mutuallyConnectNewElement(data_point, cur_c, top_candidates, level, false);
+
+                // Searches read link lists without locks, so they can reach elements that other
+                // threads are still linking in, even at levels those have not linked yet. Picking
+                // one as a neighbor means waiting for its whole insert, which may in turn wait for
+                // this one; such elements are left for later inserts and repairs to link.
+                std::priority_queue<std::pair<dist_t, tableint>, std::vector<std::pair<dist_t, tableint>>, CompareByFirst> inserted_candidates;
+                while (top_candidates.size() > 0) {
+                    if (isInserted(top_candidates.top().second))
+                        inserted_candidates.push(top_candidates.top());
+                    top_candidates.pop();
+                }
+                if (inserted_candidates.empty())
+                    continue;
+                currObj = mutuallyConnectNewElement(data_point, cur_c, inserted_candidates, level, false);
             }
         } else {
             // Do nothing for the first element
@@ -1269,24 +1563,32 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
 
     std::priority_queue<std::pair<dist_t, labeltype >>
     searchKnn(const void *query_data, size_t k, BaseFilterFunctor* isIdAllowed = nullptr) const {
+        return searchKnnEf(query_data, k, ef_, isIdAllowed);
+    }
+
+
+    /*
+    * Same as searchKnn, with the ef given per call instead of read from ef_. Lets a tuner
+    * probe several values on a live index without changing what concurrent searches use.
+    */
+    std::priority_queue<std::pair<dist_t, labeltype >>
+    searchKnnEf(const void *query_data, size_t k, size_t ef, BaseFilterFunctor* isIdAllowed = nullptr) const {
         std::priority_queue<std::pair<dist_t, labeltype >> result;
         if (cur_element_count == 0) return result;
 
         tableint currObj = enterpoint_node_;
         dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
 
+        std::vector<tableint> neighbors(maxM_);
         for (int level = maxlevel_; level > 0; level--) {
             bool changed = true;
             while (changed) {
                 changed = false;
-                unsigned int *data;
-
-                data = (unsigned int *) get_linklist(currObj, level);
-                int size = getListCount(data);
+                int size = readLinkListOptimistic(currObj, level, neighbors.data());
                 metric_hops++;
                 metric_distance_computations+=size;
 
-                tableint *datal = (tableint *) (data + 1);
+                tableint *datal = neighbors.data();
                 for (int i = 0; i < size; i++) {
                     tableint cand = datal[i];
                     if (cand < 0 || cand > max_elements_)
@@ -1306,10 +1608,10 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         bool bare_bone_search = !num_deleted_ && !isIdAllowed;
         if (bare_bone_search) {
             top_candidates = searchBaseLayerST<true>(
-                    currObj, query_data, std::max(ef_, k), isIdAllowed);
+                    currObj, query_data, std::max(ef, k), isIdAllowed);
         } else {
             top_candidates = searchBaseLayerST<false>(
-                    currObj, query_data, std::max(ef_, k), isIdAllowed);
+                    currObj, query_data, std::max(ef, k), isIdAllowed);
         }
 
         while (top_candidates.size() > k) {
@@ -1324,6 +1626,44 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
     }
 
 
+    /*
+    * Exact k-NN for a batch of queries laid out back to back, scanning the segments directly
+    * instead of walking the graph. Perfect recall, and faster than the graph on small indexes.
+    * Only fully inserted elements are scanned, so elements being inserted meanwhile are missed.
+    */
+    std::vector<std::priority_queue<std::pair<dist_t, labeltype >>>
+    searchKnnExactBatch(const void *queries, size_t num_queries, size_t k, size_t num_threads = 1,
+                        BaseFilterFunctor* isIdAllowed = nullptr) const {
+        std::vector<ElementRun> runs;
+        size_t count = inserted_count_;
+        size_t segment_size = segment_mask_ + 1;
+        SegmentDirectory *directory = segment_directory_.load(std::memory_order_acquire);
+        for (size_t first = 0; first < count; first += segment_size) {
+            size_t segment_id = first >> segment_bits_;
+            ElementSegment *segment = segment_id < directory->capacity
+                ? directory->segments[segment_id].load(std::memory_order_acquire) : nullptr;
+            if (segment == nullptr)
+                break;
+            runs.push_back({segment->data_level0 + offsetData_, size_data_per_element_, std::min(segment_size, count - first)});
+        }
+
+        // the flag lies before the vector in the element, so the offset is negative
+        std::ptrdiff_t data_to_deleted_flag = (std::ptrdiff_t) (offsetLevel0_ + 2) - (std::ptrdiff_t) offsetData_;
+        return blockedExactSearch<dist_t>(
+            runs, data_size_, queries, num_queries, k, fstdistfunc_, dist_func_param_,
+            [data_to_deleted_flag](const char *data) {
+                return !(*((const unsigned char *) data + data_to_deleted_flag) & DELETE_MARK);
+            },
+            isIdAllowed, num_threads);
+    }
+
+
+    std::priority_queue<std::pair<dist_t, labeltype >>
+    searchKnnExact(const void *query_data, size_t k, size_t num_threads = 1, BaseFilterFunctor* isIdAllowed = nullptr) const {
+        return std::move(searchKnnExactBatch(query_data, 1, k, num_threads, isIdAllowed)[0]);
+    }
+
+
     std::vector<std::pair<dist_t, labeltype >>
     searchStopConditionClosest(
         const void *query_data,
@@ -1335,18 +1675,16 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         tableint currObj = enterpoint_node_;
         dist_t curdist = fstdistfunc_(query_data, getDataByInternalId(enterpoint_node_), dist_func_param_);
 
+        std::vector<tableint> neighbors(maxM_);
         for (int level = maxlevel_; level > 0; level--) {
             bool changed = true;
             while (changed) {
                 changed = false;
-                unsigned int *data;
-
-                data = (unsigned int *) get_linklist(currObj, level);
-                int size = getListCount(data);
+                int size = readLinkListOptimistic(currObj, level, neighbors.data());
                 metric_hops++;
                 metric_distance_computations+=size;
 
-                tableint *datal = (tableint *) (data + 1);
+                tableint *datal = neighbors.data();
                 for (int i = 0; i < size; i++) {
                     tableint cand = datal[i];
                     if (cand < 0 || cand > max_elements_)
@@ -1368,7 +1706,8 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         size_t sz = top_candidates.size();
         result.resize(sz);
         while (!top_candidates.empty()) {
-            result[--sz] = top_candidates.top();
+            std::pair<dist_t, tableint> rez = top_candidates.top();
+            result[--sz] = std::pair<dist_t, labeltype>(rez.first, getExternalLabel(rez.second));
             top_candidates.pop();
         }
 
@@ -1382,7 +1721,7 @@ class HierarchicalNSW : public AlgorithmInterface<dist_t> {
         int connections_checked = 0;
         std::vector <int > inbound_connections_num(cur_element_count, 0);
         for (int i = 0; i < cur_element_count; i++) {
-            for (int l = 0; l <= element_levels_[i]; l++) {
+            for (int l = 0; l <= getElementLevel(i); l++) {
                 linklistsizeint *ll_cur = get_linklist_at_level(i, l);
                 int size = getListCount(ll_cur);
                 tableint *data = (tableint *) (ll_cur + 1);
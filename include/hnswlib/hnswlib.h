@@ -114,6 +114,17 @@ static bool AVX512Capable() {
     }
     return HW_AVX512F && avx512Supported;
 }
+
+static bool AVX2Capable() {
+    if (!AVXCapable()) return false;
+
+    int cpuInfo[4];
+    cpuid(cpuInfo, 0, 0);
+    int nIds = cpuInfo[0];
+    if (nIds < 0x00000007) return false;
+    cpuid(cpuInfo, 0x00000007, 0);
+    return (cpuInfo[1] & ((int)1 << 5)) != 0;
+}
 #endif
 
 #include <queue>
@@ -224,5 +235,10 @@ AlgorithmInterface<dist_t>::searchKnnCloserFirst(const void* query_data, size_t
 #include "space_l2.h"
 #include "space_ip.h"
 #include "stop_condition.h"
+#include "exact_scan.h"
 #include "bruteforce.h"
 #include "hnswalg.h"
+#include "ef_tuner.h"
+#include "quantization.h"
+#include "vamana.h"
+#include "ivfpq.h"
@@ -0,0 +1,537 @@
+#pragma once
+
+#include "quantization.h"
+#include <atomic>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace hnswlib {
+///////////////////////////////////////////////////////////
+//
+// Inverted-file index over product-quantized residuals.
+// A k-means coarse quantizer splits the vectors into lists;
+// each vector is stored as its list plus the 8-bit PQ code of
+// its residual to the list centroid. Searches scan the codes
+// of the num_probes closest lists with ADC lookup tables.
+//
+// Until training_size points have been added the index keeps
+// them uncompressed and searches them exactly; it then trains
+// on them on another thread, still staging and searching points
+// exactly, and encodes everything once training finishes.
+//
+// Searches share the index lock and run alongside each other;
+// adds and removals take it alone.
+//
+/////////////////////////////////////////////////////////
+
+class IvfPqIndex : public AlgorithmInterface<float> {
+ public:
+    static const uint64_t FILE_MAGIC = 0x3130515046564949ULL;  // "IIVFPQ01"
+
+    /*
+    * pq_subspaces = 0 picks about 4 dimensions per code byte. training_size = 0 waits for
+    * enough points to train every centroid of both quantizers on about 39 points.
+    */
+    IvfPqIndex(SpaceInterface<float> *s, size_t num_lists = 1024, size_t pq_subspaces = 0, size_t training_size = 0)
+        : num_lists_(num_lists) {
+        initSpace(s);
+        if (num_lists_ == 0)
+            throw std::runtime_error("IvfPqIndex needs at least one list");
+        if (pq_subspaces == 0) {
+            pq_subspaces = std::max<size_t>(1, dim_ / 4);
+            while (dim_ % pq_subspaces != 0)
+                pq_subspaces--;
+        }
+        pq_ = ProductQuantizer(dim_, pq_subspaces, metric_);
+        training_size_ = training_size ? training_size : 39 * std::max(num_lists_, (size_t) ProductQuantizer::NUM_CENTROIDS);
+        if (training_size_ < num_lists_)
+            throw std::runtime_error("IvfPqIndex: fewer training points than lists");
+    }
+
+
+    IvfPqIndex(SpaceInterface<float> *s, const std::string &location) {
+        loadIndex(location, s);
+    }
+
+
+    size_t getCurrentElementCount() const {
+        std::shared_lock <std::shared_timed_mutex> lock(index_lock_);
+        return locations_.size();
+    }
+
+
+    // False until the trained lists replace the staged points
+    bool isTrained() const {
+        std::shared_lock <std::shared_timed_mutex> lock(index_lock_);
+        return trained_;
+    }
+
+
+    // Lists scanned per query; more is slower and more accurate
+    void setNumProbes(size_t num_probes) {
+        num_probes_ = std::max<size_t>(1, num_probes);
+    }
+
+
+    void setSearchThreads(size_t num_threads) {
+        search_threads_ = std::max<size_t>(1, num_threads);
+    }
+
+
+    // Trains on the given vectors and encodes the points added so far; a training started by
+    // addPoint that finishes later is dropped
+    void train(const float *data, size_t n) {
+        std::unique_lock <std::shared_timed_mutex> lock(index_lock_);
+        trainInternal(data, n);
+    }
+
+
+    // Adding an existing label replaces its vector
+    void addPoint(const void *datapoint, labeltype label, bool replace_deleted = false) override {
+        (void) replace_deleted;
+        std::unique_lock <std::shared_timed_mutex> lock(index_lock_);
+        removeInternal(label);
+        if (!trained_) {
+            locations_[label] = Location{UNTRAINED_LIST, staged_labels_.size()};
+            const float *vector = (const float *) datapoint;
+            staged_data_.insert(staged_data_.end(), vector, vector + dim_);
+            staged_labels_.push_back(label);
+            if (staged_labels_.size() >= training_size_ && !training_pending_)
+                startTraining();
+            return;
+        }
+        encodeInternal((const float *) datapoint, label);
+    }
+
+
+    void removePoint(labeltype label) {
+        std::unique_lock <std::shared_timed_mutex> lock(index_lock_);
+        removeInternal(label);
+    }
+
+
+    // Writes the approximate (decoded) vector of label to out; false if the label is unknown
+    bool reconstruct(labeltype label, float *out) const {
+        std::shared_lock <std::shared_timed_mutex> lock(index_lock_);
+        auto found = locations_.find(label);
+        if (found == locations_.end())
+            return false;
+        const Location &location = found->second;
+        if (location.list == UNTRAINED_LIST) {
+            memcpy(out, staged_data_.data() + location.pos * dim_, dim_ * sizeof(float));
+            return true;
+        }
+        pq_.decode(lists_[location.list].codes.data() + location.pos * pq_.getCodeSize(), out);
+        const float *centroid = centroids_.data() + (size_t) location.list * dim_;
+        for (size_t d = 0; d < dim_; d++)
+            out[d] += centroid[d];
+        return true;
+    }
+
+
+    std::priority_queue<std::pair<float, labeltype>>
+    searchKnn(const void *query_data, size_t k, BaseFilterFunctor* isIdAllowed = nullptr) const override {
+        typedef std::priority_queue<std::pair<float, labeltype>> ResultHeap;
+        std::shared_lock <std::shared_timed_mutex> lock(index_lock_);
+        ResultHeap result;
+        if (k == 0)
+            return result;
+        const float *query = (const float *) query_data;
+
+        if (!trained_) {
+            for (size_t i = 0; i < staged_labels_.size(); i++) {
+                float dist = fstdistfunc_(query, staged_data_.data() + i * dim_, dist_func_param_);
+                pushResult(result, k, dist, staged_labels_[i], isIdAllowed);
+            }
+            return result;
+        }
+
+        // Closest lists by the index metric
+        std::vector<std::pair<float, uint32_t>> ranked(num_lists_);
+        for (size_t l = 0; l < num_lists_; l++) {
+            const float *centroid = centroids_.data() + l * dim_;
+            float dist = metric_ == ProductQuantizer::L2 ? squaredL2(query, centroid, dim_) : -innerProduct(query, centroid, dim_);
+            ranked[l] = std::make_pair(dist, (uint32_t) l);
+        }
+        size_t num_probes = std::min(num_probes_, num_lists_);
+        std::partial_sort(ranked.begin(), ranked.begin() + num_probes, ranked.end());
+        size_t probed_codes = 0;
+        for (size_t p = 0; p < num_probes; p++)
+            probed_codes += lists_[ranked[p].second].labels.size();
+
+        std::atomic<size_t> next_probe{0};
+        auto worker = [&](ResultHeap &heap) {
+            std::vector<float> table(pq_.getCodeSize() * ProductQuantizer::NUM_CENTROIDS);
+            std::vector<float> residual(dim_);
+            std::vector<float> dists(SCAN_BLOCK);
+            // with the inner product the table does not depend on the list
+            if (metric_ == ProductQuantizer::INNER_PRODUCT)
+                pq_.computeTable(query, table.data());
+            size_t p;
+            while ((p = next_probe.fetch_add(1)) < num_probes) {
+                uint32_t list_id = ranked[p].second;
+                const InvertedList &list = lists_[list_id];
+                const float *centroid = centroids_.data() + (size_t) list_id * dim_;
+                float bias = 0;
+                if (metric_ == ProductQuantizer::L2) {
+                    for (size_t d = 0; d < dim_; d++)
+                        residual[d] = query[d] - centroid[d];
+                    pq_.computeTable(residual.data(), table.data());
+                } else {
+                    bias = -innerProduct(query, centroid, dim_);
+                }
+                for (size_t begin = 0; begin < list.labels.size(); begin += SCAN_BLOCK) {
+                    size_t count = std::min((size_t) SCAN_BLOCK, list.labels.size() - begin);
+                    pq_.distances(table.data(), list.codes.data() + begin * pq_.getCodeSize(), count, dists.data());
+                    for (size_t i = 0; i < count; i++)
+                        pushResult(heap, k, dists[i] + bias, list.labels[begin + i], isIdAllowed);
+                }
+            }
+        };
+
+        size_t num_threads = std::max<size_t>(1, std::min(search_threads_, probed_codes / MIN_CODES_PER_THREAD));
+        num_threads = std::min(num_threads, num_probes);
+        std::vector<ResultHeap> partial(num_threads);
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < num_threads; t++)
+            threads.emplace_back(worker, std::ref(partial[t]));
+        worker(partial[0]);
+        for (std::thread &thread : threads)
+            thread.join();
+
+        result = std::move(partial[0]);
+        for (size_t t = 1; t < num_threads; t++) {
+            while (!partial[t].empty()) {
+                result.push(partial[t].top());
+                partial[t].pop();
+                if (result.size() > k)
+                    result.pop();
+            }
+        }
+        return result;
+    }
+
+
+    // Saves the staged points while a training is still running
+    void saveIndex(const std::string &location) override {
+        std::shared_lock <std::shared_timed_mutex> lock(index_lock_);
+        std::ofstream output(location, std::ios::binary);
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file");
+
+        uint64_t magic = FILE_MAGIC;
+        unsigned char trained = trained_ ? 1 : 0;
+        writeBinaryPOD(output, magic);
+        writeBinaryPOD(output, data_size_);
+        writeBinaryPOD(output, num_lists_);
+        writeBinaryPOD(output, training_size_);
+        writeBinaryPOD(output, trained);
+        size_t code_size = pq_.getCodeSize();
+        writeBinaryPOD(output, code_size);
+        if (trained_) {
+            output.write((const char *) centroids_.data(), centroids_.size() * sizeof(float));
+            pq_.save(output);
+            for (const InvertedList &list : lists_) {
+                size_t count = list.labels.size();
+                writeBinaryPOD(output, count);
+                output.write((const char *) list.labels.data(), count * sizeof(labeltype));
+                output.write((const char *) list.codes.data(), list.codes.size());
+            }
+        } else {
+            size_t count = staged_labels_.size();
+            writeBinaryPOD(output, count);
+            output.write((const char *) staged_labels_.data(), count * sizeof(labeltype));
+            output.write((const char *) staged_data_.data(), staged_data_.size() * sizeof(float));
+        }
+        output.close();
+    }
+
+
+    void loadIndex(const std::string &location, SpaceInterface<float> *s) {
+        std::unique_lock <std::shared_timed_mutex> lock(index_lock_);
+        std::ifstream input(location, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+        initSpace(s);
+        training_generation_++;
+
+        uint64_t magic;
+        size_t data_size;
+        unsigned char trained;
+        size_t code_size;
+        readBinaryPOD(input, magic);
+        readBinaryPOD(input, data_size);
+        if (magic != FILE_MAGIC || data_size != data_size_)
+            throw std::runtime_error("Not an IvfPqIndex for this space");
+        readBinaryPOD(input, num_lists_);
+        readBinaryPOD(input, training_size_);
+        readBinaryPOD(input, trained);
+        readBinaryPOD(input, code_size);
+        pq_ = ProductQuantizer(dim_, code_size, metric_);
+
+        locations_.clear();
+        staged_data_.clear();
+        staged_labels_.clear();
+        lists_.assign(num_lists_, InvertedList());
+        trained_ = trained != 0;
+        if (trained_) {
+            centroids_.resize(num_lists_ * dim_);
+            input.read((char *) centroids_.data(), centroids_.size() * sizeof(float));
+            pq_.load(input);
+            for (size_t l = 0; l < num_lists_; l++) {
+                size_t count;
+                readBinaryPOD(input, count);
+                InvertedList &list = lists_[l];
+                list.labels.resize(count);
+                list.codes.resize(count * pq_.getCodeSize());
+                input.read((char *) list.labels.data(), count * sizeof(labeltype));
+                input.read((char *) list.codes.data(), list.codes.size());
+                for (size_t i = 0; i < count; i++)
+                    locations_[list.labels[i]] = Location{(uint32_t) l, i};
+            }
+        } else {
+            size_t count;
+            readBinaryPOD(input, count);
+            staged_labels_.resize(count);
+            staged_data_.resize(count * dim_);
+            input.read((char *) staged_labels_.data(), count * sizeof(labeltype));
+            input.read((char *) staged_data_.data(), staged_data_.size() * sizeof(float));
+            for (size_t i = 0; i < count; i++)
+                locations_[staged_labels_[i]] = Location{UNTRAINED_LIST, i};
+        }
+        if (!input)
+            throw std::runtime_error("IvfPqIndex: index file is truncated");
+        input.close();
+    }
+
+ private:
+    static const uint32_t UNTRAINED_LIST = 0xFFFFFFFF;
+    static const size_t SCAN_BLOCK = 256;
+    // below this many codes per worker, starting threads costs more than it saves
+    static const size_t MIN_CODES_PER_THREAD = 32768;
+
+    struct Location {
+        uint32_t list;
+        size_t pos;
+    };
+
+    struct InvertedList {
+        std::vector<labeltype> labels;
+        std::vector<uint8_t> codes;  // pq_.getCodeSize() bytes per label
+    };
+
+
+    void initSpace(SpaceInterface<float> *s) {
+        data_size_ = s->get_data_size();
+        dim_ = data_size_ / sizeof(float);
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        metric_ = dynamic_cast<InnerProductSpace *>(s) ? ProductQuantizer::INNER_PRODUCT : ProductQuantizer::L2;
+    }
+
+
+    static void pushResult(std::priority_queue<std::pair<float, labeltype>> &heap, size_t k, float dist,
+                           labeltype label, BaseFilterFunctor *isIdAllowed) {
+        if (heap.size() >= k && dist >= heap.top().first)
+            return;
+        if (isIdAllowed && !(*isIdAllowed)(label))
+            return;
+        heap.emplace(dist, label);
+        if (heap.size() > k)
+            heap.pop();
+    }
+
+
+    uint32_t nearestList(const float *centroids, const float *vector) const {
+        uint32_t best = 0;
+        float best_dist = std::numeric_limits<float>::max();
+        for (size_t l = 0; l < num_lists_; l++) {
+            float dist = squaredL2(vector, centroids + l * dim_, dim_);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best = (uint32_t) l;
+            }
+        }
+        return best;
+    }
+
+
+    void trainInternal(const float *data, size_t n) {
+        if (n < num_lists_)
+            throw std::runtime_error("IvfPqIndex: fewer training points than lists");
+        centroids_.resize(num_lists_ * dim_);
+        std::vector<uint32_t> assignment = kmeans(data, n, dim_, num_lists_, centroids_.data());
+
+        std::vector<float> residuals(n * dim_);
+        for (size_t i = 0; i < n; i++) {
+            const float *centroid = centroids_.data() + (size_t) assignment[i] * dim_;
+            for (size_t d = 0; d < dim_; d++)
+                residuals[i * dim_ + d] = data[i * dim_ + d] - centroid[d];
+        }
+        pq_.train(residuals.data(), n);
+        trained_ = true;
+        training_generation_++;
+
+        lists_.assign(num_lists_, InvertedList());
+        std::vector<float> staged_data;
+        std::vector<labeltype> staged_labels;
+        staged_data.swap(staged_data_);
+        staged_labels.swap(staged_labels_);
+        for (size_t i = 0; i < staged_labels.size(); i++)
+            encodeInternal(staged_data.data() + i * dim_, staged_labels[i]);
+    }
+
+
+    // Starts training on a copy of the staged points; called with the index lock held
+    void startTraining() {
+        training_pending_ = true;
+        std::vector<float> data(staged_data_);
+        std::vector<labeltype> labels(staged_labels_);
+        ProductQuantizer pq(dim_, pq_.getCodeSize(), metric_);
+        size_t generation = training_generation_;
+        // the previous training has released the lock, so replacing its future waits only for its thread to exit
+        training_ = std::async(std::launch::async, [this, data, labels, pq, generation]() mutable {
+            trainInBackground(data, labels, pq, generation);
+        });
+    }
+
+
+    // Trains and encodes the copied points without the lock, then swaps the lists in for the
+    // points staged by then. Codes of copied points staged unchanged are reused; others are
+    // encoded under the lock.
+    void trainInBackground(const std::vector<float> &data, const std::vector<labeltype> &labels, ProductQuantizer &pq,
+                           size_t generation) {
+        size_t n = labels.size();
+        std::vector<float> centroids(num_lists_ * dim_);
+        std::vector<uint32_t> assignment = kmeans(data.data(), n, dim_, num_lists_, centroids.data());
+        std::vector<float> residuals(n * dim_);
+        for (size_t i = 0; i < n; i++) {
+            const float *centroid = centroids.data() + (size_t) assignment[i] * dim_;
+            for (size_t d = 0; d < dim_; d++)
+                residuals[i * dim_ + d] = data[i * dim_ + d] - centroid[d];
+        }
+        pq.train(residuals.data(), n);
+
+        size_t code_size = pq.getCodeSize();
+        std::vector<uint32_t> list_ids(n);
+        std::vector<uint8_t> codes(n * code_size);
+        for (size_t i = 0; i < n; i++) {
+            const float *vector = data.data() + i * dim_;
+            list_ids[i] = nearestList(centroids.data(), vector);
+            const float *centroid = centroids.data() + (size_t) list_ids[i] * dim_;
+            for (size_t d = 0; d < dim_; d++)
+                residuals[d] = vector[d] - centroid[d];
+            pq.encode(residuals.data(), codes.data() + i * code_size);
+        }
+        std::unordered_map<labeltype, size_t> copied;
+        for (size_t i = 0; i < n; i++)
+            copied[labels[i]] = i;
+
+        std::unique_lock <std::shared_timed_mutex> lock(index_lock_);
+        training_pending_ = false;
+        // trained or loaded meanwhile
+        if (generation != training_generation_)
+            return;
+        centroids_.swap(centroids);
+        pq_ = pq;
+        trained_ = true;
+        training_generation_++;
+
+        lists_.assign(num_lists_, InvertedList());
+        std::vector<float> staged_data;
+        std::vector<labeltype> staged_labels;
+        staged_data.swap(staged_data_);
+        staged_labels.swap(staged_labels_);
+        for (size_t i = 0; i < staged_labels.size(); i++) {
+            const float *vector = staged_data.data() + i * dim_;
+            auto found = copied.find(staged_labels[i]);
+            if (found != copied.end() && memcmp(data.data() + found->second * dim_, vector, dim_ * sizeof(float)) == 0)
+                appendCode(list_ids[found->second], staged_labels[i], codes.data() + found->second * code_size);
+            else
+                encodeInternal(vector, staged_labels[i]);
+        }
+    }
+
+
+    void encodeInternal(const float *vector, labeltype label) {
+        uint32_t list_id = nearestList(centroids_.data(), vector);
+        const float *centroid = centroids_.data() + (size_t) list_id * dim_;
+        std::vector<float> residual(dim_);
+        for (size_t d = 0; d < dim_; d++)
+            residual[d] = vector[d] - centroid[d];
+        std::vector<uint8_t> code(pq_.getCodeSize());
+        pq_.encode(residual.data(), code.data());
+        appendCode(list_id, label, code.data());
+    }
+
+
+    void appendCode(uint32_t list_id, labeltype label, const uint8_t *code) {
+        InvertedList &list = lists_[list_id];
+        locations_[label] = Location{list_id, list.labels.size()};
+        list.labels.push_back(label);
+        list.codes.insert(list.codes.end(), code, code + pq_.getCodeSize());
+    }
+
+
+    // Moves the last entry of the list into the freed position
+    void removeInternal(labeltype label) {
+        auto found = locations_.find(label);
+        if (found == locations_.end())
+            return;
+        Location location = found->second;
+        locations_.erase(found);
+
+        if (location.list == UNTRAINED_LIST) {
+            size_t last = staged_labels_.size() - 1;
+            if (location.pos != last) {
+                staged_labels_[location.pos] = staged_labels_[last];
+                memcpy(staged_data_.data() + location.pos * dim_, staged_data_.data() + last * dim_, dim_ * sizeof(float));
+                locations_[staged_labels_[location.pos]].pos = location.pos;
+            }
+            staged_labels_.pop_back();
+            staged_data_.resize(last * dim_);
+            return;
+        }
+
+        InvertedList &list = lists_[location.list];
+        size_t code_size = pq_.getCodeSize();
+        size_t last = list.labels.size() - 1;
+        if (location.pos != last) {
+            list.labels[location.pos] = list.labels[last];
+            memcpy(list.codes.data() + location.pos * code_size, list.codes.data() + last * code_size, code_size);
+            locations_[list.labels[location.pos]].pos = location.pos;
+        }
+        list.labels.pop_back();
+        list.codes.resize(last * code_size);
+    }
+
+
+    size_t data_size_{0};
+    size_t dim_{0};
+    DISTFUNC<float> fstdistfunc_;
+    void *dist_func_param_{nullptr};
+    ProductQuantizer::Metric metric_{ProductQuantizer::L2};
+
+    size_t num_lists_{0};
+    size_t training_size_{0};
+    size_t num_probes_{16};
+    size_t search_threads_{1};
+    bool trained_{false};
+    std::vector<float> centroids_;  // num_lists_ x dim_
+    ProductQuantizer pq_;
+    std::vector<InvertedList> lists_;
+    std::unordered_map<labeltype, Location> locations_;
+    // points added before training, uncompressed
+    std::vector<float> staged_data_;
+    std::vector<labeltype> staged_labels_;
+    mutable std::shared_timed_mutex index_lock_;
+    bool training_pending_{false};
+    size_t training_generation_{0};  // bumped by every training and load; a stale background training is dropped
+    // declared last, so a running training finishes before the members it uses are destroyed
+    std::future<void> training_;
+};
+}  // namespace hnswlib
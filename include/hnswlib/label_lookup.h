@@ -0,0 +1,180 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+namespace hnswlib {
+///////////////////////////////////////////////////////////
+//
+// Label -> internal id table split into independently locked shards.
+// Each shard is an open-addressing (linear probing) hash table, so
+// concurrent inserts and lookups of different labels rarely contend
+// and never allocate per entry.
+//
+/////////////////////////////////////////////////////////
+
+template<typename key_t, typename value_t>
+class ShardedLabelMap {
+    static const size_t NUM_SHARDS = 64;
+    static const size_t MIN_SHARD_CAPACITY = 16;
+
+    enum SlotState : unsigned char { SLOT_EMPTY = 0, SLOT_FULL = 1, SLOT_ERASED = 2 };
+
+    struct Slot {
+        key_t key;
+        value_t value;
+        SlotState state;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex lock;
+        std::vector<Slot> table;
+        size_t num_full{0};
+        size_t num_erased{0};
+    };
+
+    Shard shards_[NUM_SHARDS];
+
+    static inline uint64_t mixHash(uint64_t x) {
+        // splitmix64 finalizer, spreads sequential labels over shards and slots
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    inline Shard &shardFor(uint64_t hash) const {
+        return const_cast<Shard &>(shards_[hash & (NUM_SHARDS - 1)]);
+    }
+
+    // Returns the slot holding key, or the first reusable slot if the key is absent
+    static size_t probe(const Shard &shard, const key_t &key, uint64_t hash, bool &found) {
+        size_t mask = shard.table.size() - 1;
+        size_t pos = (hash >> 6) & mask;
+        size_t first_erased = shard.table.size();
+        while (true) {
+            const Slot &slot = shard.table[pos];
+            if (slot.state == SLOT_EMPTY) {
+                found = false;
+                return first_erased != shard.table.size() ? first_erased : pos;
+            }
+            if (slot.state == SLOT_FULL && slot.key == key) {
+                found = true;
+                return pos;
+            }
+            if (slot.state == SLOT_ERASED && first_erased == shard.table.size())
+                first_erased = pos;
+            pos = (pos + 1) & mask;
+        }
+    }
+
+    static void rehash(Shard &shard, size_t new_capacity) {
+        std::vector<Slot> old_slots(new_capacity, Slot{key_t(), value_t(), SLOT_EMPTY});
+        old_slots.swap(shard.table);
+        shard.num_full = 0;
+        shard.num_erased = 0;
+        for (const Slot &slot : old_slots) {
+            if (slot.state != SLOT_FULL)
+                continue;
+            bool found;
+            size_t pos = probe(shard, slot.key, mixHash(slot.key), found);
+            shard.table[pos] = slot;
+            shard.num_full++;
+        }
+    }
+
+ public:
+    ShardedLabelMap() {
+        for (size_t i = 0; i < NUM_SHARDS; i++)
+            shards_[i].table.assign(MIN_SHARD_CAPACITY, Slot{key_t(), value_t(), SLOT_EMPTY});
+    }
+
+    bool find(const key_t &key, value_t &value) const {
+        uint64_t hash = mixHash(key);
+        Shard &shard = shardFor(hash);
+        std::unique_lock <std::mutex> lock(shard.lock);
+        bool found;
+        size_t pos = probe(shard, key, hash, found);
+        if (found)
+            value = shard.table[pos].value;
+        return found;
+    }
+
+    bool contains(const key_t &key) const {
+        value_t value;
+        return find(key, value);
+    }
+
+    void insertOrAssign(const key_t &key, const value_t &value) {
+        uint64_t hash = mixHash(key);
+        Shard &shard = shardFor(hash);
+        std::unique_lock <std::mutex> lock(shard.lock);
+        // keep the load factor (including tombstones) under 3/4
+        if ((shard.num_full + shard.num_erased + 1) * 4 > shard.table.size() * 3) {
+            size_t new_capacity = shard.table.size();
+            if ((shard.num_full + 1) * 2 > shard.table.size())
+                new_capacity *= 2;
+            rehash(shard, new_capacity);
+        }
+        bool found;
+        size_t pos = probe(shard, key, hash, found);
+        Slot &slot = shard.table[pos];
+        if (!found) {
+            if (slot.state == SLOT_ERASED)
+                shard.num_erased--;
+            shard.num_full++;
+            slot.key = key;
+            slot.state = SLOT_FULL;
+        }
+        slot.value = value;
+    }
+
+    bool erase(const key_t &key) {
+        uint64_t hash = mixHash(key);
+        Shard &shard = shardFor(hash);
+        std::unique_lock <std::mutex> lock(shard.lock);
+        bool found;
+        size_t pos = probe(shard, key, hash, found);
+        if (!found)
+            return false;
+        shard.table[pos].state = SLOT_ERASED;
+        shard.num_full--;
+        shard.num_erased++;
+        return true;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (size_t i = 0; i < NUM_SHARDS; i++) {
+            std::unique_lock <std::mutex> lock(shards_[i].lock);
+            total += shards_[i].num_full;
+        }
+        return total;
+    }
+
+    void clear() {
+        for (size_t i = 0; i < NUM_SHARDS; i++) {
+            std::unique_lock <std::mutex> lock(shards_[i].lock);
+            shards_[i].table.assign(MIN_SHARD_CAPACITY, Slot{key_t(), value_t(), SLOT_EMPTY});
+            shards_[i].num_full = 0;
+            shards_[i].num_erased = 0;
+        }
+    }
+
+    // Pre-sizes every shard for about num_elements entries in total, e.g. before a bulk load
+    void reserve(size_t num_elements) {
+        size_t per_shard = num_elements / NUM_SHARDS + 1;
+        size_t capacity = MIN_SHARD_CAPACITY;
+        while (capacity * 3 < per_shard * 4)
+            capacity *= 2;
+        for (size_t i = 0; i < NUM_SHARDS; i++) {
+            std::unique_lock <std::mutex> lock(shards_[i].lock);
+            if (shards_[i].table.size() < capacity)
+                rehash(shards_[i], capacity);
+        }
+    }
+};
+}  // namespace hnswlib
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+namespace hnswlib {
+///////////////////////////////////////////////////////////
+//
+// Vector compression shared by the disk and IVF indexes:
+// Lloyd k-means and an 8-bit product quantizer with
+// asymmetric distance computation (ADC) lookup tables.
+//
+/////////////////////////////////////////////////////////
+
+static inline float squaredL2(const float *a, const float *b, size_t dim) {
+    float sum = 0;
+    for (size_t i = 0; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+
+static inline float innerProduct(const float *a, const float *b, size_t dim) {
+    float sum = 0;
+    for (size_t i = 0; i < dim; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+
+/*
+* Clusters n vectors of dim floats into k centroids (k * dim floats, written to centroids).
+* Centroids start at distinct random points; a cluster that runs empty is reseeded at a
+* random point so all k centroids stay in use. Returns the assignment of every vector.
+*/
+static std::vector<uint32_t> kmeans(const float *data, size_t n, size_t dim, size_t k, float *centroids,
+                                    size_t iterations = 20, unsigned int seed = 100) {
+    if (n == 0 || k == 0)
+        throw std::runtime_error("kmeans needs at least one point and one centroid");
+    std::mt19937 rng(seed);
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+    for (size_t c = 0; c < k; c++)
+        memcpy(centroids + c * dim, data + order[c % n] * dim, dim * sizeof(float));
+
+    std::vector<uint32_t> assignment(n, 0);
+    std::vector<float> sums(k * dim);
+    std::vector<size_t> counts(k);
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    for (size_t iter = 0; iter < iterations; iter++) {
+        bool changed = false;
+        for (size_t i = 0; i < n; i++) {
+            const float *point = data + i * dim;
+            uint32_t best = 0;
+            float best_dist = std::numeric_limits<float>::max();
+            for (size_t c = 0; c < k; c++) {
+                float dist = squaredL2(point, centroids + c * dim, dim);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = (uint32_t) c;
+                }
+            }
+            if (assignment[i] != best || iter == 0) {
+                changed = true;
+                assignment[i] = best;
+            }
+        }
+        if (!changed)
+            break;
+
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++) {
+            float *sum = sums.data() + assignment[i] * dim;
+            const float *point = data + i * dim;
+            for (size_t d = 0; d < dim; d++)
+                sum[d] += point[d];
+            counts[assignment[i]]++;
+        }
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] == 0) {
+                memcpy(centroids + c * dim, data + pick(rng) * dim, dim * sizeof(float));
+                continue;
+            }
+            for (size_t d = 0; d < dim; d++)
+                centroids[c * dim + d] = sums[c * dim + d] / counts[c];
+        }
+    }
+    return assignment;
+}
+
+
+/*
+* Splits vectors into num_subspaces equal slices and encodes each slice as the index of its
+* nearest of 256 centroids, one byte per slice. Distances to a query are then approximated
+* from a per-query table of slice-to-centroid distances (ADC). With the inner product metric
+* the table holds negated dot products and the distance is 1 - <q, x>, like InnerProductSpace.
+*/
+class ProductQuantizer {
+ public:
+    enum Metric { L2 = 0, INNER_PRODUCT = 1 };
+    static const size_t NUM_CENTROIDS = 256;
+
+    ProductQuantizer() {}
+
+    ProductQuantizer(size_t dim, size_t num_subspaces, Metric metric = L2)
+        : dim_(dim), num_subspaces_(num_subspaces), metric_(metric) {
+        if (num_subspaces == 0 || dim % num_subspaces != 0)
+            throw std::runtime_error("ProductQuantizer: dimension must be a multiple of the number of subspaces");
+        subspace_dim_ = dim / num_subspaces;
+    }
+
+    size_t getDim() const { return dim_; }
+    size_t getCodeSize() const { return num_subspaces_; }
+    Metric getMetric() const { return metric_; }
+    bool isTrained() const { return !codebooks_.empty(); }
+
+
+    // Trains on at most max_training_points of the n vectors, picked at random
+    void train(const float *data, size_t n, size_t max_training_points = 65536, size_t iterations = 20, unsigned int seed = 100) {
+        if (n == 0)
+            throw std::runtime_error("ProductQuantizer: no training data");
+        std::mt19937 rng(seed);
+        std::vector<size_t> sample(n);
+        for (size_t i = 0; i < n; i++)
+            sample[i] = i;
+        if (n > max_training_points) {
+            std::shuffle(sample.begin(), sample.end(), rng);
+            sample.resize(max_training_points);
+        }
+
+        codebooks_.assign(num_subspaces_ * NUM_CENTROIDS * subspace_dim_, 0.0f);
+        std::vector<float> slices(sample.size() * subspace_dim_);
+        for (size_t m = 0; m < num_subspaces_; m++) {
+            for (size_t i = 0; i < sample.size(); i++)
+                memcpy(slices.data() + i * subspace_dim_, data + sample[i] * dim_ + m * subspace_dim_, subspace_dim_ * sizeof(float));
+            size_t k = std::min((size_t) NUM_CENTROIDS, sample.size());
+            kmeans(slices.data(), sample.size(), subspace_dim_, k, codebooks_.data() + m * NUM_CENTROIDS * subspace_dim_,
+                   iterations, seed + (unsigned int) m);
+            // fewer points than centroids: unused codes repeat the first centroid and are never chosen
+            for (size_t c = k; c < NUM_CENTROIDS; c++)
+                memcpy(centroid(m, c), centroid(m, 0), subspace_dim_ * sizeof(float));
+        }
+    }
+
+
+    void encode(const float *vector, uint8_t *code) const {
+        for (size_t m = 0; m < num_subspaces_; m++) {
+            const float *slice = vector + m * subspace_dim_;
+            size_t best = 0;
+            float best_dist = std::numeric_limits<float>::max();
+            for (size_t c = 0; c < NUM_CENTROIDS; c++) {
+                float dist = squaredL2(slice, centroid(m, c), subspace_dim_);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = c;
+                }
+            }
+            code[m] = (uint8_t) best;
+        }
+    }
+
+
+    void decode(const uint8_t *code, float *vector) const {
+        for (size_t m = 0; m < num_subspaces_; m++)
+            memcpy(vector + m * subspace_dim_, centroid(m, code[m]), subspace_dim_ * sizeof(float));
+    }
+
+
+    // Fills table (num_subspaces * 256 floats) for distances from query to encoded vectors
+    void computeTable(const float *query, float *table) const {
+        for (size_t m = 0; m < num_subspaces_; m++) {
+            const float *slice = query + m * subspace_dim_;
+            float *row = table + m * NUM_CENTROIDS;
+            for (size_t c = 0; c < NUM_CENTROIDS; c++) {
+                if (metric_ == L2)
+                    row[c] = squaredL2(slice, centroid(m, c), subspace_dim_);
+                else
+                    row[c] = -innerProduct(slice, centroid(m, c), subspace_dim_);
+            }
+        }
+    }
+
+
+    float distance(const float *table, const uint8_t *code) const {
+        float sum = 0;
+        for (size_t m = 0; m < num_subspaces_; m++)
+            sum += table[m * NUM_CENTROIDS + code[m]];
+        return metric_ == L2 ? sum : 1.0f + sum;
+    }
+
+
+    /*
+    * distance() for n consecutive codes, written to out. On x86 CPUs with AVX2 the table
+    * entries of eight codes are fetched per gather; the check runs once, so builds without
+    * -mavx2 still use it.
+    */
+    void distances(const float *table, const uint8_t *codes, size_t n, float *out) const {
+        size_t i = 0;
+#if defined(USE_SSE) && defined(__GNUC__)
+        static const bool avx2 = AVX2Capable();
+        if (avx2 && num_subspaces_ >= 4)
+            i = distancesAVX2(table, codes, n, out);
+#endif
+        for (; i < n; i++)
+            out[i] = distance(table, codes + i * num_subspaces_);
+    }
+
+
+    void save(std::ostream &output) const {
+        writeBinaryPOD(output, dim_);
+        writeBinaryPOD(output, num_subspaces_);
+        int metric = metric_;
+        writeBinaryPOD(output, metric);
+        output.write((const char *) codebooks_.data(), codebooks_.size() * sizeof(float));
+    }
+
+
+    void load(std::istream &input) {
+        int metric;
+        readBinaryPOD(input, dim_);
+        readBinaryPOD(input, num_subspaces_);
+        readBinaryPOD(input, metric);
+        metric_ = (Metric) metric;
+        if (num_subspaces_ == 0 || dim_ % num_subspaces_ != 0)
+            throw std::runtime_error("ProductQuantizer: corrupt codebook header");
+        subspace_dim_ = dim_ / num_subspaces_;
+        codebooks_.resize(num_subspaces_ * NUM_CENTROIDS * subspace_dim_);
+        input.read((char *) codebooks_.data(), codebooks_.size() * sizeof(float));
+    }
+
+ private:
+#if defined(USE_SSE) && defined(__GNUC__)
+    /*
+    * The AVX2 part of distances(); returns how many codes it wrote. The byte gathers read up
+    * to 3 bytes past a code, so the loop stops one code early.
+    */
+    __attribute__((target("avx2")))
+    size_t distancesAVX2(const float *table, const uint8_t *codes, size_t n, float *out) const {
+        const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                   _mm256_set1_epi32((int) num_subspaces_));
+        const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+        const __m256 bias = _mm256_set1_ps(metric_ == L2 ? 0.0f : 1.0f);
+        size_t i = 0;
+        for (; i + 8 < n; i += 8) {
+            const uint8_t *block = codes + i * num_subspaces_;
+            __m256 sum = bias;
+            for (size_t m = 0; m < num_subspaces_; m++) {
+                __m256i bytes = _mm256_i32gather_epi32((const int *) (block + m), offsets, 1);
+                __m256i index = _mm256_add_epi32(_mm256_and_si256(bytes, byte_mask),
+                                                 _mm256_set1_epi32((int) (m * NUM_CENTROIDS)));
+                sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table, index, 4));
+            }
+            _mm256_storeu_ps(out + i, sum);
+        }
+        return i;
+    }
+#endif
+
+    inline float *centroid(size_t m, size_t c) {
+        return codebooks_.data() + (m * NUM_CENTROIDS + c) * subspace_dim_;
+    }
+
+    inline const float *centroid(size_t m, size_t c) const {
+        return codebooks_.data() + (m * NUM_CENTROIDS + c) * subspace_dim_;
+    }
+
+    size_t dim_{0};
+    size_t num_subspaces_{0};
+    size_t subspace_dim_{0};
+    Metric metric_{L2};
+    std::vector<float> codebooks_;  // num_subspaces x 256 centroids x subspace_dim
+};
+}  // namespace hnswlib
@@ -115,6 +115,7 @@ class MultiVectorInnerProductSpace : public BaseMultiVectorSpace<DOCIDTYPE> {
         else if (dim > 4)
             fstdistfunc_ = InnerProductDistanceSIMD4ExtResiduals;
 #endif
+        dim_ = dim;
         vector_size_ = dim * sizeof(float);
         data_size_ = vector_size_ + sizeof(DOCIDTYPE);
     }
@@ -273,4 +274,80 @@ class EpsilonSearchStopCondition : public BaseSearchStopCondition<dist_t> {
 
     ~EpsilonSearchStopCondition() {}
 };
+
+template<typename dist_t>
+class AdaptiveSearchStopCondition : public BaseSearchStopCondition<dist_t> {
+    size_t k_;
+    size_t max_num_candidates_;
+    size_t patience_;
+    float min_relative_gain_;
+    size_t curr_num_items_;
+    size_t expansions_since_gain_;
+    std::priority_queue<dist_t> top_k_;  // distances of the k best results, worst on top
+
+ public:
+    /*
+    * Searches like a fixed ef = max_num_candidates search, but stops early once the best k
+    * results have not gained a point for patience expansions in a row. With a positive
+    * min_relative_gain a newcomer only counts if it beats the k-th best distance by that
+    * fraction, so slow creeping improvements (a plateaued distance gap) also end the search.
+    */
+    AdaptiveSearchStopCondition(size_t k, size_t max_num_candidates, size_t patience = 16, float min_relative_gain = 0.0f) {
+        k_ = std::max<size_t>(k, 1);
+        max_num_candidates_ = std::max(max_num_candidates, k_);
+        patience_ = patience;
+        min_relative_gain_ = min_relative_gain;
+        curr_num_items_ = 0;
+        expansions_since_gain_ = 0;
+    }
+
+    void add_point_to_result(labeltype /*label*/, const void * /*datapoint*/, dist_t dist) override {
+        curr_num_items_ += 1;
+        if (top_k_.size() < k_) {
+            top_k_.push(dist);
+            expansions_since_gain_ = 0;
+        } else if (dist < top_k_.top()) {
+            if (dist < top_k_.top() * (1 - min_relative_gain_))
+                expansions_since_gain_ = 0;
+            top_k_.pop();
+            top_k_.push(dist);
+        }
+    }
+
+    void remove_point_from_result(labeltype /*label*/, const void * /*datapoint*/, dist_t /*dist*/) override {
+        // only the farthest of more than max_num_candidates >= k results is removed,
+        // which never belongs to the best k
+        curr_num_items_ -= 1;
+    }
+
+    bool should_stop_search(dist_t candidate_dist, dist_t lowerBound) override {
+        if (candidate_dist > lowerBound && curr_num_items_ == max_num_candidates_) {
+            // new candidate can't improve found results
+            return true;
+        }
+        if (top_k_.size() == k_ && expansions_since_gain_ >= patience_) {
+            // best k have been stable for long enough
+            return true;
+        }
+        expansions_since_gain_ += 1;
+        return false;
+    }
+
+    bool should_consider_candidate(dist_t candidate_dist, dist_t lowerBound) override {
+        bool flag_consider_candidate = curr_num_items_ < max_num_candidates_ || lowerBound > candidate_dist;
+        return flag_consider_candidate;
+    }
+
+    bool should_remove_extra() override {
+        bool flag_remove_extra = curr_num_items_ > max_num_candidates_;
+        return flag_remove_extra;
+    }
+
+    void filter_results(std::vector<std::pair<dist_t, labeltype >> &candidates) override {
+        if (candidates.size() > k_)
+            candidates.resize(k_);
+    }
+
+    ~AdaptiveSearchStopCondition() {}
+};
 }  // namespace hnswlib
@@ -0,0 +1,1140 @@
+#pragma once
+
+#include "quantization.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdlib.h>
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <aio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace hnswlib {
+///////////////////////////////////////////////////////////
+//
+// Disk-resident Vamana (DiskANN-style) graph index.
+// Once written, only product-quantized codes and the label
+// table stay in memory; full vectors and adjacency lists live
+// in page-aligned blocks on disk and are read per hop of a
+// beam search, so searching is bounded by the codes rather
+// than by the corpus.
+//
+// Points are staged in memory with addPoint(). The first
+// saveIndex() builds the whole graph in memory before writing it,
+// about data_size + 4 * max_degree bytes per point. Later saves
+// merge instead: the staged points are linked into the written
+// graph and edges into deleted points are repaired while the file
+// is streamed into a new one, so memory holds the staged points
+// and the adjacency lists they touch, not the corpus. Deleted
+// points stay in the file as unreachable tombstones until the
+// index is built anew.
+//
+/////////////////////////////////////////////////////////
+
+class DiskVamana : public AlgorithmInterface<float> {
+ public:
+    static const size_t PAGE_SIZE = 4096;
+    static const uint64_t FILE_MAGIC = 0x3330414e414d4156ULL;  // "VAMANA03"
+    static const uint64_t FILE_MAGIC_V2 = 0x3230414e414d4156ULL;  // "VAMANA02", without tombstones
+    static const size_t MAX_BATCHED_READS = 16;  // AIO_LISTIO_MAX on macOS
+    static const size_t STREAM_BLOCKS = 64;  // read at once while a merge copies the file
+
+    /*
+    * Prepares an index for building. max_degree bounds the adjacency of every node,
+    * build_list_size is the search list used while building and alpha > 1 keeps some longer
+    * edges so searches converge in few hops. pq_subspaces = 0 picks about 4 dimensions per byte.
+    */
+    DiskVamana(SpaceInterface<float> *s, size_t max_degree = 64, size_t build_list_size = 100,
+               float alpha = 1.2f, size_t pq_subspaces = 0, size_t num_threads = 0)
+        : max_degree_(max_degree), build_list_size_(build_list_size), alpha_(alpha), pq_subspaces_(pq_subspaces) {
+        initSpace(s);
+        num_threads_ = num_threads ? num_threads : std::max<unsigned int>(1, std::thread::hardware_concurrency());
+    }
+
+
+    DiskVamana(SpaceInterface<float> *s, const std::string &location) {
+        initSpace(s);
+        num_threads_ = 1;
+        loadIndex(location, s);
+    }
+
+
+    ~DiskVamana() {
+        closeFile();
+    }
+
+
+    /*
+    * Stages a point for the next saveIndex(), where it replaces the point written with the same
+    * label. It is not searchable before.
+    */
+    void addPoint(const void *datapoint, labeltype label, bool replace_deleted = false) override {
+        (void) replace_deleted;
+        {
+            std::unique_lock <std::mutex> lock(staging_lock_);
+            staged_data_.insert(staged_data_.end(), (const char *) datapoint, (const char *) datapoint + data_size_);
+            staged_labels_.push_back(label);
+        }
+        unmarkDelete(label);
+    }
+
+
+    /*
+    * Writes the index to location and opens it for searching. A new index builds the graph
+    * over the staged points in memory, see above; an open one merges them into its file.
+    */
+    void saveIndex(const std::string &location) override {
+        if (isOpen()) {
+            mergeStaged(location);
+            return;
+        }
+        size_t n = staged_labels_.size();
+        if (n == 0)
+            throw std::runtime_error("DiskVamana: no points to build an index from");
+        if (n > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("DiskVamana: too many points");
+
+        ProductQuantizer pq(dim_, pickSubspaces(), metric_);
+        pq.train((const float *) staged_data_.data(), n);
+        std::vector<uint8_t> codes(n * pq.getCodeSize());
+        for (size_t i = 0; i < n; i++)
+            pq.encode((const float *) (staged_data_.data() + i * data_size_), codes.data() + i * pq.getCodeSize());
+
+        uint32_t medoid = findMedoid();
+        std::vector<std::vector<uint32_t>> graph = buildGraph(medoid);
+        std::string temporary = location + ".tmp";
+        writeFile(temporary, n, medoid, pq, codes, std::vector<uint32_t>(), [&](uint32_t id, char *node) {
+            writeNode(node, stagedPoint(id), staged_labels_[id], graph[id]);
+        });
+        installFile(temporary, location);
+    }
+
+
+    void loadIndex(const std::string &location, SpaceInterface<float> *s) {
+        closeFile();
+        initSpace(s);
+        std::ifstream input(location, std::ios::binary);
+        if (!input.is_open())
+            throw std::runtime_error("Cannot open file");
+
+        uint64_t magic;
+        size_t data_size;
+        readBinaryPOD(input, magic);
+        readBinaryPOD(input, data_size);
+        readBinaryPOD(input, num_points_);
+        readBinaryPOD(input, max_degree_);
+        readBinaryPOD(input, medoid_);
+        readBinaryPOD(input, node_size_);
+        readBinaryPOD(input, nodes_per_page_);
+        readBinaryPOD(input, pages_per_node_);
+        uint64_t pq_offset;
+        readBinaryPOD(input, pq_offset);
+        if ((magic != FILE_MAGIC && magic != FILE_MAGIC_V2) || data_size != data_size_)
+            throw std::runtime_error("Not a DiskVamana index for this space");
+
+        input.seekg(pq_offset);
+        pq_.load(input);
+        codes_.resize(num_points_ * pq_.getCodeSize());
+        input.read((char *) codes_.data(), codes_.size());
+        std::vector<labeltype> labels(num_points_);
+        input.read((char *) labels.data(), num_points_ * sizeof(labeltype));
+        std::vector<uint32_t> tombstones;
+        if (magic == FILE_MAGIC) {
+            uint64_t tombstone_count;
+            readBinaryPOD(input, tombstone_count);
+            tombstones.resize(tombstone_count);
+            input.read((char *) tombstones.data(), tombstone_count * sizeof(uint32_t));
+        }
+        if (!input)
+            throw std::runtime_error("DiskVamana: index file is truncated");
+        input.close();
+
+        // A point written again later replaces the earlier node of its label
+        ids_.clear();
+        ids_.reserve(num_points_);
+        for (size_t i = 0; i < num_points_; i++)
+            ids_[labels[i]] = (uint32_t) i;
+        tombstones_.clear();
+        {
+            std::unique_lock <std::mutex> lock(deleted_lock_);
+            deleted_.clear();
+            for (uint32_t id : tombstones) {
+                if (id >= num_points_)
+                    throw std::runtime_error("DiskVamana: corrupt tombstone list");
+                tombstones_.insert(id);
+                if (ids_[labels[id]] == id)
+                    deleted_.insert(labels[id]);
+            }
+        }
+        openFile(location);
+        location_ = location;
+    }
+
+
+    // True for labels in the written index that are not marked deleted
+    bool contains(labeltype label) const {
+        return ids_.count(label) != 0 && isLive(label);
+    }
+
+
+    // Reads the full vector of label from its block on disk; false unless contains(label)
+    bool readVector(labeltype label, void *out) const {
+        auto found = ids_.find(label);
+        if (!isOpen() || found == ids_.end() || !isLive(label))
+            return false;
+        char *buffer = allocateBlocks(blockReadSize());
+        try {
+            readBlock(found->second, buffer);
+        } catch (...) {
+            freeBlocks(buffer);
+            throw;
+        }
+        memcpy(out, buffer + nodeOffsetInBlock(found->second), data_size_);
+        freeBlocks(buffer);
+        return true;
+    }
+
+
+    // Search list size; larger is more accurate and reads more blocks
+    void setSearchListSize(size_t search_list_size) {
+        search_list_size_ = search_list_size;
+    }
+
+
+    // Blocks read together per hop
+    void setBeamWidth(size_t beam_width) {
+        beam_width_ = std::max<size_t>(1, beam_width);
+    }
+
+
+    void markDelete(labeltype label) {
+        std::unique_lock <std::mutex> lock(deleted_lock_);
+        deleted_.insert(label);
+    }
+
+
+    void unmarkDelete(labeltype label) {
+        std::unique_lock <std::mutex> lock(deleted_lock_);
+        deleted_.erase(label);
+    }
+
+
+    size_t getCurrentElementCount() const {
+        return isOpen() ? num_points_ : staged_labels_.size();
+    }
+
+
+    // Written points that are deleted or replaced; each save keeps them in the file as tombstones
+    size_t getDeletedCount() const {
+        std::unique_lock <std::mutex> lock(deleted_lock_);
+        size_t count = tombstones_.size();
+        for (labeltype label : deleted_) {
+            auto found = ids_.find(label);
+            if (found != ids_.end() && tombstones_.count(found->second) == 0)
+                count++;
+        }
+        return count;
+    }
+
+
+    /*
+    * Beam search: each hop reads the blocks of the beam_width closest unexpanded candidates
+    * together, ranks their neighbors by PQ distance and the expanded nodes themselves by
+    * exact distance.
+    */
+    std::priority_queue<std::pair<float, labeltype>>
+    searchKnn(const void *query_data, size_t k, BaseFilterFunctor* isIdAllowed = nullptr) const override {
+        std::priority_queue<std::pair<float, labeltype>> result;
+        if (!isOpen() || num_points_ == 0 || k == 0)
+            return result;
+
+        std::vector<float> table(pq_.getCodeSize() * ProductQuantizer::NUM_CENTROIDS);
+        pq_.computeTable((const float *) query_data, table.data());
+
+        struct Candidate {
+            float dist;
+            uint32_t id;
+            bool expanded;
+        };
+        size_t list_size = std::max(search_list_size_, k);
+        std::vector<Candidate> candidates;
+        candidates.reserve(list_size + 1);
+        std::unordered_set<uint32_t> visited;
+        auto offer = [&](uint32_t id) {
+            if (!visited.insert(id).second)
+                return;
+            float dist = pq_.distance(table.data(), codes_.data() + (size_t) id * pq_.getCodeSize());
+            if (candidates.size() >= list_size && dist >= candidates.back().dist)
+                return;
+            auto pos = std::lower_bound(candidates.begin(), candidates.end(), dist,
+                                        [](const Candidate &c, float d) { return c.dist < d; });
+            candidates.insert(pos, Candidate{dist, id, false});
+            if (candidates.size() > list_size)
+                candidates.pop_back();
+        };
+        offer(medoid_);
+
+        size_t read_size = blockReadSize();
+        char *buffers = allocateBlocks(beam_width_ * read_size);
+        std::vector<uint32_t> beam;
+        std::vector<uint32_t> neighbors;
+        try {
+            while (true) {
+                beam.clear();
+                for (Candidate &c : candidates) {
+                    if (!c.expanded) {
+                        c.expanded = true;
+                        beam.push_back(c.id);
+                        if (beam.size() == beam_width_)
+                            break;
+                    }
+                }
+                if (beam.empty())
+                    break;
+
+                readBlocks(beam, buffers);
+
+                for (size_t b = 0; b < beam.size(); b++) {
+                    const char *node = buffers + b * read_size + nodeOffsetInBlock(beam[b]);
+                    labeltype label;
+                    uint32_t degree;
+                    memcpy(&label, node + data_size_, sizeof(labeltype));
+                    memcpy(&degree, node + data_size_ + sizeof(labeltype), sizeof(uint32_t));
+                    degree = std::min<uint32_t>(degree, (uint32_t) max_degree_);
+
+                    if (isLiveNode(beam[b], label) && (!isIdAllowed || (*isIdAllowed)(label))) {
+                        float dist = fstdistfunc_(query_data, node, dist_func_param_);
+                        if (result.size() < k || dist < result.top().first) {
+                            result.emplace(dist, label);
+                            if (result.size() > k)
+                                result.pop();
+                        }
+                    }
+
+                    neighbors.resize(degree);
+                    if (degree)
+                        memcpy(neighbors.data(), node + data_size_ + sizeof(labeltype) + sizeof(uint32_t), degree * sizeof(uint32_t));
+                    for (uint32_t neighbor : neighbors) {
+                        if (neighbor < num_points_)
+                            offer(neighbor);
+                    }
+                }
+            }
+        } catch (...) {
+            freeBlocks(buffers);
+            throw;
+        }
+        freeBlocks(buffers);
+        return result;
+    }
+
+ private:
+    void initSpace(SpaceInterface<float> *s) {
+        space_ = s;
+        data_size_ = s->get_data_size();
+        dim_ = data_size_ / sizeof(float);
+        fstdistfunc_ = s->get_dist_func();
+        dist_func_param_ = s->get_dist_func_param();
+        metric_ = dynamic_cast<InnerProductSpace *>(s) ? ProductQuantizer::INNER_PRODUCT : ProductQuantizer::L2;
+    }
+
+
+    size_t pickSubspaces() const {
+        if (pq_subspaces_)
+            return pq_subspaces_;
+        size_t m = std::max<size_t>(1, dim_ / 4);
+        while (dim_ % m != 0)
+            m--;
+        return m;
+    }
+
+
+    inline const char *stagedPoint(uint32_t id) const {
+        return staged_data_.data() + (size_t) id * data_size_;
+    }
+
+
+    inline float stagedDistance(uint32_t a, uint32_t b) const {
+        return fstdistfunc_(stagedPoint(a), stagedPoint(b), dist_func_param_);
+    }
+
+
+    // Entry point of every search: the point closest to the mean
+    uint32_t findMedoid() const {
+        size_t n = staged_labels_.size();
+        std::vector<float> mean(dim_, 0.0f);
+        for (size_t i = 0; i < n; i++) {
+            const float *point = (const float *) stagedPoint((uint32_t) i);
+            for (size_t d = 0; d < dim_; d++)
+                mean[d] += point[d] / n;
+        }
+        uint32_t medoid = 0;
+        float best = std::numeric_limits<float>::max();
+        for (size_t i = 0; i < n; i++) {
+            float dist = squaredL2(mean.data(), (const float *) stagedPoint((uint32_t) i), dim_);
+            if (dist < best) {
+                best = dist;
+                medoid = (uint32_t) i;
+            }
+        }
+        return medoid;
+    }
+
+
+    /*
+    * Vamana construction: starting from a random regular graph, every point is searched for
+    * from the medoid and linked to a robust-pruned subset of the nodes visited on the way,
+    * with back edges. A first pass with alpha = 1 and a second with alpha_ as in DiskANN.
+    */
+    std::vector<std::vector<uint32_t>> buildGraph(uint32_t medoid) const {
+        size_t n = staged_labels_.size();
+        size_t degree = std::min(max_degree_, n - 1);
+        std::vector<std::vector<uint32_t>> graph(n);
+        std::vector<std::mutex> locks(n);
+
+        std::mt19937 rng(100);
+        std::uniform_int_distribution<uint32_t> pick(0, (uint32_t) (n - 1));
+        for (size_t i = 0; i < n; i++) {
+            std::unordered_set<uint32_t> chosen;
+            while (chosen.size() < degree) {
+                uint32_t j = pick(rng);
+                if (j != i)
+                    chosen.insert(j);
+            }
+            graph[i].assign(chosen.begin(), chosen.end());
+        }
+
+        std::vector<uint32_t> order(n);
+        for (size_t i = 0; i < n; i++)
+            order[i] = (uint32_t) i;
+
+        for (float alpha : {1.0f, alpha_}) {
+            std::shuffle(order.begin(), order.end(), rng);
+            std::atomic<size_t> next{0};
+            auto worker = [&]() {
+                size_t i;
+                while ((i = next.fetch_add(1)) < n) {
+                    uint32_t point = order[i];
+                    std::vector<std::pair<float, uint32_t>> pool = searchForBuild(graph, locks, medoid, point);
+                    {
+                        std::unique_lock <std::mutex> lock(locks[point]);
+                        for (uint32_t neighbor : graph[point])
+                            pool.emplace_back(stagedDistance(point, neighbor), neighbor);
+                    }
+                    std::vector<uint32_t> pruned = robustPrune(point, pool, alpha, [this](uint32_t a, uint32_t b) { return stagedDistance(a, b); });
+                    {
+                        std::unique_lock <std::mutex> lock(locks[point]);
+                        graph[point] = pruned;
+                    }
+                    for (uint32_t neighbor : pruned)
+                        addBackEdge(graph, locks, neighbor, point, alpha);
+                }
+            };
+            std::vector<std::thread> threads;
+            for (size_t t = 1; t < num_threads_; t++)
+                threads.emplace_back(worker);
+            worker();
+            for (std::thread &thread : threads)
+                thread.join();
+        }
+        return graph;
+    }
+
+
+    // Greedy search over the graph under construction; returns every expanded node
+    std::vector<std::pair<float, uint32_t>> searchForBuild(const std::vector<std::vector<uint32_t>> &graph,
+                                                           std::vector<std::mutex> &locks,
+                                                           uint32_t medoid, uint32_t point) const {
+        struct Candidate {
+            float dist;
+            uint32_t id;
+            bool expanded;
+        };
+        std::vector<Candidate> candidates;
+        std::unordered_set<uint32_t> visited;
+        std::vector<std::pair<float, uint32_t>> expanded;
+        std::vector<uint32_t> neighbors;
+
+        candidates.push_back(Candidate{stagedDistance(point, medoid), medoid, false});
+        visited.insert(medoid);
+        while (true) {
+            auto it = std::find_if(candidates.begin(), candidates.end(), [](const Candidate &c) { return !c.expanded; });
+            if (it == candidates.end())
+                break;
+            it->expanded = true;
+            uint32_t current = it->id;
+            if (current != point)
+                expanded.emplace_back(it->dist, current);
+            {
+                std::unique_lock <std::mutex> lock(locks[current]);
+                neighbors = graph[current];
+            }
+            for (uint32_t neighbor : neighbors) {
+                if (!visited.insert(neighbor).second)
+                    continue;
+                float dist = stagedDistance(point, neighbor);
+                if (candidates.size() >= build_list_size_ && dist >= candidates.back().dist)
+                    continue;
+                auto pos = std::lower_bound(candidates.begin(), candidates.end(), dist,
+                                            [](const Candidate &c, float d) { return c.dist < d; });
+                candidates.insert(pos, Candidate{dist, neighbor, false});
+                if (candidates.size() > build_list_size_)
+                    candidates.pop_back();
+            }
+        }
+        return expanded;
+    }
+
+
+    // Keeps the closest candidates that are not already covered by a kept one (alpha-RNG rule);
+    // distance(a, b) gives the distance between two candidates
+    template <typename Distance>
+    std::vector<uint32_t> robustPrune(uint32_t point, std::vector<std::pair<float, uint32_t>> &pool, float alpha,
+                                      Distance distance) const {
+        std::sort(pool.begin(), pool.end());
+        pool.erase(std::unique(pool.begin(), pool.end(),
+                               [](const std::pair<float, uint32_t> &a, const std::pair<float, uint32_t> &b) { return a.second == b.second; }),
+                   pool.end());
+        std::vector<uint32_t> kept;
+        std::vector<bool> covered(pool.size(), false);
+        for (size_t i = 0; i < pool.size() && kept.size() < max_degree_; i++) {
+            if (covered[i] || pool[i].second == point)
+                continue;
+            kept.push_back(pool[i].second);
+            for (size_t j = i + 1; j < pool.size(); j++) {
+                if (!covered[j] && alpha * distance(pool[i].second, pool[j].second) <= pool[j].first)
+                    covered[j] = true;
+            }
+        }
+        return kept;
+    }
+
+
+    void addBackEdge(std::vector<std::vector<uint32_t>> &graph, std::vector<std::mutex> &locks,
+                     uint32_t node, uint32_t point, float alpha) const {
+        std::unique_lock <std::mutex> lock(locks[node]);
+        std::vector<uint32_t> &adjacency = graph[node];
+        if (std::find(adjacency.begin(), adjacency.end(), point) != adjacency.end())
+            return;
+        if (adjacency.size() < max_degree_) {
+            adjacency.push_back(point);
+            return;
+        }
+        std::vector<std::pair<float, uint32_t>> pool;
+        pool.reserve(adjacency.size() + 1);
+        for (uint32_t neighbor : adjacency)
+            pool.emplace_back(stagedDistance(node, neighbor), neighbor);
+        pool.emplace_back(stagedDistance(node, point), point);
+        adjacency = robustPrune(node, pool, alpha, [this](uint32_t a, uint32_t b) { return stagedDistance(a, b); });
+    }
+
+
+    /*
+    * Layout: a header page, then node blocks (vector, label, degree, max_degree neighbor ids)
+    * packed whole into pages, then the PQ codebook, the codes and the labels in node order,
+    * which are loaded into memory, and the tombstoned node ids. fill(id, node) writes each
+    * node into its zeroed slot, in node order.
+    */
+    void writeFile(const std::string &location, size_t n, uint32_t medoid, const ProductQuantizer &pq,
+                   const std::vector<uint8_t> &codes, const std::vector<uint32_t> &tombstones,
+                   const std::function<void(uint32_t, char *)> &fill) {
+        node_size_ = data_size_ + sizeof(labeltype) + sizeof(uint32_t) + max_degree_ * sizeof(uint32_t);
+        nodes_per_page_ = PAGE_SIZE / node_size_;
+        pages_per_node_ = nodes_per_page_ ? 1 : (node_size_ + PAGE_SIZE - 1) / PAGE_SIZE;
+        size_t node_pages = nodes_per_page_ ? (n + nodes_per_page_ - 1) / nodes_per_page_ : n * pages_per_node_;
+        uint64_t pq_offset = (1 + node_pages) * PAGE_SIZE;
+
+        std::ofstream output(location, std::ios::binary | std::ios::trunc);
+        if (!output.is_open())
+            throw std::runtime_error("Cannot open file");
+
+        std::vector<char> page(PAGE_SIZE, 0);
+        {
+            std::ostringstream header;
+            uint64_t magic = FILE_MAGIC;
+            writeBinaryPOD(header, magic);
+            writeBinaryPOD(header, data_size_);
+            writeBinaryPOD(header, n);
+            writeBinaryPOD(header, max_degree_);
+            writeBinaryPOD(header, medoid);
+            writeBinaryPOD(header, node_size_);
+            writeBinaryPOD(header, nodes_per_page_);
+            writeBinaryPOD(header, pages_per_node_);
+            writeBinaryPOD(header, pq_offset);
+            std::string bytes = header.str();
+            memcpy(page.data(), bytes.data(), bytes.size());
+            output.write(page.data(), PAGE_SIZE);
+        }
+
+        std::vector<labeltype> labels(n);
+        std::vector<char> block(blockReadSize(), 0);
+        for (size_t i = 0; i < n; i++) {
+            size_t slot = nodes_per_page_ ? i % nodes_per_page_ : 0;
+            char *node = block.data() + slot * node_size_;
+            fill((uint32_t) i, node);
+            labels[i] = nodeLabel(node);
+            bool block_full = !nodes_per_page_ || slot + 1 == nodes_per_page_ || i + 1 == n;
+            if (block_full) {
+                output.write(block.data(), block.size());
+                std::fill(block.begin(), block.end(), 0);
+            }
+        }
+
+        pq.save(output);
+        output.write((const char *) codes.data(), n * pq.getCodeSize());
+        output.write((const char *) labels.data(), n * sizeof(labeltype));
+        uint64_t tombstone_count = tombstones.size();
+        writeBinaryPOD(output, tombstone_count);
+        output.write((const char *) tombstones.data(), tombstone_count * sizeof(uint32_t));
+        if (!output)
+            throw std::runtime_error("DiskVamana: failed to write index");
+        output.close();
+    }
+
+
+    // Moves the written file over location and opens it; indexes open on the old file keep reading it
+    void installFile(const std::string &temporary, const std::string &location) {
+        closeFile();
+        if (std::rename(temporary.c_str(), location.c_str()) != 0) {
+            std::remove(location.c_str());
+            if (std::rename(temporary.c_str(), location.c_str()) != 0)
+                throw std::runtime_error("DiskVamana: failed to replace index file");
+        }
+        std::vector<char>().swap(staged_data_);
+        std::vector<labeltype>().swap(staged_labels_);
+        loadIndex(location, space_);
+    }
+
+
+    inline void writeNode(char *node, const void *vector, labeltype label, const std::vector<uint32_t> &adjacency) const {
+        uint32_t degree = (uint32_t) std::min(adjacency.size(), max_degree_);
+        memcpy(node, vector, data_size_);
+        memcpy(node + data_size_, &label, sizeof(labeltype));
+        memcpy(node + data_size_ + sizeof(labeltype), &degree, sizeof(uint32_t));
+        if (degree)
+            memcpy(node + data_size_ + sizeof(labeltype) + sizeof(uint32_t), adjacency.data(), degree * sizeof(uint32_t));
+    }
+
+
+    inline labeltype nodeLabel(const char *node) const {
+        labeltype label;
+        memcpy(&label, node + data_size_, sizeof(labeltype));
+        return label;
+    }
+
+
+    inline std::vector<uint32_t> nodeAdjacency(const char *node) const {
+        uint32_t degree;
+        memcpy(&degree, node + data_size_ + sizeof(labeltype), sizeof(uint32_t));
+        std::vector<uint32_t> adjacency(std::min<uint32_t>(degree, (uint32_t) max_degree_));
+        if (!adjacency.empty())
+            memcpy(adjacency.data(), node + data_size_ + sizeof(labeltype) + sizeof(uint32_t), adjacency.size() * sizeof(uint32_t));
+        return adjacency;
+    }
+
+
+    /*
+    * State of a merge. Nodes below written are in the open file, the staged points follow in
+    * staging order. Distances involving written nodes use their decoded PQ codes, so only the
+    * blocks whose adjacency is needed are read.
+    */
+    struct MergeState {
+        size_t written{0};
+        uint32_t medoid{0};
+        std::vector<bool> dead;  // deleted or replaced, over written and staged nodes
+        std::vector<std::vector<uint32_t>> added;  // adjacency of the staged nodes
+        std::unordered_map<uint32_t, std::vector<uint32_t>> patched;  // changed adjacency of written nodes
+        std::vector<float> first, second;  // decoded vectors
+        std::unique_ptr<char, void (*)(char *)> block{nullptr, &DiskVamana::freeBlocks};
+    };
+
+
+    /*
+    * Links the staged points into the written graph one at a time with back edges, like
+    * building does, then streams the file into a new one with the new nodes appended. Edges
+    * into points deleted since the last save are replaced by those points' own neighbors on
+    * the way, so nothing reaches them anymore and they stay behind as tombstones.
+    */
+    void mergeStaged(const std::string &location) {
+        size_t written = num_points_;
+        size_t staged = staged_labels_.size();
+        size_t n = written + staged;
+        if (n > std::numeric_limits<uint32_t>::max())
+            throw std::runtime_error("DiskVamana: too many points");
+        if (staged == 0 && location == location_ && getDeletedCount() == tombstones_.size())
+            return;  // the file is up to date
+        size_t code_size = pq_.getCodeSize();
+        size_t read_size = blockReadSize();
+
+        MergeState merge;
+        merge.written = written;
+        merge.dead.assign(n, false);
+        merge.added.resize(staged);
+        merge.first.resize(dim_);
+        merge.second.resize(dim_);
+        merge.block.reset(allocateBlocks((MAX_BATCHED_READS > STREAM_BLOCKS ? MAX_BATCHED_READS : STREAM_BLOCKS) * read_size));
+        for (uint32_t id : tombstones_)
+            merge.dead[id] = true;
+        {
+            std::unique_lock <std::mutex> lock(deleted_lock_);
+            for (labeltype label : deleted_) {
+                auto found = ids_.find(label);
+                if (found != ids_.end())
+                    merge.dead[found->second] = true;
+            }
+        }
+        // A staged point replaces the node of its label, written or staged earlier
+        std::unordered_map<labeltype, uint32_t> staged_ids;
+        for (size_t i = 0; i < staged; i++) {
+            uint32_t id = (uint32_t) (written + i);
+            labeltype label = staged_labels_[i];
+            auto found = ids_.find(label);
+            if (found != ids_.end())
+                merge.dead[found->second] = true;
+            auto earlier = staged_ids.find(label);
+            if (earlier != staged_ids.end())
+                merge.dead[earlier->second] = true;
+            staged_ids[label] = id;
+            if (!isLive(label))
+                merge.dead[id] = true;
+        }
+
+        std::string temporary = location + ".tmp";
+        try {
+            // The codebook stays; staged points are encoded with it
+            codes_.resize(n * code_size);
+            for (size_t i = 0; i < staged; i++)
+                pq_.encode((const float *) stagedPoint((uint32_t) i), codes_.data() + (written + i) * code_size);
+
+            auto distance = [this, &merge](uint32_t a, uint32_t b) {
+                return fstdistfunc_(mergeVector(merge, a, merge.first), mergeVector(merge, b, merge.second), dist_func_param_);
+            };
+            // A deleted medoid hands over to the live node closest to it, or to the first staged one
+            merge.medoid = medoid_;
+            if (merge.dead[medoid_]) {
+                std::vector<float> old_medoid(dim_);
+                pq_.decode(codes_.data() + (size_t) medoid_ * code_size, old_medoid.data());
+                std::vector<std::pair<float, uint32_t>> near = searchForMerge(merge, old_medoid.data(), medoid_);
+                if (!near.empty()) {
+                    merge.medoid = std::min_element(near.begin(), near.end())->second;
+                } else {
+                    for (uint32_t id = (uint32_t) written; id < n; id++) {
+                        if (!merge.dead[id]) {
+                            merge.medoid = id;
+                            break;
+                        }
+                    }
+                }
+            }
+            for (size_t i = 0; i < staged; i++) {
+                uint32_t id = (uint32_t) (written + i);
+                if (merge.dead[id])
+                    continue;
+                std::vector<std::pair<float, uint32_t>> pool = searchForMerge(merge, stagedPoint((uint32_t) i), id);
+                merge.added[i] = robustPrune(id, pool, alpha_, distance);
+                for (uint32_t neighbor : merge.added[i])
+                    mergeBackEdge(merge, neighbor, id, distance);
+            }
+
+            // Adjacency of the nodes deleted since the last save, whose neighbors inherit it
+            std::unordered_map<uint32_t, std::vector<uint32_t>> dead_adjacency;
+            std::vector<uint32_t> reads;
+            for (uint32_t id = 0; id < written; id++) {
+                if (merge.dead[id] && tombstones_.count(id) == 0)
+                    reads.push_back(id);
+            }
+            for (size_t start = 0; start < reads.size(); start += MAX_BATCHED_READS) {
+                std::vector<uint32_t> batch(reads.begin() + start, reads.begin() + std::min(reads.size(), start + MAX_BATCHED_READS));
+                readBlocks(batch, merge.block.get());
+                for (size_t b = 0; b < batch.size(); b++)
+                    dead_adjacency[batch[b]] = nodeAdjacency(merge.block.get() + b * read_size + nodeOffsetInBlock(batch[b]));
+            }
+
+            std::vector<uint32_t> tombstones;
+            for (uint32_t id = 0; id < n; id++) {
+                if (merge.dead[id])
+                    tombstones.push_back(id);
+            }
+
+            // Written blocks are copied in runs of STREAM_BLOCKS, read with one call each
+            size_t pages_per_block = nodes_per_page_ ? 1 : pages_per_node_;
+            size_t written_blocks = nodes_per_page_ ? (written + nodes_per_page_ - 1) / nodes_per_page_ : written;
+            size_t loaded_run = std::numeric_limits<size_t>::max();
+            std::vector<uint32_t> no_neighbors;
+            writeFile(temporary, n, merge.medoid, pq_, codes_, tombstones, [&](uint32_t id, char *node) {
+                if (id >= written) {
+                    size_t i = id - written;
+                    writeNode(node, stagedPoint((uint32_t) i), staged_labels_[i], merge.dead[id] ? no_neighbors : merge.added[i]);
+                    return;
+                }
+                size_t block_index = nodes_per_page_ ? id / nodes_per_page_ : id;
+                size_t run = block_index / STREAM_BLOCKS;
+                if (run != loaded_run) {
+                    size_t first = run * STREAM_BLOCKS;
+                    size_t count = std::min<size_t>(written_blocks - first, +STREAM_BLOCKS);
+                    readPages((1 + first * pages_per_block) * PAGE_SIZE, count * read_size, merge.block.get());
+                    loaded_run = run;
+                }
+                const char *old = merge.block.get() + (block_index % STREAM_BLOCKS) * read_size + nodeOffsetInBlock(id);
+                std::vector<uint32_t> adjacency;
+                // Tombstones keep no edges, except the medoid, where every search starts
+                if (!merge.dead[id] || id == merge.medoid) {
+                    auto found = merge.patched.find(id);
+                    adjacency = found != merge.patched.end() ? found->second : nodeAdjacency(old);
+                    repairAdjacency(merge, id, old, adjacency, dead_adjacency, distance);
+                }
+                writeNode(node, old, nodeLabel(old), adjacency);
+            });
+        } catch (...) {
+            codes_.resize(written * code_size);
+            std::remove(temporary.c_str());
+            throw;
+        }
+        installFile(temporary, location);
+    }
+
+
+    // The vector distances of the merge are taken on: staged points exactly, written ones decoded
+    inline const void *mergeVector(const MergeState &merge, uint32_t id, std::vector<float> &buffer) const {
+        if (id >= merge.written)
+            return stagedPoint((uint32_t) (id - merge.written));
+        pq_.decode(codes_.data() + (size_t) id * pq_.getCodeSize(), buffer.data());
+        return buffer.data();
+    }
+
+
+    // Adjacency of a node as the merge left it so far; reads written nodes into patched
+    std::vector<uint32_t> &mergeAdjacency(MergeState &merge, uint32_t id) const {
+        if (id >= merge.written)
+            return merge.added[id - merge.written];
+        auto found = merge.patched.find(id);
+        if (found != merge.patched.end())
+            return found->second;
+        readBlock(id, merge.block.get());
+        return merge.patched[id] = nodeAdjacency(merge.block.get() + nodeOffsetInBlock(id));
+    }
+
+
+    // Beam search from the medoid for point; returns every live expanded node but self
+    std::vector<std::pair<float, uint32_t>> searchForMerge(MergeState &merge, const void *point, uint32_t self) const {
+        struct Candidate {
+            float dist;
+            uint32_t id;
+            bool expanded;
+        };
+        std::vector<Candidate> candidates;
+        std::unordered_set<uint32_t> visited;
+        std::vector<std::pair<float, uint32_t>> expanded;
+        auto offer = [&](uint32_t id) {
+            if (!visited.insert(id).second)
+                return;
+            float dist = fstdistfunc_(point, mergeVector(merge, id, merge.first), dist_func_param_);
+            if (candidates.size() >= build_list_size_ && dist >= candidates.back().dist)
+                return;
+            auto pos = std::lower_bound(candidates.begin(), candidates.end(), dist,
+                                        [](const Candidate &c, float d) { return c.dist < d; });
+            candidates.insert(pos, Candidate{dist, id, false});
+            if (candidates.size() > build_list_size_)
+                candidates.pop_back();
+        };
+        offer(merge.medoid);
+
+        size_t read_size = blockReadSize();
+        std::vector<Candidate> beam;
+        std::vector<uint32_t> reads;
+        std::vector<uint32_t> neighbors;
+        while (true) {
+            beam.clear();
+            for (Candidate &c : candidates) {
+                if (!c.expanded) {
+                    c.expanded = true;
+                    beam.push_back(c);
+                    if (beam.size() == beam_width_)
+                        break;
+                }
+            }
+            if (beam.empty())
+                break;
+
+            // Nodes the merge has not changed are read from the file, all of a hop at once
+            reads.clear();
+            for (const Candidate &c : beam) {
+                if (c.id < merge.written && merge.patched.count(c.id) == 0)
+                    reads.push_back(c.id);
+            }
+            readBlocks(reads, merge.block.get());
+
+            size_t read = 0;
+            for (const Candidate &c : beam) {
+                if (c.id != self && !merge.dead[c.id])
+                    expanded.emplace_back(c.dist, c.id);
+                if (c.id < merge.written && merge.patched.count(c.id) == 0)
+                    neighbors = nodeAdjacency(merge.block.get() + (read++) * read_size + nodeOffsetInBlock(c.id));
+                else
+                    neighbors = mergeAdjacency(merge, c.id);
+                for (uint32_t neighbor : neighbors) {
+                    if (neighbor < merge.dead.size())
+                        offer(neighbor);
+                }
+            }
+        }
+        return expanded;
+    }
+
+
+    template <typename Distance>
+    void mergeBackEdge(MergeState &merge, uint32_t node, uint32_t point, Distance distance) const {
+        std::vector<uint32_t> &adjacency = mergeAdjacency(merge, node);
+        if (std::find(adjacency.begin(), adjacency.end(), point) != adjacency.end())
+            return;
+        if (adjacency.size() < max_degree_) {
+            adjacency.push_back(point);
+            return;
+        }
+        std::vector<std::pair<float, uint32_t>> pool;
+        pool.reserve(adjacency.size() + 1);
+        for (uint32_t neighbor : adjacency) {
+            if (!merge.dead[neighbor])
+                pool.emplace_back(distance(node, neighbor), neighbor);
+        }
+        pool.emplace_back(distance(node, point), point);
+        adjacency = robustPrune(node, pool, alpha_, distance);
+    }
+
+
+    // Replaces edges into dead nodes by those nodes' live neighbors, pruned; vector is the node's own
+    template <typename Distance>
+    void repairAdjacency(MergeState &merge, uint32_t id, const void *vector, std::vector<uint32_t> &adjacency,
+                         const std::unordered_map<uint32_t, std::vector<uint32_t>> &dead_adjacency, Distance distance) const {
+        if (std::none_of(adjacency.begin(), adjacency.end(), [&merge](uint32_t neighbor) { return merge.dead[neighbor]; }))
+            return;
+        std::vector<std::pair<float, uint32_t>> pool;
+        auto offer = [&](uint32_t candidate) {
+            if (candidate != id && candidate < merge.dead.size() && !merge.dead[candidate])
+                pool.emplace_back(fstdistfunc_(vector, mergeVector(merge, candidate, merge.second), dist_func_param_), candidate);
+        };
+        for (uint32_t neighbor : adjacency) {
+            if (!merge.dead[neighbor]) {
+                offer(neighbor);
+                continue;
+            }
+            auto found = dead_adjacency.find(neighbor);
+            if (found != dead_adjacency.end()) {
+                for (uint32_t candidate : found->second)
+                    offer(candidate);
+            }
+        }
+        adjacency = robustPrune(id, pool, alpha_, distance);
+    }
+
+
+    inline size_t blockReadSize() const {
+        return nodes_per_page_ ? PAGE_SIZE : pages_per_node_ * PAGE_SIZE;
+    }
+
+
+    inline uint64_t blockOffset(uint32_t id) const {
+        size_t page = nodes_per_page_ ? 1 + id / nodes_per_page_ : 1 + (size_t) id * pages_per_node_;
+        return (uint64_t) page * PAGE_SIZE;
+    }
+
+
+    inline size_t nodeOffsetInBlock(uint32_t id) const {
+        return nodes_per_page_ ? (id % nodes_per_page_) * node_size_ : 0;
+    }
+
+
+    inline bool isLive(labeltype label) const {
+        std::unique_lock <std::mutex> lock(deleted_lock_);
+        return deleted_.empty() || deleted_.find(label) == deleted_.end();
+    }
+
+
+    // Live and not replaced by a later node of the same label
+    inline bool isLiveNode(uint32_t id, labeltype label) const {
+        auto found = ids_.find(label);
+        return found != ids_.end() && found->second == id && isLive(label);
+    }
+
+
+    static char *allocateBlocks(size_t size) {
+#if defined(_WIN32)
+        char *buffer = (char *) _aligned_malloc(size, PAGE_SIZE);
+#else
+        char *buffer = nullptr;
+        if (posix_memalign((void **) &buffer, PAGE_SIZE, size) != 0)
+            buffer = nullptr;
+#endif
+        if (buffer == nullptr)
+            throw std::runtime_error("Not enough memory: DiskVamana failed to allocate read buffers");
+        return buffer;
+    }
+
+
+    static void freeBlocks(char *buffer) {
+#if defined(_WIN32)
+        _aligned_free(buffer);
+#else
+        free(buffer);
+#endif
+    }
+
+
+    bool isOpen() const {
+#if defined(_WIN32)
+        return file_.is_open();
+#else
+        return fd_ >= 0;
+#endif
+    }
+
+
+    void openFile(const std::string &location) {
+#if defined(_WIN32)
+        file_.open(location, std::ios::binary);
+        if (!file_.is_open())
+            throw std::runtime_error("Cannot open file");
+#else
+        // Blocks are page aligned, so they can bypass the page cache and keep memory bounded
+    #if defined(O_DIRECT)
+        fd_ = ::open(location.c_str(), O_RDONLY | O_DIRECT);
+        if (fd_ < 0)
+    #endif
+            fd_ = ::open(location.c_str(), O_RDONLY);
+        if (fd_ < 0)
+            throw std::runtime_error("Cannot open file");
+#endif
+    }
+
+
+    void closeFile() {
+#if defined(_WIN32)
+        if (file_.is_open())
+            file_.close();
+#else
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+#endif
+    }
+
+
+    void readBlock(uint32_t id, char *buffer) const {
+        readPages(blockOffset(id), blockReadSize(), buffer);
+    }
+
+
+    /*
+    * Reads the blocks of ids into consecutive buffers of blockReadSize() bytes. They are
+    * submitted together with lio_listio, so the device serves them in parallel instead of one
+    * round trip each; reads that fail or come back short are retried one at a time.
+    */
+    void readBlocks(const std::vector<uint32_t> &ids, char *buffers) const {
+        size_t size = blockReadSize();
+#if !defined(_WIN32)
+        if (ids.size() > 1) {
+            std::vector<struct aiocb> requests(ids.size());
+            std::vector<struct aiocb *> list(ids.size());
+            for (size_t i = 0; i < ids.size(); i++) {
+                memset(&requests[i], 0, sizeof(struct aiocb));
+                requests[i].aio_fildes = fd_;
+                requests[i].aio_buf = buffers + i * size;
+                requests[i].aio_nbytes = size;
+                requests[i].aio_offset = (off_t) blockOffset(ids[i]);
+                requests[i].aio_lio_opcode = LIO_READ;
+                list[i] = &requests[i];
+            }
+            for (size_t start = 0; start < ids.size(); start += MAX_BATCHED_READS) {
+                size_t count = std::min<size_t>(ids.size() - start, +MAX_BATCHED_READS);
+                // Its result only tells that some request failed, so each one is checked
+                lio_listio(LIO_WAIT, list.data() + start, (int) count, nullptr);
+                for (size_t i = start; i < start + count; i++) {
+                    // A signal can end the wait early
+                    while (aio_error(&requests[i]) == EINPROGRESS) {
+                        const struct aiocb *pending[1] = {&requests[i]};
+                        aio_suspend(pending, 1, nullptr);
+                    }
+                    bool done = aio_error(&requests[i]) == 0 && aio_return(&requests[i]) == (ssize_t) size;
+                    if (!done)
+                        readBlock(ids[i], buffers + i * size);
+                }
+            }
+            return;
+        }
+#endif
+        for (size_t i = 0; i < ids.size(); i++)
+            readBlock(ids[i], buffers + i * size);
+    }
+
+
+    void readPages(uint64_t offset, size_t size, char *buffer) const {
+#if defined(_WIN32)
+        std::unique_lock <std::mutex> lock(file_lock_);
+        file_.seekg(offset);
+        file_.read(buffer, size);
+        if (!file_)
+            throw std::runtime_error("DiskVamana: failed to read node block");
+#else
+        size_t done = 0;
+        while (done < size) {
+            ssize_t got = ::pread(fd_, buffer + done, size - done, (off_t) (offset + done));
+            if (got <= 0)
+                throw std::runtime_error("DiskVamana: failed to read node block");
+            done += (size_t) got;
+        }
+#endif
+    }
+
+
+    SpaceInterface<float> *space_{nullptr};
+    size_t data_size_{0};
+    size_t dim_{0};
+    DISTFUNC<float> fstdistfunc_;
+    void *dist_func_param_{nullptr};
+    ProductQuantizer::Metric metric_{ProductQuantizer::L2};
+
+    // build parameters
+    size_t max_degree_{64};
+    size_t build_list_size_{100};
+    float alpha_{1.2f};
+    size_t pq_subspaces_{0};
+    size_t num_threads_{1};
+    std::mutex staging_lock_;
+    std::vector<char> staged_data_;
+    std::vector<labeltype> staged_labels_;
+
+    // search state
+    size_t search_list_size_{100};
+    size_t beam_width_{4};
+    size_t num_points_{0};
+    uint32_t medoid_{0};
+    size_t node_size_{0};
+    size_t nodes_per_page_{0};
+    size_t pages_per_node_{1};
+    ProductQuantizer pq_;
+    std::vector<uint8_t> codes_;  // pq_.getCodeSize() bytes per node, in node order
+    std::unordered_map<labeltype, uint32_t> ids_;  // node of every label
+    std::unordered_set<uint32_t> tombstones_;  // nodes no edge leads to since the last save
+    std::string location_;  // of the open file
+    mutable std::mutex deleted_lock_;
+    std::unordered_set<labeltype> deleted_;
+#if defined(_WIN32)
+    mutable std::mutex file_lock_;
+    mutable std::ifstream file_;
+#else
+    int fd_{-1};
+#endif
+};
+}  // namespace hnswlib
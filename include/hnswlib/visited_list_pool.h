@@ -64,9 +64,26 @@ class VisitedListPool {
 
     void releaseVisitedList(VisitedList *vl) {
         std::unique_lock <std::mutex> lock(poolguard);
+        if (vl->numelements < (unsigned int) numelements) {
+            // handed out before the pool was grown
+            delete vl;
+            return;
+        }
         pool.push_front(vl);
     }
 
+    // Grows the lists handed out from now on; lists currently in use are dropped on release
+    void setNumElements(int numelements1) {
+        std::unique_lock <std::mutex> lock(poolguard);
+        if (numelements1 <= numelements)
+            return;
+        numelements = numelements1;
+        while (pool.size()) {
+            delete pool.front();
+            pool.pop_front();
+        }
+    }
+
     ~VisitedListPool() {
         while (pool.size()) {
             VisitedList *rez = pool.front();
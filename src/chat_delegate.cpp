@@ -0,0 +1,197 @@
+// chat_delegate.cpp
+#include "chat_delegate.h"
+#include "chat_model.h"
+#include <QAbstractTextDocumentLayout>
+#include <QPainter>
+#include <QtMath>
+#include <algorithm>
+
+namespace {
+constexpr int margin = 6;
+// Enough laid out documents for a tall window; the rest of the history costs only its height
+constexpr int cachedDocuments = 256;
+// Heights are tiny, but a long session can show many workspaces; the cache restarts beyond this
+constexpr int maxCachedHeights = 50000;
+// Rich text of unpainted rows is not parsed, so it is assumed to fill a few lines
+constexpr int estimatedRichTextLines = 3;
+}
+
+ChatDelegate::ChatDelegate(QAbstractItemView* view, MarkdownRenderer* renderer, CodeHighlighter* highlighter)
+    : QStyledItemDelegate(view), view(view), renderer(renderer), highlighter(highlighter), documents(cachedDocuments) {
+    relayoutTimer.setSingleShot(true);
+    relayoutTimer.setInterval(0);
+    connect(&relayoutTimer, &QTimer::timeout, this, [this]() {
+        if (relayoutIndex.isValid()) {
+            emit sizeHintChanged(relayoutIndex);
+        }
+    });
+    // Messages painted as plain text pick up their HTML on the next paint, code its colors
+    connect(renderer, &MarkdownRenderer::rendered, view->viewport(), QOverload<>::of(&QWidget::update));
+    connect(highlighter, &CodeHighlighter::highlighted, view->viewport(), QOverload<>::of(&QWidget::update));
+}
+
+void ChatDelegate::paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const {
+    QString text = index.data().toString();
+    int kind = index.data(ChatModel::KindRole).toInt();
+    int width = textWidth();
+    QTextDocument* laidOut = kind == ChatModel::PendingReply
+                                 ? pendingDocument(text, index.data(ChatModel::ClosedLengthRole).toInt(), width, option.font)
+                                 : document(text, kind, width, option.font);
+
+    painter->save();
+    if (option.state & QStyle::State_Selected) {
+        painter->fillRect(option.rect, option.palette.highlight());
+    }
+    painter->translate(option.rect.topLeft() + QPoint(margin, margin));
+    QAbstractTextDocumentLayout::PaintContext context;
+    context.palette = option.palette;
+    if (kind == ChatModel::Notice) {
+        context.palette.setColor(QPalette::Text, option.palette.color(QPalette::Disabled, QPalette::Text));
+    } else if (option.state & QStyle::State_Selected) {
+        context.palette.setColor(QPalette::Text, option.palette.color(QPalette::HighlightedText));
+    }
+    context.clip = QRectF(0, 0, width, option.rect.height());
+    laidOut->documentLayout()->draw(painter, context);
+    painter->restore();
+
+    int height = qCeil(laidOut->size().height()) + 2 * margin;
+    if (height != option.rect.height()) {
+        rememberHeight(index, text, width, height);
+    }
+}
+
+QSize ChatDelegate::sizeHint(const QStyleOptionViewItem& option, const QModelIndex& index) const {
+    QString text = index.data().toString();
+    int width = textWidth();
+    int height;
+    auto measured = heights.constFind(text.constData());
+    if (pending && pending->document.textWidth() == width && index.data(ChatModel::KindRole).toInt() == ChatModel::PendingReply) {
+        // Each update is new text; the reply keeps the height painted last until it is painted again
+        height = qCeil(pending->document.size().height()) + 2 * margin;
+    } else if (measured != heights.constEnd() && measured->textSize == text.size()) {
+        // Reflowed to a new width, the text keeps roughly the same area
+        height = measured->width == width ? measured->height
+                                          : std::max(option.fontMetrics.height(), measured->height * measured->width / width);
+    } else {
+        height = estimateHeight(text, index.data(ChatModel::KindRole).toInt(), width, option);
+    }
+    return QSize(view->viewport()->width(), height);
+}
+
+QTextDocument* ChatDelegate::document(const QString& text, int kind, int width, const QFont& font) const {
+    CachedDocument* cached = documents.object(text.constData());
+    bool current = cached && cached->kind == kind && cached->text.size() == text.size();
+    if (!current || !cached->rendered) {
+        QString html;
+        if (kind == ChatModel::Message) {
+            html = renderer->html(text);
+        }
+        bool rendered = kind != ChatModel::Message || !html.isNull();
+        if (!current || rendered) {
+            cached = new CachedDocument;
+            cached->text = text;
+            cached->kind = kind;
+            cached->rendered = rendered;
+            cached->document.setDocumentMargin(0);
+            cached->document.setDefaultFont(font);
+            if (html.isNull()) {
+                cached->document.setPlainText(text);
+            } else {
+                cached->document.setHtml(html);
+                cached->languages = CodeHighlighter::codeLanguages(html);
+            }
+            cached->highlighted = html.isNull();
+            documents.insert(text.constData(), cached);
+        }
+    }
+    if (!cached->highlighted) {
+        cached->highlighted = highlighter->highlight(&cached->document, cached->languages);
+    }
+    if (cached->document.textWidth() != width) {
+        cached->document.setTextWidth(width);
+    }
+    return &cached->document;
+}
+
+QTextDocument* ChatDelegate::pendingDocument(const QString& html, int closedLength, int width, const QFont& font) const {
+    // Closed blocks only grow, so anything else is a new reply and starts a new document
+    if (!pending || closedLength < pending->closedHtml.size() || !html.startsWith(pending->closedHtml)) {
+        pending.reset(new PendingDocument);
+        pending->document.setDocumentMargin(0);
+        pending->document.setUndoRedoEnabled(false); // Would keep every replaced trailing block
+    }
+    if (pending->document.defaultFont() != font) {
+        pending->document.setDefaultFont(font);
+    }
+
+    QString trailingHtml = html.mid(closedLength);
+    if (closedLength != pending->closedHtml.size() || trailingHtml != pending->trailingHtml) {
+        QTextCursor cursor(&pending->document);
+        cursor.beginEditBlock();
+        cursor.setPosition(pending->trailingStart);
+        cursor.movePosition(QTextCursor::End, QTextCursor::KeepAnchor);
+        cursor.removeSelectedText();
+        if (closedLength != pending->closedHtml.size()) {
+            QString closedPart = html.mid(pending->closedHtml.size(), closedLength - pending->closedHtml.size());
+            insertBlocks(cursor, closedPart);
+            pending->closedHtml = html.left(closedLength);
+            pending->closedLanguages += CodeHighlighter::codeLanguages(closedPart);
+            pending->trailingStart = cursor.position();
+        }
+        insertBlocks(cursor, trailingHtml);
+        cursor.endEditBlock();
+        pending->trailingHtml = trailingHtml;
+        pending->languages = pending->closedLanguages + CodeHighlighter::codeLanguages(trailingHtml);
+        pending->highlighted = false;
+    }
+
+    if (!pending->highlighted) {
+        pending->highlighted = highlighter->highlight(&pending->document, pending->languages);
+    }
+    if (pending->document.textWidth() != width) {
+        pending->document.setTextWidth(width);
+    }
+    return &pending->document;
+}
+
+void ChatDelegate::insertBlocks(QTextCursor& cursor, const QString& html) {
+    if (html.isEmpty()) {
+        return;
+    }
+    // Starts a plain block after what is there, so the first inserted block is not merged into
+    // the last one and takes none of its formats, e.g. those of a code line
+    if (cursor.position() > 0) {
+        cursor.insertBlock(QTextBlockFormat(), QTextCharFormat());
+    } else {
+        cursor.setBlockFormat(QTextBlockFormat()); // The empty block left of a removed one keeps its format
+        cursor.setCharFormat(QTextCharFormat());
+    }
+    cursor.insertHtml(html);
+}
+
+int ChatDelegate::textWidth() const {
+    return std::max(1, view->viewport()->width() - 2 * margin);
+}
+
+int ChatDelegate::estimateHeight(const QString& text, int kind, int width, const QStyleOptionViewItem& option) const {
+    int lines;
+    if (kind == ChatModel::PendingReply) {
+        lines = estimatedRichTextLines;
+    } else {
+        int charactersPerLine = std::max(1, width / std::max(1, option.fontMetrics.averageCharWidth()));
+        lines = 1 + text.size() / charactersPerLine + text.count('\n');
+    }
+    return lines * option.fontMetrics.lineSpacing() + 2 * margin;
+}
+
+void ChatDelegate::rememberHeight(const QModelIndex& index, const QString& text, int width, int height) const {
+    if (heights.size() >= maxCachedHeights) {
+        heights.clear();
+    }
+    heights.insert(text.constData(), MeasuredHeight{text.size(), width, height});
+    // sizeHintChanged() lays out every row, so the corrections of one paint share one layout
+    relayoutIndex = index;
+    if (!relayoutTimer.isActive()) {
+        relayoutTimer.start();
+    }
+}
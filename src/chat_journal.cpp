@@ -0,0 +1,75 @@
+// chat_journal.cpp
+#include "chat_journal.h"
+#include <QDataStream>
+#include <QDebug>
+#include <QFile>
+
+namespace {
+constexpr quint32 recordMagic = 0x4A524E4C; // "JRNL"
+constexpr int recordHeaderSize = 4 + 4 + 8 + 4; // magic, payload length, sequence, checksum
+
+// FNV-1a, enough to tell a torn or overwritten record from a complete one
+quint32 checksum(quint64 sequence, const QByteArray& payload) {
+    quint32 hash = 2166136261u;
+    for (int i = 0; i < 8; ++i) {
+        hash = (hash ^ static_cast<quint8>(sequence >> (8 * i))) * 16777619u;
+    }
+    for (char c : payload) {
+        hash = (hash ^ static_cast<quint8>(c)) * 16777619u;
+    }
+    return hash;
+}
+} // namespace
+
+ChatJournal::ChatJournal(const QString& directory) : directory(directory) {}
+
+QVector<QString> ChatJournal::replay(int workspaceId, quint64 afterSequence) const {
+    QVector<QString> messages;
+    QFile file(pathFor(workspaceId));
+    if (!file.exists()) {
+        return messages;
+    }
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Failed to open chat journal" << file.fileName() << ":" << file.errorString();
+        return messages;
+    }
+
+    QByteArray data = file.readAll();
+    std::vector<std::pair<quint64, QByteArray>> records;
+    qint64 valid = decodeRecords(data, records);
+    if (valid < data.size()) {
+        qWarning() << "Skipping" << (data.size() - valid) << "bytes of incomplete records in" << file.fileName();
+    }
+    for (const auto& record : records) {
+        if (record.first > afterSequence) {
+            messages.append(QString::fromUtf8(record.second));
+        }
+    }
+    return messages;
+}
+
+QString ChatJournal::pathFor(int workspaceId) const {
+    return directory + "/workspace-" + QString::number(workspaceId) + ".journal";
+}
+
+qint64 ChatJournal::decodeRecords(const QByteArray& data, std::vector<std::pair<quint64, QByteArray>>& records) {
+    qint64 pos = 0;
+    while (data.size() - pos >= recordHeaderSize) {
+        QDataStream stream(data.mid(pos, recordHeaderSize));
+        quint32 magic;
+        quint32 length;
+        quint64 sequence;
+        quint32 sum;
+        stream >> magic >> length >> sequence >> sum;
+        if (magic != recordMagic || data.size() - pos - recordHeaderSize < length) {
+            break;
+        }
+        QByteArray payload = data.mid(pos + recordHeaderSize, length);
+        if (checksum(sequence, payload) != sum) {
+            break;
+        }
+        records.emplace_back(sequence, payload);
+        pos += recordHeaderSize + length;
+    }
+    return pos;
+}
@@ -0,0 +1,149 @@
+// chat_model.cpp
+#include "chat_model.h"
+
+namespace {
+const char* const olderMessagesText = "Scroll up for older messages";
+}
+
+ChatModel::ChatModel(QObject* parent) : QAbstractListModel(parent) {
+}
+
+int ChatModel::rowCount(const QModelIndex& parent) const {
+    if (parent.isValid()) {
+        return 0;
+    }
+    return headerRows() + messages.size() + pendingReplyRows() + notices.size();
+}
+
+QVariant ChatModel::data(const QModelIndex& index, int role) const {
+    if (!index.isValid() || index.row() >= rowCount()) {
+        return QVariant();
+    }
+    int row = index.row() - headerRows();
+    Kind kind = row >= 0 && row < messages.size() ? Message
+              : row == messages.size() && !pendingReply.isEmpty() ? PendingReply
+                                                                  : Notice;
+    if (role == KindRole) {
+        return static_cast<int>(kind);
+    }
+    if (role == ClosedLengthRole) {
+        return kind == PendingReply ? pendingClosedLength : 0;
+    }
+    if (role != Qt::DisplayRole) {
+        return QVariant();
+    }
+
+    if (kind == Message) {
+        return messages.at(row);
+    }
+    if (kind == PendingReply) {
+        return pendingReply;
+    }
+    if (row >= 0) {
+        return notices.at(row - messages.size() - pendingReplyRows());
+    }
+    return !title.isEmpty() && index.row() == 0 ? title : QString(olderMessagesText);
+}
+
+void ChatModel::setConversation(const QString& title, const QVector<QString>& messages, bool hasOlderMessages) {
+    beginResetModel();
+    this->title = title;
+    olderMessagesHint = hasOlderMessages;
+    this->messages = messages;
+    pendingReply.clear();
+    notices.clear();
+    endResetModel();
+}
+
+void ChatModel::prependMessages(const QVector<QString>& olderMessages, bool hasOlderMessages) {
+    if (!olderMessages.isEmpty()) {
+        int first = headerRows();
+        beginInsertRows(QModelIndex(), first, first + olderMessages.size() - 1);
+        QVector<QString> merged;
+        merged.reserve(olderMessages.size() + messages.size());
+        merged += olderMessages;
+        merged += messages;
+        messages = std::move(merged);
+        endInsertRows();
+    }
+    setHasOlderMessages(hasOlderMessages);
+}
+
+void ChatModel::appendMessage(const QString& message) {
+    int trailingRows = pendingReplyRows() + notices.size();
+    if (trailingRows > 0) {
+        int first = headerRows() + messages.size();
+        beginRemoveRows(QModelIndex(), first, first + trailingRows - 1);
+        pendingReply.clear();
+        notices.clear();
+        endRemoveRows();
+    }
+    int row = headerRows() + messages.size();
+    beginInsertRows(QModelIndex(), row, row);
+    messages.append(message);
+    endInsertRows();
+}
+
+void ChatModel::setPendingReply(const QString& closedBlocksHtml, const QString& trailingHtml) {
+    QString html = closedBlocksHtml + trailingHtml;
+    pendingClosedLength = closedBlocksHtml.size();
+    int row = headerRows() + messages.size();
+    if (html.isEmpty()) {
+        if (!pendingReply.isEmpty()) {
+            beginRemoveRows(QModelIndex(), row, row);
+            pendingReply.clear();
+            endRemoveRows();
+        }
+    } else if (pendingReply.isEmpty()) {
+        beginInsertRows(QModelIndex(), row, row);
+        pendingReply = html;
+        endInsertRows();
+    } else {
+        pendingReply = html;
+        emit dataChanged(index(row), index(row));
+    }
+}
+
+QModelIndex ChatModel::messageIndex(int message) const {
+    if (message < 0 || message >= messages.size()) {
+        return QModelIndex();
+    }
+    return index(headerRows() + message);
+}
+
+void ChatModel::addNotice(const QString& notice) {
+    int row = rowCount();
+    beginInsertRows(QModelIndex(), row, row);
+    notices.append(notice);
+    endInsertRows();
+}
+
+void ChatModel::clear() {
+    beginResetModel();
+    title.clear();
+    olderMessagesHint = false;
+    messages.clear();
+    pendingReply.clear();
+    notices.clear();
+    endResetModel();
+}
+
+int ChatModel::headerRows() const {
+    return (title.isEmpty() ? 0 : 1) + (olderMessagesHint ? 1 : 0);
+}
+
+void ChatModel::setHasOlderMessages(bool hasOlderMessages) {
+    if (hasOlderMessages == olderMessagesHint) {
+        return;
+    }
+    int row = title.isEmpty() ? 0 : 1;
+    if (hasOlderMessages) {
+        beginInsertRows(QModelIndex(), row, row);
+        olderMessagesHint = true;
+        endInsertRows();
+    } else {
+        beginRemoveRows(QModelIndex(), row, row);
+        olderMessagesHint = false;
+        endRemoveRows();
+    }
+}
@@ -0,0 +1,295 @@
+// code_highlighter.cpp
+#include "code_highlighter.h"
+#include <QColor>
+#include <QCryptographicHash>
+#include <QHash>
+#include <QMetaObject>
+#include <QRegularExpression>
+#include <QRunnable>
+#include <QTextCharFormat>
+#include <QTextLayout>
+#include <algorithm>
+#include <functional>
+
+namespace {
+// Tokens are a few bytes per word; the cost counts tokens
+constexpr int cachedTokens = 4 * 1024 * 1024;
+// Blocks of replies still streaming in, which are usually the latest ones tokenized
+constexpr int recentBlocks = 8;
+
+enum State { Normal, InBlock };
+
+struct LanguageRules {
+    QSet<QString> keywords;
+    QString lineComment;
+    QString blockStart;
+    QString blockEnd;
+    CodeHighlighter::TokenKind blockKind;
+};
+
+QSet<QString> words(const char* list) {
+    QSet<QString> set;
+    for (const QString& word : QString::fromLatin1(list).split(' ', Qt::SkipEmptyParts)) {
+        set.insert(word);
+    }
+    return set;
+}
+
+const LanguageRules& rulesFor(const QString& language) {
+    static const LanguageRules cLike{
+        words("auto bool break case catch char class const constexpr continue default delete do double else enum "
+              "explicit export extends extern false final float fn for func function go if impl implements import "
+              "in int interface let long match mod mut namespace new nullptr package private protected pub public "
+              "return self short signed sizeof static string struct super switch template this throw true try type "
+              "typedef typename union unsigned use using var virtual void volatile while yield"),
+        "//", "/*", "*/", CodeHighlighter::Comment};
+    static const LanguageRules python{
+        words("and as assert async await break class continue def del elif else except False finally for from "
+              "global if import in is lambda None nonlocal not or pass raise return self True try while with yield"),
+        "#", "\"\"\"", "\"\"\"", CodeHighlighter::String};
+    static const LanguageRules shell{
+        words("case do done echo elif else esac exit export fi for function if in local read return set shift then "
+              "until while"),
+        "#", QString(), QString(), CodeHighlighter::Comment};
+    static const QHash<QString, const LanguageRules*> byName{
+        {"python", &python}, {"py", &python},
+        {"bash", &shell}, {"sh", &shell}, {"shell", &shell}, {"zsh", &shell}, {"console", &shell},
+    };
+    // C, C++, Java, JavaScript, Go, Rust and the like share their comments and most keywords
+    return *byName.value(language.toLower(), &cLike);
+}
+
+bool matchesAt(const QString& code, int position, int end, const QString& text) {
+    if (text.isEmpty() || position + text.size() > end) {
+        return false;
+    }
+    for (int i = 0; i < text.size(); ++i) {
+        if (code.at(position + i) != text.at(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends the tokens of the line code[start, end) and returns the state at its end
+int tokenizeLine(const QString& code, int start, int end, int state, const LanguageRules& rules,
+                 CodeHighlighter::Tokens& tokens) {
+    int i = start;
+    if (state == InBlock) {
+        int close = code.indexOf(rules.blockEnd, i);
+        if (close == -1 || close + rules.blockEnd.size() > end) {
+            if (end > start) {
+                tokens.append({start, end - start, rules.blockKind});
+            }
+            return InBlock;
+        }
+        i = close + rules.blockEnd.size();
+        tokens.append({start, i - start, rules.blockKind});
+    }
+    while (i < end) {
+        QChar c = code.at(i);
+        if (matchesAt(code, i, end, rules.lineComment)) {
+            tokens.append({i, end - i, CodeHighlighter::Comment});
+            break;
+        }
+        if (matchesAt(code, i, end, rules.blockStart)) {
+            int close = code.indexOf(rules.blockEnd, i + rules.blockStart.size());
+            if (close == -1 || close + rules.blockEnd.size() > end) {
+                tokens.append({i, end - i, rules.blockKind});
+                return InBlock;
+            }
+            int next = close + rules.blockEnd.size();
+            tokens.append({i, next - i, rules.blockKind});
+            i = next;
+        } else if (c == '"' || c == '\'' || c == '`') {
+            int next = i + 1;
+            while (next < end && code.at(next) != c) {
+                next += code.at(next) == '\\' ? 2 : 1;
+            }
+            next = std::min(next + 1, end);
+            tokens.append({i, next - i, CodeHighlighter::String});
+            i = next;
+        } else if (c.isDigit()) {
+            int next = i + 1;
+            while (next < end && (code.at(next).isLetterOrNumber() || code.at(next) == '.' || code.at(next) == '_')) {
+                ++next;
+            }
+            tokens.append({i, next - i, CodeHighlighter::Number});
+            i = next;
+        } else if (c.isLetter() || c == '_') {
+            int next = i + 1;
+            while (next < end && (code.at(next).isLetterOrNumber() || code.at(next) == '_')) {
+                ++next;
+            }
+            if (rules.keywords.contains(code.mid(i, next - i))) {
+                tokens.append({i, next - i, CodeHighlighter::Keyword});
+            }
+            i = next;
+        } else {
+            ++i;
+        }
+    }
+    return Normal;
+}
+
+QTextCharFormat formatFor(CodeHighlighter::TokenKind kind) {
+    // Readable on the dark background of the chat view
+    QTextCharFormat format;
+    switch (kind) {
+    case CodeHighlighter::Keyword:
+        format.setForeground(QColor(198, 120, 221));
+        break;
+    case CodeHighlighter::String:
+        format.setForeground(QColor(152, 195, 121));
+        break;
+    case CodeHighlighter::Comment:
+        format.setForeground(QColor(127, 132, 142));
+        format.setFontItalic(true);
+        break;
+    case CodeHighlighter::Number:
+        format.setForeground(QColor(209, 154, 102));
+        break;
+    }
+    return format;
+}
+
+class HighlightTask : public QRunnable {
+public:
+    explicit HighlightTask(std::function<void()> work) : work(std::move(work)) {}
+
+    void run() override {
+        work();
+    }
+
+private:
+    std::function<void()> work;
+};
+}
+
+CodeHighlighter::CodeHighlighter(QObject* parent) : QObject(parent), cache(cachedTokens) {
+}
+
+bool CodeHighlighter::highlight(QTextDocument* document, const QStringList& languages) {
+    bool complete = true;
+    int codeBlock = 0;
+    QTextBlock block = document->begin();
+    while (block.isValid()) {
+        // Preformatted HTML is imported as one block per line that does not wrap
+        if (!block.blockFormat().nonBreakableLines()) {
+            block = block.next();
+            continue;
+        }
+        QVector<QTextBlock> lines;
+        QStringList text;
+        for (; block.isValid() && block.blockFormat().nonBreakableLines(); block = block.next()) {
+            lines.append(block);
+            text.append(block.text());
+        }
+        QString language = codeBlock < languages.size() ? languages.at(codeBlock) : QString();
+        ++codeBlock;
+        if (const Tokens* found = tokens(text.join('\n'), language)) {
+            apply(document, lines, *found);
+        } else {
+            complete = false;
+        }
+    }
+    return complete;
+}
+
+QStringList CodeHighlighter::codeLanguages(const QString& html) {
+    static const QRegularExpression codeBlock("<pre><code(?: class=\"language-([^\"]*)\")?>");
+    QStringList languages;
+    QRegularExpressionMatchIterator matches = codeBlock.globalMatch(html);
+    while (matches.hasNext()) {
+        languages.append(matches.next().captured(1));
+    }
+    return languages;
+}
+
+const CodeHighlighter::Tokens* CodeHighlighter::tokens(const QString& code, const QString& language) {
+    QByteArray hash = key(code, language);
+    if (const Tokens* cached = cache.object(hash)) {
+        return cached;
+    }
+    if (pending.contains(hash)) {
+        return nullptr;
+    }
+    pending.insert(hash);
+
+    // A block streaming in extends one tokenized before, up to that one's last line
+    Tokenized previous;
+    bool extends = false;
+    for (const Tokenized& candidate : recent) {
+        if (candidate.language == language && candidate.resumeOffset > 0 &&
+            code.startsWith(candidate.code.left(candidate.resumeOffset))) {
+            previous = candidate;
+            extends = true;
+            break;
+        }
+    }
+    pool.start(new HighlightTask([this, hash, code, language, previous, extends]() {
+        Tokenized result = tokenize(code, language, extends ? &previous : nullptr);
+        QMetaObject::invokeMethod(this, [this, hash, result]() {
+            cache.insert(hash, new Tokens(result.tokens), std::max(1, result.tokens.size()));
+            pending.remove(hash);
+            recent.prepend(result);
+            if (recent.size() > recentBlocks) {
+                recent.removeLast();
+            }
+            emit highlighted();
+        }, Qt::QueuedConnection);
+    }));
+    return nullptr;
+}
+
+void CodeHighlighter::apply(QTextDocument* document, const QVector<QTextBlock>& lines, const Tokens& tokens) const {
+    // Tokens are in order and none crosses a line; a block comment gets one per line
+    int token = 0;
+    int lineStart = 0;
+    for (const QTextBlock& line : lines) {
+        int lineEnd = lineStart + line.length() - 1;
+        QVector<QTextLayout::FormatRange> ranges;
+        for (; token < tokens.size() && tokens.at(token).start < lineEnd; ++token) {
+            const Token& current = tokens.at(token);
+            ranges.append({current.start - lineStart, current.length, formatFor(current.kind)});
+        }
+        // As QSyntaxHighlighter does: extra formats of the layout, leaving the text untouched
+        line.layout()->setFormats(ranges);
+        document->markContentsDirty(line.position(), line.length());
+        lineStart = lineEnd + 1;
+    }
+}
+
+QByteArray CodeHighlighter::key(const QString& code, const QString& language) {
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    hash.addData(language.toUtf8());
+    hash.addData(QByteArray(1, '\0'));
+    hash.addData(code.toUtf8());
+    return hash.result();
+}
+
+CodeHighlighter::Tokenized CodeHighlighter::tokenize(const QString& code, const QString& language, const Tokenized* previous) {
+    const LanguageRules& rules = rulesFor(language);
+    Tokenized result;
+    result.language = language;
+    result.code = code;
+    int lineStart = 0;
+    int state = Normal;
+    if (previous) {
+        result.tokens = previous->tokens.mid(0, previous->resumeTokens);
+        lineStart = previous->resumeOffset;
+        state = previous->resumeState;
+    }
+    while (true) {
+        int lineEnd = code.indexOf('\n', lineStart);
+        if (lineEnd == -1) {
+            result.resumeOffset = lineStart;
+            result.resumeTokens = result.tokens.size();
+            result.resumeState = state;
+            tokenizeLine(code, lineStart, code.size(), state, rules, result.tokens);
+            return result;
+        }
+        state = tokenizeLine(code, lineStart, lineEnd, state, rules, result.tokens);
+        lineStart = lineEnd + 1;
+    }
+}
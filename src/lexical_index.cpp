@@ -0,0 +1,267 @@
+// lexical_index.cpp
+#include "lexical_index.h"
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace {
+// Standard BM25 parameters
+constexpr float k1 = 1.2f;
+constexpr float b = 0.75f;
+// Below this many postings per thread, starting threads costs more than it saves
+constexpr size_t minPostingsPerThread = 65536;
+
+bool isWordChar(QChar c) {
+    return c.isLetterOrNumber() || c == '_';
+}
+
+// Splits an identifier at underscores and lower-to-upper case changes
+QStringList identifierParts(const QString& word) {
+    QStringList parts;
+    QString current;
+    for (int i = 0; i < word.size(); ++i) {
+        QChar c = word[i];
+        bool boundary = c == '_' || (c.isUpper() && i > 0 && word[i - 1].isLower());
+        if (boundary && !current.isEmpty()) {
+            parts.append(current.toLower());
+            current.clear();
+        }
+        if (c != '_') {
+            current.append(c);
+        }
+    }
+    if (!current.isEmpty()) {
+        parts.append(current.toLower());
+    }
+    return parts;
+}
+}
+
+void LexicalIndex::add(hnswlib::labeltype label, const QString& text) {
+    if (!documentLengths.empty() && label < nextLabel) {
+        qWarning() << "LexicalIndex labels must be added in increasing order, ignoring label" << label;
+        return;
+    }
+    nextLabel = label + 1;
+
+    QStringList tokens = tokenize(text);
+    std::unordered_map<std::string, quint32> frequencies;
+    for (const QString& token : tokens) {
+        frequencies[token.toStdString()]++;
+    }
+    for (const auto& term : frequencies) {
+        PostingList& list = postings[term.first];
+        appendVarint(list.bytes, list.count == 0 ? label : label - list.lastLabel);
+        appendVarint(list.bytes, term.second);
+        list.lastLabel = label;
+        list.count++;
+        list.liveCount++;
+    }
+    documentLengths[label] = static_cast<quint32>(tokens.size());
+    totalLength += tokens.size();
+}
+
+bool LexicalIndex::remove(hnswlib::labeltype label, const QString& text) {
+    auto it = documentLengths.find(label);
+    if (it == documentLengths.end()) {
+        return false;
+    }
+    totalLength -= it->second;
+    documentLengths.erase(it);
+    QStringList tokens = tokenize(text);
+    tokens.removeDuplicates();
+    for (const QString& token : tokens) {
+        auto term = postings.find(token.toStdString());
+        if (term != postings.end() && term->second.liveCount > 0) {
+            term->second.liveCount--;
+        }
+    }
+    // The postings stay until compaction; scoring skips labels without a length
+    removedDocuments++;
+    compactIfNeeded();
+    return true;
+}
+
+void LexicalIndex::clear() {
+    postings.clear();
+    documentLengths.clear();
+    nextLabel = 0;
+    totalLength = 0;
+    removedDocuments = 0;
+}
+
+size_t LexicalIndex::size() const {
+    return documentLengths.size();
+}
+
+size_t LexicalIndex::postingBytes() const {
+    size_t bytes = 0;
+    for (const auto& term : postings) {
+        bytes += term.second.bytes.size();
+    }
+    return bytes;
+}
+
+std::vector<LexicalMatch> LexicalIndex::search(const QString& query, size_t k, size_t numThreads) const {
+    std::vector<LexicalMatch> matches;
+    if (k == 0 || documentLengths.empty()) {
+        return matches;
+    }
+
+    QStringList tokens = tokenize(query);
+    tokens.removeDuplicates();
+    std::vector<const PostingList*> lists;
+    size_t postingCount = 0;
+    for (const QString& token : tokens) {
+        auto it = postings.find(token.toStdString());
+        if (it != postings.end() && it->second.liveCount > 0) {
+            lists.push_back(&it->second);
+            postingCount += it->second.count;
+        }
+    }
+    if (lists.empty()) {
+        return matches;
+    }
+
+    float documentCount = static_cast<float>(documentLengths.size());
+    float averageLength = static_cast<float>(totalLength) / documentCount;
+    auto idf = [documentCount](const PostingList* list) {
+        float df = static_cast<float>(list->liveCount);
+        return std::log(1.0f + (documentCount - df + 0.5f) / (df + 0.5f));
+    };
+
+    // Each thread scores whole terms into its own map; the maps are summed afterwards
+    numThreads = std::max<size_t>(1, std::min({numThreads, lists.size(), postingCount / minPostingsPerThread}));
+    std::vector<ScoreMap> partial(numThreads);
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = t; i < lists.size(); i += numThreads) {
+                scoreTerm(*lists[i], idf(lists[i]), averageLength, partial[t]);
+            }
+        });
+    }
+    for (size_t i = 0; i < lists.size(); i += numThreads) {
+        scoreTerm(*lists[i], idf(lists[i]), averageLength, partial[0]);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    ScoreMap& scores = partial[0];
+    for (size_t t = 1; t < numThreads; ++t) {
+        for (const auto& entry : partial[t]) {
+            std::pair<float, size_t>& total = scores[entry.first];
+            total.first += entry.second.first;
+            total.second += entry.second.second;
+        }
+    }
+
+    matches.reserve(scores.size());
+    for (const auto& entry : scores) {
+        matches.push_back({entry.first, entry.second.first, entry.second.second});
+    }
+    auto better = [](const LexicalMatch& a, const LexicalMatch& c) {
+        return a.score != c.score ? a.score > c.score : a.label > c.label; // Newer entries win ties
+    };
+    if (matches.size() > k) {
+        std::partial_sort(matches.begin(), matches.begin() + k, matches.end(), better);
+        matches.resize(k);
+    } else {
+        std::sort(matches.begin(), matches.end(), better);
+    }
+    return matches;
+}
+
+QStringList LexicalIndex::tokenize(const QString& text) {
+    QStringList tokens;
+    int start = -1;
+    for (int i = 0; i <= text.size(); ++i) {
+        bool word = i < text.size() && isWordChar(text[i]);
+        if (word && start < 0) {
+            start = i;
+        } else if (!word && start >= 0) {
+            QString token = text.mid(start, i - start);
+            tokens.append(token.toLower());
+            QStringList parts = identifierParts(token);
+            if (parts.size() > 1) {
+                tokens.append(parts);
+            }
+            start = -1;
+        }
+    }
+    return tokens;
+}
+
+void LexicalIndex::appendVarint(std::string& bytes, quint64 value) {
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<char>(value));
+}
+
+quint64 LexicalIndex::readVarint(const std::string& bytes, size_t& pos) {
+    quint64 value = 0;
+    int shift = 0;
+    while (pos < bytes.size()) {
+        unsigned char byte = static_cast<unsigned char>(bytes[pos++]);
+        value |= static_cast<quint64>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    return value;
+}
+
+void LexicalIndex::scoreTerm(const PostingList& list, float idf, float averageLength, ScoreMap& scores) const {
+    size_t pos = 0;
+    hnswlib::labeltype label = 0;
+    for (size_t i = 0; i < list.count; ++i) {
+        label += readVarint(list.bytes, pos);
+        float tf = static_cast<float>(readVarint(list.bytes, pos));
+        auto length = documentLengths.find(label);
+        if (length == documentLengths.end()) {
+            continue; // Removed
+        }
+        float norm = k1 * (1.0f - b + b * length->second / averageLength);
+        std::pair<float, size_t>& score = scores[label];
+        score.first += idf * tf * (k1 + 1.0f) / (tf + norm);
+        score.second++;
+    }
+}
+
+void LexicalIndex::compactIfNeeded() {
+    // Rewriting every list is linear in the postings, so wait until a quarter of the documents are removed
+    if (removedDocuments < 256 || removedDocuments * 4 < removedDocuments + documentLengths.size()) {
+        return;
+    }
+
+    for (auto it = postings.begin(); it != postings.end();) {
+        PostingList& list = it->second;
+        PostingList kept;
+        size_t pos = 0;
+        hnswlib::labeltype label = 0;
+        for (size_t i = 0; i < list.count; ++i) {
+            label += readVarint(list.bytes, pos);
+            quint64 tf = readVarint(list.bytes, pos);
+            if (documentLengths.count(label) == 0) {
+                continue;
+            }
+            appendVarint(kept.bytes, kept.count == 0 ? label : label - kept.lastLabel);
+            appendVarint(kept.bytes, tf);
+            kept.lastLabel = label;
+            kept.count++;
+        }
+        if (kept.count == 0) {
+            it = postings.erase(it);
+            continue;
+        }
+        kept.liveCount = kept.count;
+        list = std::move(kept);
+        ++it;
+    }
+    removedDocuments = 0;
+}
@@ -1,9 +1,19 @@
 // main.cpp
 #include <QApplication>
 #include "mainwindow.h"
+#include "shard_self_test.h"
+#include "shard_worker.h"
 
 int main(int argc, char *argv[])
 {
+    // Vector index shards run headless in their own processes
+    if (ShardWorker::isRequested(argc, argv)) {
+        return ShardWorker::run(argc, argv);
+    }
+    if (ShardSelfTest::isRequested(argc, argv)) {
+        return ShardSelfTest::run(argc, argv);
+    }
+
     QApplication app(argc, argv);
 
     MainWindow mainWindow;
@@ -10,11 +10,35 @@
 #include <QNetworkRequest>
 #include <functional>
 #include <vector>
-#include <future>
 #include <QRegularExpression>
 #include <QTimer>
 #include <QMessageBox>
 #include <QCheckBox> // Include QCheckBox
+#include <QStatusBar>
+#include <QScrollBar>
+#include <QSignalBlocker>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QApplication>
+#include <QClipboard>
+#include <QTextDocument>
+#include <algorithm>
+#include "chat_delegate.h"
+
+namespace {
+// Messages read per history page; the newest page is read when a workspace is selected
+constexpr int historyPageSize = 100;
+// Enough to scroll through; a narrower query finds the rest
+constexpr int searchResultLimit = 500;
+// Related entries shown above the message matches; the search runs while typing, so it gets a
+// budget well below a keystroke
+constexpr size_t relatedEntryLimit = 5;
+constexpr int relatedSearchBudgetMs = 30;
+// Idle workspaces give up their loaded history after a while, and are compressed on disk after longer
+constexpr qint64 unloadAfterMs = 15 * 60 * 1000;
+constexpr qint64 archiveAfterMs = 3 * 24 * 60 * 60 * 1000LL;
+constexpr int idleCheckIntervalMs = 5 * 60 * 1000;
+}
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
@@ -44,6 +68,16 @@ MainWindow::MainWindow(QWidget *parent)
     addWorkspaceButton->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
     leftLayout->addWidget(addWorkspaceButton);
 
+    // Search across all conversations; matches are listed under the field while it has text
+    searchLineEdit = new QLineEdit(leftWidget);
+    searchLineEdit->setPlaceholderText("Search all conversations");
+    searchLineEdit->setClearButtonEnabled(true);
+    leftLayout->addWidget(searchLineEdit);
+    searchResultsList = new QListWidget(leftWidget);
+    searchResultsList->setWordWrap(true);
+    searchResultsList->hide();
+    leftLayout->addWidget(searchResultsList);
+
     // Set up the workspaces list
     workspacesList = new QListWidget(leftWidget);
     workspacesList->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
@@ -52,12 +86,28 @@ MainWindow::MainWindow(QWidget *parent)
     // Set up the right widget (main chat window)
     rightLayout = new QVBoxLayout(rightWidget);
 
-    // Set up the chat text browser
-    chatTextBrowser = new QTextBrowser(rightWidget);
-    chatTextBrowser->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+    // Set up the chat view; only the messages in sight are laid out and painted
+    chatModel = new ChatModel(this);
+    markdownRenderer = new MarkdownRenderer(this);
+    codeHighlighter = new CodeHighlighter(this);
+    chatView = new QListView(rightWidget);
+    chatView->setSizePolicy(QSizePolicy::Expanding, QSizePolicy::Expanding);
+    chatView->setModel(chatModel);
+    chatView->setItemDelegate(new ChatDelegate(chatView, markdownRenderer, codeHighlighter));
+    chatView->setVerticalScrollMode(QAbstractItemView::ScrollPerPixel);
+    chatView->setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+    chatView->setResizeMode(QListView::Adjust);
+    chatView->setSelectionMode(QAbstractItemView::ExtendedSelection);
+    chatView->setEditTriggers(QAbstractItemView::NoEditTriggers);
     // Set the background color to a lighter gray
-    chatTextBrowser->setStyleSheet("QTextBrowser { background-color: rgb(50, 51, 61); }");
-    rightLayout->addWidget(chatTextBrowser);
+    chatView->setStyleSheet("QListView { background-color: rgb(50, 51, 61); }");
+    rightLayout->addWidget(chatView);
+
+    QAction *copyAction = new QAction("Copy", chatView);
+    copyAction->setShortcut(QKeySequence::Copy);
+    copyAction->setShortcutContext(Qt::WidgetShortcut);
+    chatView->addAction(copyAction);
+    connect(copyAction, &QAction::triggered, this, &MainWindow::copySelectedMessages);
 
     // Set up the input line edit and send button
     inputLineEdit = new QLineEdit(rightWidget);
@@ -109,9 +159,38 @@ MainWindow::MainWindow(QWidget *parent)
     // Connect the input line edit to the sendMessage slot when Enter is pressed
     connect(inputLineEdit, &QLineEdit::returnPressed, this, &MainWindow::sendMessage);
 
-    // Load workspaces from file
+    // Every keystroke searches; the worker drops searches that were typed over
+    connect(searchLineEdit, &QLineEdit::textChanged, this, &MainWindow::searchConversations);
+    connect(searchResultsList, &QListWidget::itemClicked, this, &MainWindow::openSearchResult);
+
+    // Older messages are read once the user scrolls to the top of the chat
+    QScrollBar *chatScrollBar = chatView->verticalScrollBar();
+    connect(chatScrollBar, &QScrollBar::valueChanged, this, &MainWindow::onChatScrolled);
+    // Rows measured after painting change the range; a chat scrolled to the end stays there
+    connect(chatScrollBar, &QScrollBar::rangeChanged, this, [this, chatScrollBar](int, int maximum) {
+        if (chatFollowsEnd) {
+            chatScrollBar->setValue(maximum);
+        }
+    });
+
+    // Workspaces are read and written on the persistence thread; an existing workspaces.json is imported once
+    QString dataDirectory = MainWindowHelpers::dataDirectory();
+    persistence = new PersistenceWorker(new WorkspaceStore(dataDirectory + "/workspaces.db", dataDirectory), [this]() {
+        QMap<int, Workspace*> qmapWorkspaceMap;
+        for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
+            qmapWorkspaceMap[it->first] = it->second;
+        }
+        return MainWindowHelpers::workspaceRecords(qmapWorkspaceMap);
+    }, this);
+    connect(persistence, &PersistenceWorker::saved, this, &MainWindow::onWorkspacesSaved);
+    persistence->start();
     loadWorkspaces();
 
+    idleTimer = new QTimer(this);
+    idleTimer->setInterval(idleCheckIntervalMs);
+    connect(idleTimer, &QTimer::timeout, this, &MainWindow::releaseIdleWorkspaces);
+    idleTimer->start();
+
     // Add the default workspace if no workspaces are loaded
     if (workspaceMap.empty()) {
         addWorkspace();
@@ -131,8 +210,9 @@ MainWindow::MainWindow(QWidget *parent)
 }
 
 MainWindow::~MainWindow() {
-    // Save workspaces to file
-    saveWorkspaces();
+    // Save workspaces; the only save that waits for the disk
+    persistence->requestSave();
+    persistence->flush();
 
     delete ui;
     for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
@@ -145,16 +225,20 @@ void MainWindow::loadWorkspaces() {
     for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
         qmapWorkspaceMap[it->first] = it->second;
     }
-    MainWindowHelpers::loadWorkspaces(qmapWorkspaceMap, workspacesList);
+    MainWindowHelpers::loadWorkspaces(qmapWorkspaceMap, workspacesList, persistence->loadWorkspaces());
     workspaceMap = qmapWorkspaceMap.toStdMap();
 }
 
 void MainWindow::saveWorkspaces() {
-    QMap<int, Workspace*> qmapWorkspaceMap;
-    for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
-        qmapWorkspaceMap[it->first] = it->second;
+    // Coalesced with other changes and written on the persistence thread
+    persistence->requestSave();
+}
+
+void MainWindow::onWorkspacesSaved(quint64 generation, bool ok) {
+    (void)generation;
+    if (!ok) {
+        statusBar()->showMessage("Workspaces could not be saved, retrying with the next change", 5000);
     }
-    MainWindowHelpers::saveWorkspaces(qmapWorkspaceMap);
 }
 
 void MainWindow::addWorkspace() {
@@ -194,16 +278,209 @@ void MainWindow::selectWorkspace(QListWidgetItem *item) {
     if (!item) return; // Ensure the item is valid
 
     int workspaceId = item->data(Qt::UserRole).toInt();
-    QString workspaceName = item->text();
-    chatTextBrowser->clear();
-    chatTextBrowser->append("Selected Workspace: " + workspaceName);
-
-    // Load chat history for the selected workspace
     if (workspaceMap.find(workspaceId) != workspaceMap.end()) {
-        QVector<QString> chatHistory = workspaceMap[workspaceId]->getChatHistory();
-        for (const auto& message : chatHistory) {
-            chatTextBrowser->append(message);
+        workspaceMap[workspaceId]->markActive();
+    }
+    showChatHistory(workspaceId);
+
+    // Only the most recent page is read now; older ones follow as the user scrolls up
+    auto it = workspaceMap.find(workspaceId);
+    if (it != workspaceMap.end() && it->second->getChatHistory().size() < historyPageSize) {
+        loadOlderHistory(workspaceId);
+    }
+}
+
+void MainWindow::showChatHistory(int workspaceId) {
+    // Resetting scrolls to the top, which must not look like the user asking for older messages
+    QSignalBlocker blocker(chatView->verticalScrollBar());
+
+    auto it = workspaceMap.find(workspaceId);
+    if (it == workspaceMap.end()) {
+        chatModel->clear();
+        return;
+    }
+    // The model shares the loaded history with the workspace; rows are laid out as they come into view
+    chatModel->setConversation("Selected Workspace: " + it->second->getName(), it->second->getChatHistory(),
+                               it->second->hasUnloadedHistory());
+    chatFollowsEnd = true;
+    chatView->scrollToBottom();
+}
+
+void MainWindow::loadOlderHistory(int workspaceId, qint64 count) {
+    auto it = workspaceMap.find(workspaceId);
+    if (it == workspaceMap.end() || !it->second->hasUnloadedHistory() || historyLoads.count(workspaceId) > 0) {
+        return;
+    }
+    historyLoads.insert(workspaceId);
+    qint64 before = it->second->getLoadedHistoryStart();
+    int limit = static_cast<int>(std::max<qint64>(historyPageSize, count));
+    persistence->loadHistoryPage(workspaceId, before, limit, [this, workspaceId, before, limit](const QVector<QString>& messages) {
+        historyLoads.erase(workspaceId);
+        auto it = workspaceMap.find(workspaceId);
+        // Deleted meanwhile, or the history was changed under the page
+        if (it == workspaceMap.end() || it->second->getLoadedHistoryStart() != before) {
+            return;
         }
+        // A short page means the store has nothing older
+        it->second->prependChatHistory(messages, messages.size() < limit);
+
+        QListWidgetItem *currentItem = workspacesList->currentItem();
+        if (currentItem && currentItem->data(Qt::UserRole).toInt() == workspaceId) {
+            QScrollBar *scrollBar = chatView->verticalScrollBar();
+            {
+                // Inserting rows moves the scroll bar, which must not look like the user scrolling
+                QSignalBlocker blocker(scrollBar);
+                // The row at the top of the view stays in place while the page is inserted above it
+                QPersistentModelIndex anchor = chatView->indexAt(QPoint(0, 0));
+                int anchorOffset = anchor.isValid() ? chatView->visualRect(anchor).top() : 0;
+                chatModel->prependMessages(messages, it->second->hasUnloadedHistory());
+                if (chatFollowsEnd) {
+                    chatView->scrollToBottom();
+                } else if (anchor.isValid()) {
+                    chatView->scrollTo(anchor, QAbstractItemView::PositionAtTop);
+                    scrollBar->setValue(scrollBar->value() - anchorOffset);
+                }
+            }
+            // Still at the top when the page did not fill the view
+            onChatScrolled(scrollBar->value());
+        }
+        if (scrollTargetWorkspace == workspaceId) {
+            revealScrollTarget();
+        }
+    });
+}
+
+void MainWindow::revealScrollTarget() {
+    auto it = workspaceMap.find(scrollTargetWorkspace);
+    QListWidgetItem *currentItem = workspacesList->currentItem();
+    if (it == workspaceMap.end() || !currentItem || currentItem->data(Qt::UserRole).toInt() != scrollTargetWorkspace) {
+        scrollTargetWorkspace = -1;
+        return;
+    }
+    qint64 loadedStart = it->second->getLoadedHistoryStart();
+    if (scrollTargetPosition < loadedStart && it->second->hasUnloadedHistory()) {
+        // Called again once the pages down to the message are in
+        loadOlderHistory(scrollTargetWorkspace, loadedStart - scrollTargetPosition);
+        return;
+    }
+    scrollTargetWorkspace = -1;
+    QModelIndex index = chatModel->messageIndex(static_cast<int>(scrollTargetPosition - loadedStart));
+    if (index.isValid()) {
+        chatFollowsEnd = false;
+        chatView->setCurrentIndex(index);
+        chatView->scrollTo(index, QAbstractItemView::PositionAtCenter);
+    }
+}
+
+void MainWindow::searchConversations(const QString& text) {
+    quint64 search = ++searchGeneration;
+    searchResultsList->clear();
+    QString query = text.trimmed();
+    searchResultsList->setVisible(!query.isEmpty());
+    // The word being typed matches as a prefix until it is ended with a space
+    if (!query.isEmpty() && !text.endsWith(' ') && !query.endsWith('"') && !query.endsWith('*')) {
+        query += '*';
+    }
+
+    QElapsedTimer elapsed;
+    elapsed.start();
+    if (!query.isEmpty()) {
+        showRelatedEntries(text.trimmed());
+    }
+    // An empty query still goes out, so the search it replaces stops
+    persistence->streamSearch(query, searchResultLimit, [this, search, elapsed](const std::vector<MessageMatch>& matches, bool finished) {
+        if (search != searchGeneration) {
+            return;
+        }
+        for (const MessageMatch& match : matches) {
+            auto it = workspaceMap.find(match.workspaceId);
+            QString name = it != workspaceMap.end() ? it->second->getName() : QString::number(match.workspaceId);
+            QString snippet = match.snippet.simplified();
+            QListWidgetItem *item = new QListWidgetItem(name + ": " + snippet, searchResultsList);
+            item->setToolTip(snippet);
+            item->setData(Qt::UserRole, match.workspaceId);
+            item->setData(Qt::UserRole + 1, match.position);
+        }
+        if (finished && searchResultsList->isVisible()) {
+            statusBar()->showMessage(QString("%1 matches in %2 ms").arg(searchResultsList->count()).arg(elapsed.elapsed()), 3000);
+        }
+    });
+}
+
+void MainWindow::showRelatedEntries(const QString& query) {
+    std::vector<Workspace*> searchable;
+    for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
+        if (it->second->getEmbeddingCount() > 0) {
+            searchable.push_back(it->second);
+        }
+    }
+    if (searchable.empty()) {
+        return;
+    }
+    // Blocks this thread, which is the one that adds entries and deletes workspaces, until the
+    // searches under way are done
+    std::vector<float> queryEmbedding = searchable.front()->getEmbedding(query.toStdString());
+    WorkspaceSearchResult related = workspaceSearch.search(searchable, queryEmbedding, relatedEntryLimit, relatedSearchBudgetMs);
+    for (const WorkspaceSearchHit& hit : related.hits) {
+        QString snippet = hit.text.simplified();
+        QListWidgetItem *item = new QListWidgetItem(hit.workspaceName + " (related): " + snippet, searchResultsList);
+        item->setToolTip(snippet);
+        item->setData(Qt::UserRole, hit.workspaceId);
+        item->setData(Qt::UserRole + 1, -1); // Not a message; only the workspace is opened
+    }
+}
+
+void MainWindow::openSearchResult(QListWidgetItem *item) {
+    int workspaceId = item->data(Qt::UserRole).toInt();
+    qint64 position = item->data(Qt::UserRole + 1).toLongLong();
+    for (int row = 0; row < workspacesList->count(); ++row) {
+        QListWidgetItem *workspaceItem = workspacesList->item(row);
+        if (workspaceItem->data(Qt::UserRole).toInt() == workspaceId) {
+            workspacesList->setCurrentItem(workspaceItem);
+            selectWorkspace(workspaceItem);
+            if (position >= 0) {
+                scrollTargetWorkspace = workspaceId;
+                scrollTargetPosition = position;
+                revealScrollTarget();
+            }
+            return;
+        }
+    }
+}
+
+void MainWindow::releaseIdleWorkspaces() {
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QListWidgetItem *currentItem = workspacesList->currentItem();
+    int currentId = currentItem ? currentItem->data(Qt::UserRole).toInt() : -1;
+    bool archived = false;
+    for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
+        Workspace* workspace = it->second;
+        qint64 idle = now - workspace->getLastActive();
+        if (it->first == currentId || idle < unloadAfterMs) {
+            continue;
+        }
+        // Selecting the workspace again pages the history back in
+        if (!workspace->getChatHistory().isEmpty() && historyLoads.count(it->first) == 0) {
+            workspace->unloadChatHistory();
+        }
+        // Once per idle period; messages added after an archive are plain until the next one
+        if (idle >= archiveAfterMs && workspace->getArchivedAt() < workspace->getLastActive()) {
+            workspace->markArchived();
+            persistence->archiveHistory(it->first);
+            archived = true;
+        }
+    }
+    if (archived) {
+        saveWorkspaces(); // So a restart does not archive the same histories again
+    }
+}
+
+void MainWindow::onChatScrolled(int value) {
+    QScrollBar *scrollBar = chatView->verticalScrollBar();
+    chatFollowsEnd = value == scrollBar->maximum();
+    QListWidgetItem *currentItem = workspacesList->currentItem();
+    if (currentItem && value == scrollBar->minimum()) {
+        loadOlderHistory(currentItem->data(Qt::UserRole).toInt());
     }
 }
 
@@ -218,44 +495,76 @@ void MainWindow::sendMessage() {
 
         QString modelName = workspaceMap[workspaceId]->getModel();
         if (modelName.isEmpty()) {
-            chatTextBrowser->append("No model selected for this workspace.");
+            chatModel->addNotice("No model selected for this workspace.");
             return;
         }
 
         if (!MainWindowHelpers::verifyModelStartup(modelName, modelStatusMap)) {
-            chatTextBrowser->append("Model is not ready.");
+            chatModel->addNotice("Model is not ready.");
             return;
         }
 
         // Display loading indicator
-        chatTextBrowser->append("Generating response...");
-
-        // Use std::async for asynchronous generation
-        auto future = std::async(std::launch::async, [this, workspaceId, modelName, message]() {
-            try {
-                workspaceMap[workspaceId]->getAgent()->generate(modelName.toStdString(), message.toStdString(), [this, workspaceId](const std::string& response) {
-                    QString responseText = QString::fromStdString(response);
-                    QMetaObject::invokeMethod(this, [this, responseText, workspaceId]() {
-                        MainWindowHelpers::updateChatWithMarkdown(chatTextBrowser, responseText);
-                        workspaceMap[workspaceId]->addChatMessage(responseText);
-                        saveWorkspaces(); // Save workspaces after adding a chat message
-                    });
-                });
-            } catch (const std::runtime_error& e) {
-                QMetaObject::invokeMethod(this, [this, e]() {
-                    chatTextBrowser->append("Runtime Error: " + QString::fromStdString(e.what()));
-                });
-            } catch (const std::exception& e) {
-                QMetaObject::invokeMethod(this, [this, e]() {
-                    chatTextBrowser->append("Error: " + QString::fromStdString(e.what()));
+        chatModel->addNotice("Generating response...");
+
+        // The agent generates on its own thread and returns right away; both callbacks come back
+        // to this thread, where the reply so far is painted while it streams in
+        auto progress = [this, workspaceId](const std::string& closedBlocksHtml, const std::string& trailingHtml) {
+            QString closedHtml = QString::fromStdString(closedBlocksHtml);
+            QString replyHtml = QString::fromStdString(trailingHtml);
+            QMetaObject::invokeMethod(this, [this, closedHtml, replyHtml, workspaceId]() {
+                QListWidgetItem *currentItem = workspacesList->currentItem();
+                if (currentItem && currentItem->data(Qt::UserRole).toInt() == workspaceId) {
+                    chatModel->setPendingReply(closedHtml, replyHtml);
+                }
+            });
+        };
+        try {
+            workspaceMap[workspaceId]->getAgent()->generateStreaming(modelName.toStdString(), message.toStdString(), progress, [this, workspaceId](const std::string& response) {
+                QString responseText = QString::fromStdString(response);
+                QMetaObject::invokeMethod(this, [this, responseText, workspaceId]() {
+                    auto workspace = workspaceMap.find(workspaceId);
+                    if (workspace == workspaceMap.end()) {
+                        return; // Deleted while the reply was generated
+                    }
+                    QListWidgetItem *currentItem = workspacesList->currentItem();
+                    if (currentItem && currentItem->data(Qt::UserRole).toInt() == workspaceId) {
+                        MainWindowHelpers::updateChatWithMarkdown(chatModel, responseText);
+                    }
+                    workspace->second->addChatMessage(responseText);
+                    workspace->second->markActive();
+                    // One row per message instead of rewriting every history
+                    persistence->appendMessage(workspaceId, responseText);
                 });
-            }
-        });
+            });
+        } catch (const std::runtime_error& e) {
+            chatModel->addNotice("Runtime Error: " + QString::fromStdString(e.what()));
+        } catch (const std::exception& e) {
+            chatModel->addNotice("Error: " + QString::fromStdString(e.what()));
+        }
     }
 }
 
 void MainWindow::clearChat() {
-    chatTextBrowser->clear();
+    chatModel->clear();
+}
+
+void MainWindow::copySelectedMessages() {
+    QModelIndexList selected = chatView->selectionModel()->selectedIndexes();
+    std::sort(selected.begin(), selected.end());
+    QStringList texts;
+    for (const QModelIndex& index : selected) {
+        QString text = index.data().toString();
+        if (index.data(ChatModel::KindRole).toInt() == ChatModel::PendingReply) {
+            QTextDocument document;
+            document.setHtml(text);
+            text = document.toPlainText();
+        }
+        texts.append(text);
+    }
+    if (!texts.isEmpty()) {
+        QApplication::clipboard()->setText(texts.join("\n\n"));
+    }
 }
 
 void MainWindow::openSettings(QListWidgetItem *item) {
@@ -333,7 +642,7 @@ void MainWindow::openSettings(QListWidgetItem *item) {
         workspaceMap[workspaceId]->setModel(selectedModel);
         workspaceMap[workspaceId]->setUseEmbedding(useEmbedding); // Set the embedding setting
         workspaceMap[workspaceId]->setEnableStreaming(enableStreaming); // Set the streaming setting
-        chatTextBrowser->append("API " + selectedApi + " and Model " + selectedModel + " selected for workspace " + workspaceName);
+        chatModel->addNotice("API " + selectedApi + " and Model " + selectedModel + " selected for workspace " + workspaceName);
 
         // Save workspaces to file after setting the model
         saveWorkspaces();
@@ -381,19 +690,75 @@ void MainWindow::deleteWorkspace() {
     reply = QMessageBox::question(this, "Delete Workspace", "Are you sure you want to delete workspace " + workspaceName + "?", QMessageBox::Yes | QMessageBox::No);
 
     if (reply == QMessageBox::Yes) {
+        detachBranches(workspaceMap[workspaceId]);
         delete workspaceMap[workspaceId];
         workspaceMap.erase(workspaceId);
+        persistence->removeWorkspace(workspaceId);
         delete currentItem;
         saveWorkspaces();
     }
 }
 
+void MainWindow::forkWorkspace() {
+    QListWidgetItem *currentItem = workspacesList->currentItem();
+    if (!currentItem) return;
+
+    int parentId = currentItem->data(Qt::UserRole).toInt();
+    auto parent = workspaceMap.find(parentId);
+    if (parent == workspaceMap.end()) return;
+
+    // Forking after an earlier message retries the conversation from there
+    int historySize = static_cast<int>(parent->second->getHistorySize());
+    bool ok;
+    int position = QInputDialog::getInt(this, "Fork Workspace", "Fork after message:", historySize, 0, historySize, 1, &ok);
+    if (!ok) return;
+
+    LlmAgentInterface* agent = MainWindowHelpers::createAgent(parent->second->getApiType());
+    if (!agent) return;
+
+    QMap<int, Workspace*> qmapWorkspaceMap;
+    for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
+        qmapWorkspaceMap[it->first] = it->second;
+    }
+    int workspaceId = MainWindowHelpers::getNextWorkspaceId(qmapWorkspaceMap);
+    QString workspaceName = parent->second->getName() + " (fork)";
+    for (int n = 2; !workspacesList->findItems(workspaceName, Qt::MatchExactly).isEmpty(); ++n) {
+        workspaceName = parent->second->getName() + " (fork " + QString::number(n) + ")";
+    }
+
+    // Shares the parent's history and index instead of copying them
+    bool resumesContext = parent->second->hasReplyContext(position);
+    Workspace* branch = new Workspace(parent->second->fork(workspaceName, workspaceId, agent, position));
+    workspaceMap[workspaceId] = branch;
+    // Stored right away, so the branch's first message never arrives before its row
+    persistence->forkWorkspace(MainWindowHelpers::workspaceRecord(branch));
+
+    QListWidgetItem *item = new QListWidgetItem(workspaceName, workspacesList);
+    item->setData(Qt::UserRole, workspaceId); // Store the workspace ID in the item's data
+    workspacesList->addItem(item);
+    workspacesList->setCurrentItem(item);
+    selectWorkspace(item);
+    if (!resumesContext) {
+        statusBar()->showMessage("The fork starts without the model's context of the messages before it; "
+                                 "that is only kept for the last few replies", 8000);
+    }
+}
+
+void MainWindow::detachBranches(const Workspace* parent) {
+    for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
+        if (it->second != parent) {
+            it->second->detachFrom(*parent);
+        }
+    }
+}
+
 void MainWindow::deleteAllWorkspaces() {
     QMessageBox::StandardButton reply;
     reply = QMessageBox::question(this, "Delete All Workspaces", "Are you sure you want to delete all workspaces?", QMessageBox::Yes | QMessageBox::No);
 
     if (reply == QMessageBox::Yes) {
         for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
+            persistence->removeWorkspace(it->first);
             delete it->second;
         }
         workspaceMap.clear();
@@ -407,11 +772,13 @@ void MainWindow::showContextMenu(const QPoint& pos) {
 
     QAction renameAction("Rename Workspace", this);
     QAction deleteAction("Delete Workspace", this);
+    QAction forkAction("Fork Workspace", this);
     QAction settingsAction("Settings", this);
     QAction deleteAllAction("Delete All Workspaces", this);
 
     connect(&renameAction, &QAction::triggered, this, &MainWindow::renameWorkspace);
     connect(&deleteAction, &QAction::triggered, this, &MainWindow::deleteWorkspace);
+    connect(&forkAction, &QAction::triggered, this, &MainWindow::forkWorkspace);
     connect(&settingsAction, &QAction::triggered, this, [this, pos]() {
         QListWidgetItem* item = workspacesList->itemAt(pos);
         if (item) {
@@ -422,6 +789,7 @@ void MainWindow::showContextMenu(const QPoint& pos) {
 
     contextMenu.addAction(&renameAction);
     contextMenu.addAction(&deleteAction);
+    contextMenu.addAction(&forkAction);
     contextMenu.addAction(&settingsAction);
     contextMenu.addAction(&deleteAllAction);
 
@@ -473,23 +841,23 @@ void MainWindow::streamSendMessage() {
 
         QString modelName = workspaceMap[workspaceId]->getModel();
         if (modelName.isEmpty()) {
-            chatTextBrowser->append("No model selected for this workspace.");
+            chatModel->addNotice("No model selected for this workspace.");
             return;
         }
 
         if (!MainWindowHelpers::verifyModelStartup(modelName, modelStatusMap)) {
-            chatTextBrowser->append("Model is not ready.");
+            chatModel->addNotice("Model is not ready.");
             return;
         }
 
-        chatTextBrowser->append("Generating response...");
+        chatModel->addNotice("Generating response...");
 
         ollama::OllamaApi ollamaApi;
         ollamaApi.generateWithEmbedding(modelName.toStdString(), message.toStdString(), [this, workspaceId](const std::string& embedding) {
             std::vector<float> embeddingVec = parseEmbedding(embedding);
             workspaceMap[workspaceId]->streamAddEmbedding(embeddingVec, QString::fromStdString(embedding));
             QMetaObject::invokeMethod(this, [this, embedding]() {
-                chatTextBrowser->append("Embedding received: " + QString::fromStdString(embedding));
+                chatModel->addNotice("Embedding received: " + QString::fromStdString(embedding));
             });
         }, true);
     }
@@ -12,8 +12,8 @@
 
 namespace MainWindowHelpers {
 
-void updateChatWithMarkdown(QTextBrowser* chatTextBrowser, const QString& markdownText) {
-    chatTextBrowser->append(markdownText);
+void updateChatWithMarkdown(ChatModel* chatModel, const QString& markdownText) {
+    chatModel->appendMessage(markdownText);
 }
 
 LlmAgentInterface* createAgent(const QString& apiType) {
@@ -25,55 +25,24 @@ LlmAgentInterface* createAgent(const QString& apiType) {
     return nullptr;
 }
 
-void loadWorkspaces(QMap<int, Workspace*>& workspaceMap, QListWidget* workspacesList) {
-    try {
-        QString filePath = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/workspaces.json";
-        QFile file(filePath);
-
-        if (!file.exists()) {
-            QDir dir(QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation));
-            if (!dir.mkpath(".")) {
-                qCritical() << "Failed to create directory for workspaces file.";
-                return;
-            }
-
-            // Create an empty file if it doesn't exist
-            if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-                qCritical() << "Failed to create workspaces file:" << file.errorString();
-                return;
-            }
-            file.close();
-        }
-
-        if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-            qCritical() << "Failed to open workspaces file for reading:" << file.errorString();
-            return;
-        }
-
-        QByteArray data = file.readAll();
-        file.close();
-
-        QJsonDocument jsonDoc = QJsonDocument::fromJson(data);
-        if (jsonDoc.isNull() || !jsonDoc.isArray()) {
-            qCritical() << "Invalid JSON format in workspaces file.";
-            return;
-        }
-
-        QJsonArray jsonArray = jsonDoc.array();
+QString dataDirectory() {
+    return QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+}
 
-        for (const auto& jsonValue : jsonArray) {
-            if (jsonValue.isObject()) {
-                QJsonObject jsonObject = jsonValue.toObject();
-                QString agentType = jsonObject["agentType"].toString();
-                QString apiType = jsonObject["apiType"].toString();
-                LlmAgentInterface* agent = createAgent(apiType);
-                if (agent) {
-                    Workspace* workspace = new Workspace(Workspace::fromJson(jsonObject, agent));
-                    workspaceMap[workspace->getId()] = workspace;
-                    QListWidgetItem *item = new QListWidgetItem(workspace->getName(), workspacesList);
-                    item->setData(Qt::UserRole, workspace->getId()); // Store the workspace ID in the item's data
-                    workspacesList->addItem(item);
-                }
+void loadWorkspaces(QMap<int, Workspace*>& workspaceMap, QListWidget* workspacesList, const std::vector<WorkspaceRecord>& records) {
+    try {
+        for (const auto& record : records) {
+            QString apiType = record.json["apiType"].toString();
+            LlmAgentInterface* agent = createAgent(apiType);
+            if (agent) {
+                Workspace* workspace = new Workspace(Workspace::fromJson(record.json, agent));
+                // Messages are paged in when the workspace is selected
+                workspace->setStoredHistorySize(record.messageCount);
+                workspace->setForkOrigin(record.parentId, record.forkPosition);
+                workspaceMap[workspace->getId()] = workspace;
+                QListWidgetItem *item = new QListWidgetItem(workspace->getName(), workspacesList);
+                item->setData(Qt::UserRole, workspace->getId()); // Store the workspace ID in the item's data
+                workspacesList->addItem(item);
             }
         }
     } catch (const QException& e) {
@@ -83,32 +52,22 @@ void loadWorkspaces(QMap<int, Workspace*>& workspaceMap, QListWidget* workspaces
     }
 }
 
-void saveWorkspaces(const QMap<int, Workspace*>& workspaceMap) {
-    try {
-        QString filePath = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation) + "/workspaces.json";
-        QFile file(filePath);
-
-        if (!file.open(QIODevice::WriteOnly | QIODevice::Text)) {
-            qCritical() << "Failed to open workspaces file for writing:" << file.errorString();
-            return;
-        }
-
-        QJsonArray jsonArray;
-        for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
-            QJsonObject jsonObject = it.value()->toJson();
-            jsonObject["agentType"] = QString::fromStdString(it.value()->getAgent()->getAgentType()); // Use getAgentType()
-            jsonObject["apiType"] = it.value()->getApiType();
-            jsonArray.append(jsonObject);
-        }
+WorkspaceRecord workspaceRecord(const Workspace* workspace) {
+    WorkspaceRecord record;
+    record.id = workspace->getId();
+    record.agentType = QString::fromStdString(workspace->getAgent()->getAgentType()); // Use getAgentType()
+    record.json = workspace->toJson(false);
+    record.parentId = workspace->getParentId();
+    record.forkPosition = workspace->getForkPosition();
+    return record;
+}
 
-        QJsonDocument jsonDoc(jsonArray);
-        file.write(jsonDoc.toJson());
-        file.close();
-    } catch (const QException& e) {
-        qCritical() << "Exception caught in saveWorkspaces:" << e.what();
-    } catch (...) {
-        qCritical() << "Unknown exception caught in saveWorkspaces";
+std::vector<WorkspaceRecord> workspaceRecords(const QMap<int, Workspace*>& workspaceMap) {
+    std::vector<WorkspaceRecord> records;
+    for (auto it = workspaceMap.begin(); it != workspaceMap.end(); ++it) {
+        records.push_back(workspaceRecord(it.value()));
     }
+    return records;
 }
 
 bool verifyModelStartup(const QString& modelName, std::unordered_map<std::string, bool>& modelStatusMap) {
@@ -0,0 +1,164 @@
+// markdown_renderer.cpp
+#include "markdown_renderer.h"
+#include <QCache>
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QMetaObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRegularExpression>
+#include <QRunnable>
+#include <algorithm>
+#include <cmark.h>
+#include <cstdlib>
+#include <functional>
+
+namespace {
+// Rendered HTML is a few times the size of its markdown; this holds a long session's worth
+constexpr int cachedHtmlCharacters = 32 * 1024 * 1024;
+
+struct HtmlCache {
+    QMutex lock;
+    QCache<QByteArray, QString> entries{cachedHtmlCharacters};
+};
+
+HtmlCache& htmlCache() {
+    static HtmlCache cache;
+    return cache;
+}
+
+// Hands the HTML back to the thread of the context object
+class RenderTask : public QRunnable {
+public:
+    RenderTask(QObject* context, const QString& markdown, std::function<void(const QString&)> finished)
+        : context(context), markdown(markdown), finished(std::move(finished)) {}
+
+    void run() override {
+        QString html = MarkdownRenderer::toHtml(markdown);
+        std::function<void(const QString&)> finished = this->finished;
+        QMetaObject::invokeMethod(context, [finished, html]() {
+            finished(html);
+        }, Qt::QueuedConnection);
+    }
+
+private:
+    QObject* context;
+    QString markdown;
+    std::function<void(const QString&)> finished;
+};
+
+int leadingSpaces(const QString& line) {
+    int count = 0;
+    while (count < line.size() && line.at(count) == ' ') {
+        ++count;
+    }
+    return count;
+}
+}
+
+MarkdownRenderer::MarkdownRenderer(QObject* parent) : QObject(parent) {
+}
+
+QString MarkdownRenderer::html(const QString& markdown) {
+    QByteArray hash = key(markdown);
+    {
+        HtmlCache& cache = htmlCache();
+        QMutexLocker locker(&cache.lock);
+        if (const QString* cached = cache.entries.object(hash)) {
+            return *cached;
+        }
+    }
+    if (!pending.contains(hash)) {
+        pending.insert(hash);
+        pool.start(new RenderTask(this, markdown, [this, hash](const QString& html) {
+            store(hash, html);
+            pending.remove(hash);
+            emit rendered();
+        }));
+    }
+    return QString();
+}
+
+void MarkdownRenderer::insert(const QString& markdown, const QString& html) {
+    store(key(markdown), html);
+}
+
+QString MarkdownRenderer::toHtml(const QString& markdown) {
+    QByteArray utf8 = markdown.toUtf8();
+    char* html = cmark_markdown_to_html(utf8.constData(), static_cast<size_t>(utf8.size()), CMARK_OPT_DEFAULT);
+    if (!html) {
+        qWarning() << "Failed to render markdown of" << markdown.size() << "characters";
+        return markdown.toHtmlEscaped();
+    }
+    QString result = QString::fromUtf8(html);
+    free(html);
+    return result;
+}
+
+QByteArray MarkdownRenderer::key(const QString& markdown) {
+    // Hashing the UTF-16 as it is saves converting every message before the lookup
+    QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(markdown.constData()),
+                                               markdown.size() * static_cast<int>(sizeof(QChar)));
+    return QCryptographicHash::hash(bytes, QCryptographicHash::Md5);
+}
+
+void MarkdownRenderer::store(const QByteArray& key, const QString& html) {
+    HtmlCache& cache = htmlCache();
+    QMutexLocker locker(&cache.lock);
+    cache.entries.insert(key, new QString(html), std::max(1, html.size()));
+}
+
+void MarkdownStream::append(const QString& text) {
+    source += text;
+    closeBlocks();
+}
+
+QString MarkdownStream::html() const {
+    return closedHtml + trailingHtml();
+}
+
+QString MarkdownStream::trailingHtml() const {
+    return MarkdownRenderer::toHtml(source.mid(closedEnd));
+}
+
+void MarkdownStream::closeBlocks() {
+    int end;
+    while ((end = source.indexOf('\n', scanned)) != -1) {
+        int lineStart = scanned;
+        QString line = source.mid(lineStart, end - lineStart);
+        scanned = end + 1;
+
+        QString trimmed = line.trimmed();
+        int indent = leadingSpaces(line);
+        if (!fence.isEmpty()) {
+            // Closed by a run of at least as many of the same character and nothing else
+            if (indent < 4 && trimmed.startsWith(fence) && trimmed.count(fence.at(0)) == trimmed.size()) {
+                fence.clear();
+            }
+            continue;
+        }
+        if (trimmed.isEmpty()) {
+            afterBlank = true;
+            continue;
+        }
+        if (afterBlank && startsBlock(line) && lineStart > closedEnd) {
+            closedHtml += MarkdownRenderer::toHtml(source.mid(closedEnd, lineStart - closedEnd));
+            closedEnd = lineStart;
+        }
+        afterBlank = false;
+        if (indent < 4 && (trimmed.startsWith("```") || trimmed.startsWith("~~~"))) {
+            QChar marker = trimmed.at(0);
+            int length = 0;
+            while (length < trimmed.size() && trimmed.at(length) == marker) {
+                ++length;
+            }
+            fence = QString(length, marker);
+        }
+    }
+}
+
+bool MarkdownStream::startsBlock(const QString& line) {
+    // Indented lines and markers may continue the list or quote above the blank line
+    static const QRegularExpression continuation("^(\\s|>|[-*+](\\s|$)|\\d{1,9}[.)](\\s|$))");
+    return !continuation.match(line).hasMatch();
+}
@@ -0,0 +1,133 @@
+// message_compressor.cpp
+#include "message_compressor.h"
+#include <QDebug>
+#include <zdict.h>
+#include <zstd.h>
+
+namespace {
+constexpr char formatZstd = 1;
+constexpr int headerSize = 1 + 4;
+// Archiving runs in the background, so the ratio matters more than the speed
+constexpr int compressionLevel = 12;
+// Fewer samples than this make a dictionary that fits the sample rather than chat text
+constexpr size_t minTrainingSamples = 256;
+// A message larger than this is never decompressed in one go; it is a sign of a corrupt header
+constexpr unsigned long long maxMessageSize = 256ull << 20;
+
+void writeId(char* out, quint32 id) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = static_cast<char>((id >> (8 * i)) & 0xFF);
+    }
+}
+
+quint32 readId(const char* in) {
+    quint32 id = 0;
+    for (int i = 0; i < 4; ++i) {
+        id |= static_cast<quint32>(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return id;
+}
+} // namespace
+
+MessageCompressor::MessageCompressor()
+    : compressionContext(ZSTD_createCCtx()), decompressionContext(ZSTD_createDCtx()) {
+}
+
+MessageCompressor::~MessageCompressor() {
+    for (auto& entry : dictionaries) {
+        ZSTD_freeCDict(entry.second.compression);
+        ZSTD_freeDDict(entry.second.decompression);
+    }
+    ZSTD_freeCCtx(compressionContext);
+    ZSTD_freeDCtx(decompressionContext);
+}
+
+QByteArray MessageCompressor::trainDictionary(const std::vector<QByteArray>& samples, size_t dictionarySize) {
+    if (samples.size() < minTrainingSamples) {
+        return QByteArray();
+    }
+    QByteArray buffer;
+    std::vector<size_t> sampleSizes;
+    sampleSizes.reserve(samples.size());
+    for (const auto& sample : samples) {
+        buffer.append(sample);
+        sampleSizes.push_back(static_cast<size_t>(sample.size()));
+    }
+
+    QByteArray dictionary(static_cast<int>(dictionarySize), Qt::Uninitialized);
+    size_t size = ZDICT_trainFromBuffer(dictionary.data(), dictionarySize, buffer.constData(),
+                                        sampleSizes.data(), static_cast<unsigned>(sampleSizes.size()));
+    if (ZDICT_isError(size)) {
+        qWarning() << "Could not train a message dictionary:" << ZDICT_getErrorName(size);
+        return QByteArray();
+    }
+    dictionary.resize(static_cast<int>(size));
+    return dictionary;
+}
+
+void MessageCompressor::addDictionary(quint32 id, const QByteArray& dictionary) {
+    Dictionary& entry = dictionaries[id];
+    ZSTD_freeCDict(entry.compression);
+    ZSTD_freeDDict(entry.decompression);
+    entry.compression = ZSTD_createCDict(dictionary.constData(), static_cast<size_t>(dictionary.size()), compressionLevel);
+    entry.decompression = ZSTD_createDDict(dictionary.constData(), static_cast<size_t>(dictionary.size()));
+    activeDictionary = id;
+}
+
+bool MessageCompressor::hasDictionary() const {
+    return activeDictionary != 0;
+}
+
+QByteArray MessageCompressor::compress(const QByteArray& text) {
+    size_t bound = ZSTD_compressBound(static_cast<size_t>(text.size()));
+    QByteArray compressed(static_cast<int>(headerSize + bound), Qt::Uninitialized);
+    compressed[0] = formatZstd;
+    writeId(compressed.data() + 1, activeDictionary);
+
+    size_t size;
+    auto dictionary = dictionaries.find(activeDictionary);
+    if (dictionary != dictionaries.end()) {
+        size = ZSTD_compress_usingCDict(compressionContext, compressed.data() + headerSize, bound,
+                                        text.constData(), static_cast<size_t>(text.size()), dictionary->second.compression);
+    } else {
+        size = ZSTD_compressCCtx(compressionContext, compressed.data() + headerSize, bound,
+                                 text.constData(), static_cast<size_t>(text.size()), compressionLevel);
+    }
+    if (ZSTD_isError(size) || headerSize + size >= static_cast<size_t>(text.size())) {
+        return QByteArray();
+    }
+    compressed.resize(static_cast<int>(headerSize + size));
+    return compressed;
+}
+
+bool MessageCompressor::decompress(const QByteArray& compressed, QByteArray& text) {
+    if (!isCompressed(compressed)) {
+        return false;
+    }
+    const char* frame = compressed.constData() + headerSize;
+    size_t frameSize = static_cast<size_t>(compressed.size() - headerSize);
+    unsigned long long size = ZSTD_getFrameContentSize(frame, frameSize);
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > maxMessageSize) {
+        return false;
+    }
+
+    text.resize(static_cast<int>(size));
+    quint32 id = readId(compressed.constData() + 1);
+    size_t result;
+    if (id == 0) {
+        result = ZSTD_decompressDCtx(decompressionContext, text.data(), static_cast<size_t>(text.size()), frame, frameSize);
+    } else {
+        auto dictionary = dictionaries.find(id);
+        if (dictionary == dictionaries.end()) {
+            qWarning() << "Message was compressed with unknown dictionary" << id;
+            return false;
+        }
+        result = ZSTD_decompress_usingDDict(decompressionContext, text.data(), static_cast<size_t>(text.size()), frame, frameSize,
+                                            dictionary->second.decompression);
+    }
+    return !ZSTD_isError(result) && result == size;
+}
+
+bool MessageCompressor::isCompressed(const QByteArray& data) {
+    return data.size() > headerSize && data[0] == formatZstd;
+}
@@ -1,15 +1,22 @@
 // ollama_agent.cpp
 #include "ollama_agent.h"
 #include "Ollama.hpp"
+#include "markdown_renderer.h"
 #include <QDebug>
 #include <QString>
 #include <QStringList>
-#include <QTextDocument>
-#include <sstream>
+#include <QJsonDocument>
 #include <QMetaObject>
 #include <QCoreApplication>
+#include <chrono>
 #include <future>
 
+namespace {
+// Rendering the reply so far costs its trailing block; progress is spaced out so tokens
+// arriving faster than the view repaints are not rendered for nothing
+constexpr std::chrono::milliseconds progressInterval(50);
+}
+
 OllamaAgent::OllamaAgent() : serverURL("http://localhost:11434") {
     ollama::setServerURL(serverURL);
 }
@@ -47,23 +54,59 @@ bool OllamaAgent::load_model(const std::string& modelName) {
 }
 
 void OllamaAgent::generate(const std::string& modelName, const std::string& prompt, std::function<void(const std::string&)> callback) {
-    std::ostringstream responseStream;
-    std::future<void> future = std::async(std::launch::async, [this, modelName, prompt, callback, &responseStream]() {
+    generateStreaming(modelName, prompt, nullptr, callback);
+}
+
+void OllamaAgent::generateStreaming(const std::string& modelName, const std::string& prompt, ProgressCallback progress,
+                                    std::function<void(const std::string&)> callback) {
+    // Returns right away; the reply is generated on its own thread. Finished ones are dropped
+    // here, the rest are joined when the agent is destroyed
+    generations.remove_if([](const std::future<void>& generation) {
+        return generation.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    });
+    generations.push_back(std::async(std::launch::async, [this, modelName, prompt, progress, callback]() {
+        MarkdownStream reply;
+        std::chrono::steady_clock::time_point lastProgress;
         try {
-            ollama::generate(modelName, prompt, [this, callback, &responseStream](const ollama::response& response) {
-                responseStream << response.as_simple_string();
+            // The server continues the conversation from the context of the previous reply
+            QJsonObject previous;
+            QJsonArray previousContext = getContext();
+            if (!previousContext.isEmpty()) {
+                previous["context"] = previousContext;
+            }
+            ollama::response lastContext(QJsonDocument(previous).toJson(QJsonDocument::Compact).toStdString());
+            ollama::generate(modelName, prompt, lastContext, [this, progress, callback, &reply, &lastProgress](const ollama::response& response) {
+                reply.append(QString::fromStdString(response.as_simple_string()));
                 qDebug() << "Received response from model:" << QString::fromStdString(response.as_simple_string());
 
-                if (response.as_json()["done"] == true) {
-                    std::string fullResponse = responseStream.str();
-                    QString responseText = QString::fromStdString(fullResponse);
-                    QString htmlText = markdownToHtml(responseText);
+                bool done = response.as_json()["done"] == true;
+                auto now = std::chrono::steady_clock::now();
+                if (progress && (done || now - lastProgress >= progressInterval)) {
+                    lastProgress = now;
+                    QString trailingHtml = reply.trailingHtml();
+                    if (done) {
+                        // The chat view finds the complete reply rendered already
+                        MarkdownRenderer::insert(reply.markdown(), reply.closedBlocksHtml() + trailingHtml);
+                    }
+                    std::string closedText = reply.closedBlocksHtml().toStdString();
+                    std::string trailingText = trailingHtml.toStdString();
+                    QMetaObject::invokeMethod(QCoreApplication::instance(), [progress, closedText, trailingText]() {
+                        progress(closedText, trailingText);
+                    });
+                }
 
-                    QMetaObject::invokeMethod(QCoreApplication::instance(), [callback, htmlText]() {
-                        callback(htmlText.toStdString());
+                if (done) {
+                    if (response.as_json().contains("context")) {
+                        QByteArray contextJson = QByteArray::fromStdString(response.as_json()["context"].dump());
+                        setContext(QJsonDocument::fromJson(contextJson).array());
+                    }
+                    // Kept as markdown; the chat view renders it when shown
+                    std::string markdown = reply.markdown().toStdString();
+                    QMetaObject::invokeMethod(QCoreApplication::instance(), [callback, markdown]() {
+                        callback(markdown);
                     });
 
-                    responseStream.str("");
+                    reply = MarkdownStream();
                 }
             });
         } catch (const ollama::exception& e) {
@@ -72,7 +115,7 @@ void OllamaAgent::generate(const std::string& modelName, const std::string& prom
                 callback("Error: " + std::string(e.what()));
             });
         }
-    });
+    }));
 }
 
 QJsonObject OllamaAgent::getSettings() const {
@@ -86,8 +129,12 @@ void OllamaAgent::setSettings(const QJsonObject& settings) {
     serverURL = settings["serverURL"].toString().toStdString();
 }
 
-QString OllamaAgent::markdownToHtml(const QString& markdownText) {
-    QTextDocument document;
-    document.setMarkdown(markdownText);
-    return document.toHtml();
+QJsonArray OllamaAgent::getContext() const {
+    std::lock_guard<std::mutex> lock(contextMutex);
+    return context;
+}
+
+void OllamaAgent::setContext(const QJsonArray& context) {
+    std::lock_guard<std::mutex> lock(contextMutex);
+    this->context = context;
 }
@@ -0,0 +1,154 @@
+// persistence_worker.cpp
+#include "persistence_worker.h"
+#include <QDebug>
+
+namespace {
+// Renames, settings changes and deletions within this window share one transaction
+constexpr int coalesceWindowMs = 500;
+// The first matches of a search show after this many are read
+constexpr int searchBatchSize = 25;
+}
+
+PersistenceWorker::PersistenceWorker(WorkspaceStore* store, SnapshotProvider snapshotProvider, QObject* parent)
+    : QObject(parent), store(store), snapshotProvider(std::move(snapshotProvider)), coalesceTimer(this) {
+    thread.setObjectName("PersistenceWorker");
+    coalesceTimer.setSingleShot(true);
+    coalesceTimer.setInterval(coalesceWindowMs);
+    connect(&coalesceTimer, &QTimer::timeout, this, &PersistenceWorker::takeSnapshot);
+}
+
+PersistenceWorker::~PersistenceWorker() {
+    coalesceTimer.stop();
+    // Queued events are handled in order, so this returns once the earlier ones are done;
+    // the connection must be closed on the thread that opened it
+    runBlocking([this]() { store->close(); });
+    if (thread.isRunning()) {
+        thread.quit();
+        thread.wait();
+    }
+    delete store;
+}
+
+void PersistenceWorker::start() {
+    store->moveToThread(&thread);
+    thread.start();
+    WorkspaceStore* target = store;
+    QMetaObject::invokeMethod(store, [target]() {
+        if (!target->open()) {
+            qCritical() << "Workspaces will not be saved in this session";
+        }
+    }, Qt::QueuedConnection);
+}
+
+std::vector<WorkspaceRecord> PersistenceWorker::loadWorkspaces() {
+    std::vector<WorkspaceRecord> records;
+    runBlocking([this, &records]() { records = store->loadWorkspaces(); });
+    return records;
+}
+
+void PersistenceWorker::appendMessage(int workspaceId, const QString& message) {
+    WorkspaceStore* target = store;
+    QMetaObject::invokeMethod(store, [target, workspaceId, message]() {
+        target->appendMessage(workspaceId, message);
+    }, Qt::QueuedConnection);
+}
+
+void PersistenceWorker::loadHistoryPage(int workspaceId, qint64 beforePosition, int limit, HistoryCallback onLoaded) {
+    WorkspaceStore* target = store;
+    QMetaObject::invokeMethod(store, [this, target, workspaceId, beforePosition, limit, onLoaded]() {
+        QVector<QString> messages = target->loadMessages(workspaceId, beforePosition, limit);
+        QMetaObject::invokeMethod(this, [onLoaded, messages]() { onLoaded(messages); }, Qt::QueuedConnection);
+    }, Qt::QueuedConnection);
+}
+
+void PersistenceWorker::forkWorkspace(const WorkspaceRecord& record) {
+    WorkspaceStore* target = store;
+    QMetaObject::invokeMethod(store, [target, record]() { target->forkWorkspace(record); }, Qt::QueuedConnection);
+}
+
+void PersistenceWorker::removeWorkspace(int workspaceId) {
+    WorkspaceStore* target = store;
+    QMetaObject::invokeMethod(store, [target, workspaceId]() { target->removeWorkspace(workspaceId); }, Qt::QueuedConnection);
+}
+
+void PersistenceWorker::archiveHistory(int workspaceId) {
+    WorkspaceStore* target = store;
+    QMetaObject::invokeMethod(store, [target, workspaceId]() { target->archiveHistory(workspaceId); }, Qt::QueuedConnection);
+}
+
+void PersistenceWorker::streamSearch(const QString& query, int limit, SearchCallback onMatches) {
+    quint64 search = ++latestSearch;
+    WorkspaceStore* target = store;
+    QMetaObject::invokeMethod(store, [this, target, search, query, limit, onMatches]() {
+        // Searches typed over while still queued behind writes are skipped
+        if (latestSearch.load() != search) {
+            return;
+        }
+        target->searchNewestMessages(query, limit, searchBatchSize, [this, search, onMatches](const std::vector<MessageMatch>& matches) {
+            if (latestSearch.load() != search) {
+                return false;
+            }
+            // Only the last batch is short
+            bool finished = static_cast<int>(matches.size()) < searchBatchSize;
+            QMetaObject::invokeMethod(this, [onMatches, matches, finished]() { onMatches(matches, finished); }, Qt::QueuedConnection);
+            return true;
+        });
+    }, Qt::QueuedConnection);
+}
+
+void PersistenceWorker::requestSave() {
+    saveRequested = true;
+    // Not restarted by later requests, so a steady stream of changes still saves every window
+    if (!coalesceTimer.isActive()) {
+        coalesceTimer.start();
+    }
+}
+
+void PersistenceWorker::flush() {
+    coalesceTimer.stop();
+    if (saveRequested) {
+        takeSnapshot();
+    }
+    runBlocking([this]() {
+        writePendingSnapshot();
+        store->checkpoint();
+    });
+}
+
+void PersistenceWorker::takeSnapshot() {
+    saveRequested = false;
+    std::unique_ptr<PendingSnapshot> snapshot(new PendingSnapshot);
+    snapshot->generation = ++generation;
+    snapshot->records = snapshotProvider();
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        pending = std::move(snapshot); // Replaces an older one the worker has not reached yet
+    }
+    QMetaObject::invokeMethod(store, [this]() { writePendingSnapshot(); }, Qt::QueuedConnection);
+}
+
+void PersistenceWorker::writePendingSnapshot() {
+    std::unique_ptr<PendingSnapshot> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        snapshot = std::move(pending);
+    }
+    if (!snapshot) {
+        return; // Already written with a newer snapshot
+    }
+
+    // Only the rows that changed since the last snapshot are written
+    bool ok = store->saveWorkspaces(snapshot->records);
+    if (!ok) {
+        qWarning() << "Workspace snapshot" << snapshot->generation << "was not saved";
+    }
+    emit saved(snapshot->generation, ok);
+}
+
+void PersistenceWorker::runBlocking(const std::function<void()>& task) {
+    if (thread.isRunning()) {
+        QMetaObject::invokeMethod(store, task, Qt::BlockingQueuedConnection);
+    } else {
+        task();
+    }
+}
@@ -0,0 +1,117 @@
+// shard_protocol.cpp
+#include "shard_protocol.h"
+#include <QDataStream>
+#include <QIODevice>
+#include <cstring>
+
+namespace ShardProtocol {
+
+namespace {
+
+void writeVector(QDataStream& stream, const std::vector<float>& vector) {
+    stream << QByteArray(reinterpret_cast<const char*>(vector.data()), static_cast<int>(vector.size() * sizeof(float)));
+}
+
+std::vector<float> readVector(QDataStream& stream) {
+    QByteArray bytes;
+    stream >> bytes;
+    std::vector<float> vector(bytes.size() / sizeof(float));
+    memcpy(vector.data(), bytes.constData(), vector.size() * sizeof(float));
+    return vector;
+}
+
+QByteArray frame(const QByteArray& payload) {
+    QByteArray message;
+    QDataStream stream(&message, QIODevice::WriteOnly);
+    stream << static_cast<quint32>(payload.size());
+    message.append(payload);
+    return message;
+}
+
+bool readLength(const QByteArray& buffer, quint32& length) {
+    if (buffer.size() < static_cast<int>(sizeof(quint32))) {
+        return false;
+    }
+    QDataStream header(buffer);
+    header >> length;
+    return true;
+}
+
+// Splits the next complete payload off the front of buffer
+bool takePayload(QByteArray& buffer, QByteArray& payload) {
+    quint32 length;
+    if (!readLength(buffer, length) || length > maxPayloadSize) {
+        return false;
+    }
+    int total = static_cast<int>(sizeof(quint32) + length);
+    if (buffer.size() < total) {
+        return false;
+    }
+    payload = buffer.mid(sizeof(quint32), length);
+    buffer.remove(0, total);
+    return true;
+}
+
+} // namespace
+
+QByteArray encode(const Request& request) {
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream << request.id << static_cast<quint8>(request.op) << request.label << request.k;
+    writeVector(stream, request.vector);
+    return frame(payload);
+}
+
+QByteArray encode(const Response& response) {
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    stream << response.id << static_cast<quint8>(response.status) << response.count;
+    stream << static_cast<quint32>(response.neighbors.size());
+    for (const auto& neighbor : response.neighbors) {
+        stream << neighbor.first << static_cast<quint64>(neighbor.second);
+    }
+    return frame(payload);
+}
+
+bool takeRequest(QByteArray& buffer, Request& request) {
+    QByteArray payload;
+    if (!takePayload(buffer, payload)) {
+        return false;
+    }
+    QDataStream stream(payload);
+    quint8 op;
+    stream >> request.id >> op >> request.label >> request.k;
+    request.op = static_cast<Op>(op);
+    request.vector = readVector(stream);
+    return true;
+}
+
+bool takeResponse(QByteArray& buffer, Response& response) {
+    QByteArray payload;
+    if (!takePayload(buffer, payload)) {
+        return false;
+    }
+    QDataStream stream(payload);
+    stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    quint8 status;
+    quint32 neighborCount;
+    stream >> response.id >> status >> response.count >> neighborCount;
+    response.status = static_cast<Status>(status);
+    response.neighbors.clear();
+    response.neighbors.reserve(neighborCount);
+    for (quint32 i = 0; i < neighborCount && !stream.atEnd(); ++i) {
+        float distance;
+        quint64 label;
+        stream >> distance >> label;
+        response.neighbors.emplace_back(distance, static_cast<hnswlib::labeltype>(label));
+    }
+    return true;
+}
+
+bool isMalformed(const QByteArray& buffer) {
+    quint32 length;
+    return readLength(buffer, length) && length > maxPayloadSize;
+}
+
+} // namespace ShardProtocol
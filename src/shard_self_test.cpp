@@ -0,0 +1,199 @@
+// shard_self_test.cpp
+#include "shard_self_test.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QLocalServer>
+#include <QProcess>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+#include <hnswlib/hnswlib.h>
+#include "sharded_index.h"
+
+namespace {
+constexpr size_t k = 10;
+constexpr int queryCount = 50;
+constexpr int searchTimeoutMs = 500;
+constexpr double minRecall = 0.9; // Workers search approximately
+
+struct Failures {
+    int count = 0;
+
+    void check(bool ok, const char* what) {
+        if (!ok) {
+            qCritical() << "Shard self-test failed:" << what;
+            count++;
+        }
+    }
+};
+
+std::vector<std::unique_ptr<QProcess>> startWorkers(const QStringList& serverNames, int dim) {
+    std::vector<std::unique_ptr<QProcess>> workers;
+    for (const QString& serverName : serverNames) {
+        workers.push_back(std::make_unique<QProcess>());
+        workers.back()->setProcessChannelMode(QProcess::ForwardedChannels);
+        workers.back()->start(QCoreApplication::applicationFilePath(),
+                              {"--shard-worker", serverName, "--dim", QString::number(dim), "--exit-with-client"});
+    }
+    return workers;
+}
+
+void stopWorkers(std::vector<std::unique_ptr<QProcess>>& workers) {
+    for (auto& worker : workers) {
+        if (!worker->waitForFinished(1000)) {
+            worker->kill();
+            worker->waitForFinished(1000);
+        }
+    }
+}
+
+// Fraction of the exact k nearest neighbors found
+double recall(const std::vector<std::pair<float, hnswlib::labeltype>>& found,
+              std::priority_queue<std::pair<float, hnswlib::labeltype>> exact) {
+    std::set<hnswlib::labeltype> expected;
+    size_t total = exact.size();
+    while (!exact.empty()) {
+        expected.insert(exact.top().second);
+        exact.pop();
+    }
+    size_t hits = 0;
+    for (const auto& neighbor : found) {
+        hits += expected.count(neighbor.second);
+    }
+    return total == 0 ? 1.0 : static_cast<double>(hits) / total;
+}
+} // namespace
+
+namespace ShardSelfTest {
+
+bool isRequested(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--shard-self-test") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int run(int argc, char* argv[]) {
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    QCommandLineOption selfTestOption("shard-self-test", "Check ShardedIndex against worker processes.");
+    QCommandLineOption shardsOption("shards", "Worker processes.", "n", "3");
+    QCommandLineOption dimOption("dim", "Embedding dimension.", "n", "32");
+    QCommandLineOption countOption("count", "Embeddings to insert.", "n", "3000");
+    parser.addOption(selfTestOption);
+    parser.addOption(shardsOption);
+    parser.addOption(dimOption);
+    parser.addOption(countOption);
+    parser.process(app);
+
+    const int shardCount = std::max(1, parser.value(shardsOption).toInt());
+    const int dim = std::max(1, parser.value(dimOption).toInt());
+    const int count = std::max(static_cast<int>(k), parser.value(countOption).toInt());
+
+    QStringList serverNames;
+    for (int i = 0; i < shardCount; ++i) {
+        serverNames << QString("airc-llm-self-test-%1-%2").arg(QCoreApplication::applicationPid()).arg(i);
+    }
+    std::vector<std::unique_ptr<QProcess>> workers = startWorkers(serverNames, dim);
+
+    // Accepts connections but never answers, standing in for a hung worker
+    QLocalServer silentServer;
+    QString silentName = QString("airc-llm-self-test-%1-silent").arg(QCoreApplication::applicationPid());
+    QLocalServer::removeServer(silentName);
+    silentServer.listen(silentName);
+
+    Failures failures;
+    {
+        ShardedIndex index(dim);
+        if (!index.connectToWorkers(serverNames, 5000)) {
+            qCritical() << "Shard self-test could not reach its workers";
+            stopWorkers(workers);
+            return 1;
+        }
+
+        hnswlib::L2Space space(dim);
+        hnswlib::BruteforceSearch<float> exact(&space, count);
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        auto randomVector = [&]() {
+            std::vector<float> vector(dim);
+            for (float& value : vector) {
+                value = uniform(rng);
+            }
+            return vector;
+        };
+
+        bool added = true;
+        for (int label = 0; label < count; ++label) {
+            std::vector<float> vector = randomVector();
+            added = index.addEmbedding(label, vector) && added;
+            exact.addPoint(vector.data(), label);
+        }
+        failures.check(added, "every embedding is stored");
+        failures.check(index.getEmbeddingCount() == static_cast<quint64>(count), "the shards hold every embedding");
+
+        // Every shard answers and the merged lists match an exact search
+        std::vector<std::vector<float>> queries;
+        double recallSum = 0;
+        bool allAnswered = true;
+        for (int i = 0; i < queryCount; ++i) {
+            queries.push_back(randomVector());
+            ShardedSearchResult result = index.search(queries.back(), k, searchTimeoutMs);
+            allAnswered = allAnswered && result.answeredShards == shardCount && result.failedShards == 0;
+            recallSum += recall(result.neighbors, exact.searchKnn(queries.back().data(), k));
+        }
+        failures.check(allAnswered, "every shard answers a search");
+        failures.check(recallSum / queryCount >= minRecall, "sharded search finds the exact neighbors");
+
+        // Removed embeddings are never returned
+        std::set<hnswlib::labeltype> removed;
+        bool removedAll = true;
+        for (int label = 0; label < count; label += 10) {
+            removedAll = index.removeEmbedding(label) && removedAll;
+            exact.removePoint(label);
+            removed.insert(label);
+        }
+        failures.check(removedAll, "every removal is acknowledged");
+        failures.check(index.getEmbeddingCount() == static_cast<quint64>(count) - removed.size(),
+                       "removals leave the count");
+        bool foundRemoved = false;
+        for (const auto& query : queries) {
+            for (const auto& neighbor : index.search(query, k, searchTimeoutMs).neighbors) {
+                foundRemoved = foundRemoved || removed.count(neighbor.second) > 0;
+            }
+        }
+        failures.check(!foundRemoved, "removed embeddings are not returned");
+
+        // A hung shard costs one deadline, not one per shard, and the others still answer
+        ShardedIndex withSilent(dim);
+        if (withSilent.connectToWorkers(serverNames + QStringList{silentName}, 5000)) {
+            QElapsedTimer timer;
+            timer.start();
+            ShardedSearchResult result = withSilent.search(queries.front(), k, searchTimeoutMs);
+            qint64 elapsed = timer.elapsed();
+            failures.check(result.answeredShards == shardCount && result.failedShards == 1,
+                           "a hung shard fails alone");
+            failures.check(result.neighbors == index.search(queries.front(), k, searchTimeoutMs).neighbors,
+                           "the other shards' results survive a hung shard");
+            failures.check(elapsed < 2 * searchTimeoutMs, "a hung shard holds the search up for one deadline");
+        } else {
+            failures.check(false, "connects to a hung shard");
+        }
+    }
+    // The workers quit once their clients are gone
+    stopWorkers(workers);
+
+    if (failures.count > 0) {
+        return 1;
+    }
+    qDebug() << "Shard self-test passed with" << shardCount << "workers and" << count << "embeddings";
+    return 0;
+}
+}
@@ -0,0 +1,123 @@
+// shard_worker.cpp
+#include "shard_worker.h"
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <cstring>
+
+ShardWorker::ShardWorker(const QString& serverName, int dim, int ef, QObject* parent)
+    : QObject(parent), serverName(serverName), dim(dim) {
+    space = std::make_unique<hnswlib::L2Space>(dim);
+    index = std::make_unique<hnswlib::HierarchicalNSW<float>>(space.get(), 100000, 16, 200, 100, true);
+    index->setEf(ef);
+    connect(&server, &QLocalServer::newConnection, this, &ShardWorker::onNewConnection);
+}
+
+bool ShardWorker::listen() {
+    QLocalServer::removeServer(serverName); // Left behind if a previous worker crashed
+    if (!server.listen(serverName)) {
+        qCritical() << "Shard worker could not listen on" << serverName << ":" << server.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool ShardWorker::isRequested(int argc, char* argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--shard-worker") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int ShardWorker::run(int argc, char* argv[]) {
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    QCommandLineOption workerOption("shard-worker", "Serve a vector index shard on a local socket.", "server name");
+    QCommandLineOption dimOption("dim", "Embedding dimension.", "n", "128");
+    QCommandLineOption efOption("ef", "Search ef.", "n", "64");
+    QCommandLineOption exitOption("exit-with-client", "Quit when the last client disconnects.");
+    parser.addOption(workerOption);
+    parser.addOption(dimOption);
+    parser.addOption(efOption);
+    parser.addOption(exitOption);
+    parser.process(app);
+
+    ShardWorker worker(parser.value(workerOption), parser.value(dimOption).toInt(), parser.value(efOption).toInt());
+    worker.exitWithClient = parser.isSet(exitOption);
+    if (!worker.listen()) {
+        return 1;
+    }
+    return app.exec();
+}
+
+void ShardWorker::onNewConnection() {
+    while (QLocalSocket* socket = server.nextPendingConnection()) {
+        buffers.insert(socket, QByteArray());
+        connect(socket, &QLocalSocket::readyRead, this, [this, socket]() { onReadyRead(socket); });
+        connect(socket, &QLocalSocket::disconnected, this, [this, socket]() {
+            buffers.remove(socket);
+            socket->deleteLater();
+            // Workers started by a ShardedIndex must not outlive it, even if it crashed
+            if (exitWithClient && buffers.isEmpty()) {
+                QCoreApplication::quit();
+            }
+        });
+    }
+}
+
+void ShardWorker::onReadyRead(QLocalSocket* socket) {
+    QByteArray& buffer = buffers[socket];
+    buffer.append(socket->readAll());
+
+    ShardProtocol::Request request;
+    while (ShardProtocol::takeRequest(buffer, request)) {
+        socket->write(ShardProtocol::encode(handle(request)));
+    }
+    if (ShardProtocol::isMalformed(buffer)) {
+        qWarning() << "Shard worker" << serverName << "dropped a client that sent an oversized message";
+        socket->abort(); // Removes the buffer as the socket disconnects
+    }
+}
+
+ShardProtocol::Response ShardWorker::handle(const ShardProtocol::Request& request) {
+    ShardProtocol::Response response;
+    response.id = request.id;
+
+    try {
+        switch (request.op) {
+        case ShardProtocol::Op::Add:
+            if (request.vector.size() != static_cast<size_t>(dim)) {
+                response.status = ShardProtocol::Status::Error;
+                break;
+            }
+            if (index->getCurrentElementCount() >= index->getMaxElements()) {
+                index->resizeIndex(index->getMaxElements() * 2);
+            }
+            index->addPoint(request.vector.data(), request.label, true);
+            break;
+        case ShardProtocol::Op::Remove:
+            index->markDelete(request.label);
+            break;
+        case ShardProtocol::Op::Search:
+            if (request.vector.size() != static_cast<size_t>(dim)) {
+                response.status = ShardProtocol::Status::Error;
+                break;
+            }
+            response.neighbors = index->searchKnnCloserFirst(request.vector.data(), request.k);
+            break;
+        case ShardProtocol::Op::Count:
+            response.count = index->getCurrentElementCount() - index->getDeletedCount();
+            break;
+        default:
+            response.status = ShardProtocol::Status::Error;
+            break;
+        }
+    } catch (const std::exception& e) {
+        qWarning() << "Shard worker" << serverName << "failed a request:" << e.what();
+        response.status = ShardProtocol::Status::Error;
+    }
+    return response;
+}
@@ -0,0 +1,278 @@
+// sharded_index.cpp
+#include "sharded_index.h"
+#include <QCoreApplication>
+#include <QDebug>
+#include <QThread>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <tuple>
+
+ShardedIndex::ShardedIndex(int dim) : dim(dim) {}
+
+ShardedIndex::~ShardedIndex() {
+    stopWorkers();
+}
+
+bool ShardedIndex::startWorkers(int shardCount, int timeoutMs) {
+    stopWorkers();
+    QElapsedTimer timer;
+    timer.start();
+
+    shards.resize(shardCount);
+    for (int i = 0; i < shardCount; ++i) {
+        Shard& shard = shards[i];
+        shard.serverName = QString("airc-llm-shard-%1-%2").arg(QCoreApplication::applicationPid()).arg(i);
+        shard.process = std::make_unique<QProcess>();
+        shard.process->setProcessChannelMode(QProcess::ForwardedChannels);
+        shard.process->start(QCoreApplication::applicationFilePath(),
+                             {"--shard-worker", shard.serverName, "--dim", QString::number(dim), "--exit-with-client"});
+    }
+
+    for (Shard& shard : shards) {
+        if (!connectShard(shard, timer, timeoutMs)) {
+            qWarning() << "Could not reach shard worker" << shard.serverName;
+            stopWorkers();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ShardedIndex::connectToWorkers(const QStringList& serverNames, int timeoutMs) {
+    stopWorkers();
+    QElapsedTimer timer;
+    timer.start();
+
+    shards.resize(serverNames.size());
+    for (int i = 0; i < serverNames.size(); ++i) {
+        shards[i].serverName = serverNames[i];
+        if (!connectShard(shards[i], timer, timeoutMs)) {
+            qWarning() << "Could not reach shard worker" << serverNames[i];
+            shards.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+int ShardedIndex::getShardCount() const {
+    return static_cast<int>(shards.size());
+}
+
+bool ShardedIndex::addEmbedding(hnswlib::labeltype label, const std::vector<float>& embedding, int timeoutMs) {
+    if (shards.empty()) {
+        return false;
+    }
+    QElapsedTimer timer;
+    timer.start();
+
+    ShardProtocol::Request request;
+    request.op = ShardProtocol::Op::Add;
+    request.label = label;
+    request.vector = embedding;
+    Shard& shard = shards[shardFor(label)];
+    ShardProtocol::Response response;
+    return receive(shard, send(shard, request), timer, timeoutMs, response) && response.status == ShardProtocol::Status::Ok;
+}
+
+bool ShardedIndex::removeEmbedding(hnswlib::labeltype label, int timeoutMs) {
+    if (shards.empty()) {
+        return false;
+    }
+    QElapsedTimer timer;
+    timer.start();
+
+    ShardProtocol::Request request;
+    request.op = ShardProtocol::Op::Remove;
+    request.label = label;
+    Shard& shard = shards[shardFor(label)];
+    ShardProtocol::Response response;
+    return receive(shard, send(shard, request), timer, timeoutMs, response) && response.status == ShardProtocol::Status::Ok;
+}
+
+ShardedSearchResult ShardedIndex::search(const std::vector<float>& queryEmbedding, size_t k, int timeoutMs) {
+    ShardedSearchResult result;
+
+    // Scatter first so every worker searches while the replies are gathered
+    ShardProtocol::Request request;
+    request.op = ShardProtocol::Op::Search;
+    request.k = static_cast<quint32>(k);
+    request.vector = queryEmbedding;
+    std::vector<ShardProtocol::Response> responses;
+    std::vector<bool> answered = scatterGather(request, timeoutMs, responses);
+    for (size_t i = 0; i < shards.size(); ++i) {
+        answered[i] = answered[i] && responses[i].status == ShardProtocol::Status::Ok;
+        if (answered[i]) {
+            result.answeredShards++;
+        } else {
+            result.failedShards++;
+        }
+    }
+
+    // k-way merge of the per-shard lists, which are already sorted closest first
+    using Head = std::tuple<float, size_t, size_t>; // Distance, shard, position in its list
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (answered[i] && !responses[i].neighbors.empty()) {
+            heads.emplace(responses[i].neighbors[0].first, i, 0);
+        }
+    }
+    while (!heads.empty() && result.neighbors.size() < k) {
+        float distance;
+        size_t shard;
+        size_t position;
+        std::tie(distance, shard, position) = heads.top();
+        heads.pop();
+        result.neighbors.emplace_back(distance, responses[shard].neighbors[position].second);
+        if (position + 1 < responses[shard].neighbors.size()) {
+            heads.emplace(responses[shard].neighbors[position + 1].first, shard, position + 1);
+        }
+    }
+    return result;
+}
+
+quint64 ShardedIndex::getEmbeddingCount(int timeoutMs) {
+    ShardProtocol::Request request;
+    request.op = ShardProtocol::Op::Count;
+    std::vector<ShardProtocol::Response> responses;
+    std::vector<bool> answered = scatterGather(request, timeoutMs, responses);
+
+    quint64 total = 0;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (answered[i] && responses[i].status == ShardProtocol::Status::Ok) {
+            total += responses[i].count;
+        }
+    }
+    return total;
+}
+
+bool ShardedIndex::connectShard(Shard& shard, const QElapsedTimer& timer, int timeoutMs) {
+    shard.socket = std::make_unique<QLocalSocket>();
+    // A freshly started worker needs a moment before it listens
+    while (true) {
+        shard.socket->connectToServer(shard.serverName);
+        int remaining = timeoutMs - static_cast<int>(timer.elapsed());
+        if (shard.socket->waitForConnected(std::max(0, remaining))) {
+            return true;
+        }
+        if (timer.elapsed() >= timeoutMs) {
+            return false;
+        }
+        shard.socket->abort();
+        QThread::msleep(20);
+    }
+}
+
+size_t ShardedIndex::shardFor(hnswlib::labeltype label) const {
+    return static_cast<size_t>(label % shards.size());
+}
+
+quint32 ShardedIndex::send(Shard& shard, ShardProtocol::Request& request) {
+    request.id = nextRequestId++;
+    if (shard.socket && shard.socket->state() == QLocalSocket::ConnectedState) {
+        shard.socket->write(ShardProtocol::encode(request));
+        shard.socket->flush();
+    }
+    return request.id;
+}
+
+std::vector<bool> ShardedIndex::scatterGather(ShardProtocol::Request& request, int timeoutMs,
+                                              std::vector<ShardProtocol::Response>& responses) {
+    QElapsedTimer clock;
+    clock.start();
+
+    // Each shard's deadline runs from its own send, and a reply is taken whenever it is there,
+    // so a slow shard costs the others nothing
+    std::vector<quint32> requestIds(shards.size());
+    std::vector<qint64> deadlines(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        requestIds[i] = send(shards[i], request);
+        deadlines[i] = clock.elapsed() + timeoutMs;
+    }
+
+    responses.assign(shards.size(), ShardProtocol::Response());
+    std::vector<bool> answered(shards.size(), false);
+    std::vector<size_t> waiting(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        waiting[i] = i;
+    }
+    while (!waiting.empty()) {
+        size_t before = waiting.size();
+        for (size_t w = 0; w < waiting.size();) {
+            size_t i = waiting[w];
+            Poll state = poll(shards[i], requestIds[i], responses[i]);
+            if (state == Poll::Pending && clock.elapsed() >= deadlines[i]) {
+                state = Poll::Failed;
+            }
+            if (state == Poll::Pending) {
+                ++w;
+                continue;
+            }
+            answered[i] = state == Poll::Received;
+            waiting.erase(waiting.begin() + w);
+        }
+        if (!waiting.empty() && waiting.size() == before) {
+            // Nothing arrived this round; block briefly on the shard that is due first
+            size_t next = *std::min_element(waiting.begin(), waiting.end(), [&deadlines](size_t a, size_t b) {
+                return deadlines[a] < deadlines[b];
+            });
+            qint64 remaining = deadlines[next] - clock.elapsed();
+            shards[next].socket->waitForReadyRead(static_cast<int>(std::max<qint64>(0, std::min<qint64>(remaining, pollIntervalMs))));
+        }
+    }
+    return answered;
+}
+
+ShardedIndex::Poll ShardedIndex::poll(Shard& shard, quint32 requestId, ShardProtocol::Response& response) {
+    if (!shard.socket) {
+        return Poll::Failed;
+    }
+    if (shard.socket->state() == QLocalSocket::ConnectedState && shard.socket->bytesAvailable() == 0) {
+        shard.socket->waitForReadyRead(0); // Picks up whatever the worker has written so far
+    }
+    shard.buffer.append(shard.socket->readAll());
+    // Replies to requests that timed out earlier are still in the stream; skip them
+    while (ShardProtocol::takeResponse(shard.buffer, response)) {
+        if (response.id == requestId) {
+            return Poll::Received;
+        }
+    }
+    if (ShardProtocol::isMalformed(shard.buffer)) {
+        qWarning() << "Dropped shard worker" << shard.serverName << "after an oversized reply";
+        shard.socket->abort();
+        shard.buffer.clear();
+        return Poll::Failed;
+    }
+    return shard.socket->state() == QLocalSocket::ConnectedState ? Poll::Pending : Poll::Failed;
+}
+
+bool ShardedIndex::receive(Shard& shard, quint32 requestId, const QElapsedTimer& timer, int timeoutMs,
+                           ShardProtocol::Response& response) {
+    while (true) {
+        Poll state = poll(shard, requestId, response);
+        if (state != Poll::Pending) {
+            return state == Poll::Received;
+        }
+        int remaining = timeoutMs - static_cast<int>(timer.elapsed());
+        if (remaining <= 0 || !shard.socket->waitForReadyRead(remaining)) {
+            return false;
+        }
+    }
+}
+
+void ShardedIndex::stopWorkers() {
+    for (Shard& shard : shards) {
+        if (shard.socket) {
+            shard.socket->abort();
+        }
+        if (shard.process) {
+            shard.process->terminate();
+            if (!shard.process->waitForFinished(1000)) {
+                shard.process->kill();
+                shard.process->waitForFinished(1000);
+            }
+        }
+    }
+    shards.clear();
+}
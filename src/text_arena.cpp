@@ -0,0 +1,115 @@
+// text_arena.cpp
+#include "text_arena.h"
+#include <QDebug>
+
+void TextArena::append(hnswlib::labeltype label, const QString& text) {
+    if (!spans.empty() && label < labelBase + spans.size()) {
+        qWarning() << "TextArena labels must be appended in increasing order, ignoring label" << label;
+        return;
+    }
+    if (spans.empty()) {
+        labelBase = label;
+    }
+    // Fill any gap in the label sequence with dead spans
+    while (labelBase + spans.size() < label) {
+        spans.push_back({arena.size(), 0, false});
+    }
+
+    QByteArray utf8 = text.toUtf8();
+    spans.push_back({arena.size(), static_cast<unsigned int>(utf8.size()), true});
+    arena.append(utf8.constData(), utf8.size());
+    liveCount++;
+}
+
+bool TextArena::remove(hnswlib::labeltype label) {
+    if (label < labelBase || label >= labelBase + spans.size()) {
+        return false;
+    }
+    Span& span = spans[label - labelBase];
+    if (!span.live) {
+        return false;
+    }
+    span.live = false;
+    garbageBytes += span.length;
+    liveCount--;
+    compactIfNeeded();
+    return true;
+}
+
+bool TextArena::contains(hnswlib::labeltype label) const {
+    return findSpan(label) != nullptr;
+}
+
+QString TextArena::get(hnswlib::labeltype label) const {
+    const Span* span = findSpan(label);
+    if (!span) {
+        return QString();
+    }
+    return QString::fromUtf8(arena.data() + span->offset, span->length);
+}
+
+std::vector<hnswlib::labeltype> TextArena::labels() const {
+    std::vector<hnswlib::labeltype> result;
+    result.reserve(liveCount);
+    for (size_t i = 0; i < spans.size(); ++i) {
+        if (spans[i].live) {
+            result.push_back(labelBase + i);
+        }
+    }
+    return result;
+}
+
+size_t TextArena::size() const {
+    return liveCount;
+}
+
+size_t TextArena::byteSize() const {
+    return arena.size();
+}
+
+void TextArena::clear() {
+    std::string().swap(arena);
+    spans.clear();
+    liveCount = 0;
+    garbageBytes = 0;
+}
+
+const TextArena::Span* TextArena::findSpan(hnswlib::labeltype label) const {
+    if (label < labelBase || label >= labelBase + spans.size()) {
+        return nullptr;
+    }
+    const Span& span = spans[label - labelBase];
+    return span.live ? &span : nullptr;
+}
+
+void TextArena::compactIfNeeded() {
+    // Dead spans at the front (pruned oldest entries) can be dropped from the table
+    while (!spans.empty() && !spans.front().live) {
+        spans.pop_front();
+        labelBase++;
+    }
+    if (spans.empty()) {
+        clear();
+        return;
+    }
+
+    // Rewrite the buffer once more than half of it is garbage
+    static const size_t minGarbageBytes = 1 << 20;
+    if (garbageBytes < minGarbageBytes || garbageBytes * 2 < arena.size()) {
+        return;
+    }
+    std::string compacted;
+    compacted.reserve(arena.size() - garbageBytes);
+    for (Span& span : spans) {
+        if (span.live) {
+            size_t offset = compacted.size();
+            compacted.append(arena, span.offset, span.length);
+            span.offset = offset;
+        } else {
+            span.offset = compacted.size();
+            span.length = 0;
+        }
+    }
+    arena.swap(compacted);
+    garbageBytes = 0;
+}
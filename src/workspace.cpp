@@ -4,12 +4,102 @@
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QDateTime>
 #include <QDebug>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+#include <thread>
 
 Workspace::Workspace(const QString& name, int id, LlmAgentInterface* agent, const QString& apiType)
-    : name(name), model(""), id(id), agent(agent), apiType(apiType) {
-    auto space = std::make_unique<hnswlib::L2Space>(embeddingDim);
-    index = std::make_unique<hnswlib::HierarchicalNSW<float>>(space.get(), 100000);
+    : Workspace(name, id, agent, apiType, defaultIndexCapacity) {
+}
+
+Workspace::Workspace(const QString& name, int id, LlmAgentInterface* agent, const QString& apiType, size_t indexCapacity)
+    : name(name), model(""), id(id), agent(agent), apiType(apiType), lastActive(QDateTime::currentMSecsSinceEpoch()),
+      searchThreads(std::max(1u, std::thread::hardware_concurrency())) {
+    space = std::make_unique<hnswlib::L2Space>(embeddingDim);
+    // Deleted slots are reused by later inserts
+    index = std::make_unique<hnswlib::HierarchicalNSW<float>>(space.get(), indexCapacity, 16, efConstruction, 100, true);
+}
+
+Workspace::InheritedEntryFilter::InheritedEntryFilter(hnswlib::labeltype limit, const std::unordered_set<hnswlib::labeltype>& hidden,
+                                                      hnswlib::BaseFilterFunctor* outer)
+    : limit(limit), hidden(hidden), outer(outer) {
+}
+
+bool Workspace::InheritedEntryFilter::operator()(hnswlib::labeltype label) {
+    return label < limit && hidden.count(label) == 0 && (outer == nullptr || (*outer)(label));
+}
+
+Workspace Workspace::fork(const QString& name, int id, LlmAgentInterface* agent, qint64 position) {
+    position = std::max<qint64>(0, std::min(position, getHistorySize()));
+    Workspace branch(name, id, agent, apiType, branchIndexCapacity);
+    branch.model = model;
+    branch.parentId = this->id;
+    branch.forkPosition = position;
+    branch.useEmbedding = useEmbedding;
+    branch.enableStreaming = enableStreaming;
+    branch.compactionThreshold = compactionThreshold;
+    branch.exactSearchThreshold = exactSearchThreshold;
+    branch.adaptivePatience = adaptivePatience;
+    branch.targetRecall = targetRecall;
+    branch.recallK = recallK;
+    branch.efConstruction = efConstruction;
+    branch.searchEf = searchEf;
+    if (searchEf != 0) {
+        branch.index->setEf(searchEf);
+    }
+
+    agent->setSettings(this->agent->getSettings());
+    // The server continues from the reply the branch starts after, without re-reading the prefix
+    auto context = replyContexts.find(position - 1);
+    if (context != replyContexts.end()) {
+        agent->setContext(context->second);
+        branch.replyContexts[context->first] = context->second;
+    }
+
+    // The loaded messages are shared until either side appends; a branch from an earlier
+    // message pages its history in from the parent's rows in the store instead
+    if (position == getHistorySize()) {
+        branch.chatHistory = chatHistory;
+        branch.historyStart = historyStart;
+    } else {
+        branch.historyStart = position;
+    }
+
+    // Labels are never reused, so the branch numbers its own entries after the shared ones
+    freezeEntries();
+    branch.base = base;
+    branch.baseLabelLimit = baseLabelLimit;
+    branch.hiddenBaseLabels = hiddenBaseLabels; // Copied by whichever side hides an entry first
+    branch.baseDepth = baseDepth;
+    branch.baseEntryCount = baseEntryCount;
+    branch.nextLabel = nextLabel;
+    return branch;
+}
+
+void Workspace::detachFrom(const Workspace& parent) {
+    if (parentId != parent.id) {
+        return;
+    }
+    // The store copies the parent's own messages up to the fork point into this workspace
+    parentId = parent.parentId;
+    forkPosition = std::min(forkPosition, parent.forkPosition);
+}
+
+void Workspace::setForkOrigin(int parentId, qint64 forkPosition) {
+    this->parentId = parentId;
+    this->forkPosition = forkPosition;
+}
+
+int Workspace::getParentId() const {
+    return parentId;
+}
+
+qint64 Workspace::getForkPosition() const {
+    return forkPosition;
 }
 
 QString Workspace::getName() const {
@@ -42,26 +132,103 @@ void Workspace::setApiType(const QString& apiType) {
 
 void Workspace::addChatMessage(const QString& message) {
     chatHistory.append(message);
+    // Only replies are kept in the history, so the agent's context now ends with this one
+    QJsonArray context = agent->getContext();
+    if (!context.isEmpty()) {
+        replyContexts[getHistorySize() - 1] = context;
+        if (replyContexts.size() > keptReplyContexts) {
+            replyContexts.erase(replyContexts.begin());
+        }
+    }
 }
 
 QVector<QString> Workspace::getChatHistory() const {
     return chatHistory;
 }
 
-QJsonObject Workspace::toJson() const {
+void Workspace::setStoredHistorySize(qint64 size) {
+    chatHistory.clear();
+    historyStart = size;
+}
+
+void Workspace::prependChatHistory(const QVector<QString>& olderMessages, bool reachedOldest) {
+    QVector<QString> merged;
+    merged.reserve(olderMessages.size() + chatHistory.size());
+    merged += olderMessages;
+    merged += chatHistory;
+    chatHistory = std::move(merged);
+    historyStart = reachedOldest ? 0 : std::max<qint64>(0, historyStart - olderMessages.size());
+}
+
+qint64 Workspace::getHistorySize() const {
+    return historyStart + chatHistory.size();
+}
+
+qint64 Workspace::getLoadedHistoryStart() const {
+    return historyStart;
+}
+
+bool Workspace::hasUnloadedHistory() const {
+    return historyStart > 0;
+}
+
+void Workspace::unloadChatHistory() {
+    setStoredHistorySize(getHistorySize());
+}
+
+void Workspace::markActive() {
+    lastActive = QDateTime::currentMSecsSinceEpoch();
+}
+
+qint64 Workspace::getLastActive() const {
+    return lastActive;
+}
+
+void Workspace::markArchived() {
+    archivedAt = QDateTime::currentMSecsSinceEpoch();
+}
+
+qint64 Workspace::getArchivedAt() const {
+    return archivedAt;
+}
+
+bool Workspace::hasReplyContext(qint64 position) const {
+    return position == 0 || replyContexts.count(position - 1) != 0;
+}
+
+QJsonObject Workspace::toJson(bool includeChatHistory) const {
     QJsonObject json;
     json["name"] = name;
     json["model"] = model;
     json["id"] = id;
     json["apiType"] = apiType;
 
-    QJsonArray chatArray;
-    for (const auto& message : chatHistory) {
-        chatArray.append(message);
+    // WorkspaceStore keeps the history one row per message instead
+    if (includeChatHistory) {
+        QJsonArray chatArray;
+        for (const auto& message : chatHistory) {
+            chatArray.append(message);
+        }
+        json["chatHistory"] = chatArray;
     }
-    json["chatHistory"] = chatArray;
+
+    json["searchEf"] = static_cast<int>(searchEf);
+    json["efConstruction"] = static_cast<int>(efConstruction);
+    json["tunedElementCount"] = static_cast<int>(tunedElementCount);
+    json["indexType"] = indexType == IndexType::IvfPq ? "ivfpq" : indexType == IndexType::DiskVamana ? "diskvamana" : "hnsw";
+    json["lastActive"] = static_cast<double>(lastActive);
+    json["archivedAt"] = static_cast<double>(archivedAt);
 
     json["agentSettings"] = agent->getSettings();
+    // Kept so forks from these replies still resume the server-side context after a restart
+    QJsonArray contexts;
+    for (const auto& context : replyContexts) {
+        QJsonObject entry;
+        entry["position"] = static_cast<double>(context.first);
+        entry["context"] = context.second;
+        contexts.append(entry);
+    }
+    json["replyContexts"] = contexts;
 
     return json;
 }
@@ -79,7 +246,35 @@ Workspace Workspace::fromJson(const QJsonObject& json, LlmAgentInterface* agent)
         workspace.addChatMessage(message.toString());
     }
 
+    // Tuned values from the last session; re-tuned once the index doubles again
+    workspace.searchEf = static_cast<size_t>(json["searchEf"].toInt());
+    workspace.efConstruction = static_cast<size_t>(json["efConstruction"].toInt());
+    workspace.tunedElementCount = static_cast<size_t>(json["tunedElementCount"].toInt());
+    if (workspace.efConstruction == 0) {
+        workspace.efConstruction = 200;
+    }
+    if (workspace.searchEf != 0) {
+        workspace.index->setEf(workspace.searchEf);
+    }
+    if (json["indexType"].toString() == "ivfpq") {
+        workspace.setIndexType(IndexType::IvfPq);
+    } else if (json["indexType"].toString() == "diskvamana") {
+        workspace.setIndexType(IndexType::DiskVamana);
+    }
+    // Workspaces saved before activity was tracked count as active now
+    if (json.contains("lastActive")) {
+        workspace.lastActive = static_cast<qint64>(json["lastActive"].toDouble());
+    }
+    workspace.archivedAt = static_cast<qint64>(json["archivedAt"].toDouble());
+
     agent->setSettings(json["agentSettings"].toObject());
+    for (const auto& value : json["replyContexts"].toArray()) {
+        QJsonObject entry = value.toObject();
+        workspace.replyContexts[static_cast<qint64>(entry["position"].toDouble())] = entry["context"].toArray();
+    }
+    if (!workspace.replyContexts.empty()) {
+        agent->setContext(workspace.replyContexts.rbegin()->second); // The next reply continues the last one
+    }
 
     return workspace;
 }
@@ -88,29 +283,514 @@ LlmAgentInterface* Workspace::getAgent() const {
     return agent;
 }
 
-void Workspace::addEmbedding(const std::vector<float>& embedding, const QString& text) {
-    embeddings.push_back(embedding);
-    texts.push_back(text);
-    index->addPoint(embedding.data(), texts.size() - 1);
+hnswlib::labeltype Workspace::addEmbedding(const std::vector<float>& embedding, const QString& text) {
+    hnswlib::labeltype label = nextLabel++;
+    texts.append(label, text);
+    lexicalIndex.add(label, text);
+    if (indexType == IndexType::IvfPq) {
+        archiveIndex->addPoint(embedding.data(), label);
+        return label;
+    }
+
+    ensureIndexCapacity(*index);
+    // Takes over the slot of a deleted entry if there is one
+    index->addPoint(embedding.data(), label, true);
+    scheduleTuning();
+    return label;
+}
+
+bool Workspace::removeEmbedding(hnswlib::labeltype label) {
+    if (isInherited(label)) {
+        // The frozen index is shared, so the entry is only hidden from this workspace
+        if (!hasEntry(label)) {
+            return false;
+        }
+        if (hiddenBaseLabels.use_count() > 1) {
+            hiddenBaseLabels = std::make_shared<std::unordered_set<hnswlib::labeltype>>(*hiddenBaseLabels);
+        }
+        hiddenBaseLabels->insert(label);
+        baseEntryCount--;
+        return true;
+    }
+    QString text = texts.get(label);
+    if (!texts.remove(label)) {
+        return false;
+    }
+    lexicalIndex.remove(label, text);
+    if (indexType == IndexType::IvfPq) {
+        archiveIndex->removePoint(label);
+        return true;
+    }
+    if (diskIndex && diskIndex->contains(label)) {
+        diskIndex->markDelete(label); // The next save unlinks it and keeps the mark in the file
+        return true;
+    }
+    index->markDelete(label);
+    deletionsSinceCompaction++;
+    scheduleCompaction();
+    return true;
+}
+
+size_t Workspace::pruneEmbeddings(size_t keepNewest) {
+    if (getEmbeddingCount() <= keepNewest) {
+        return 0;
+    }
+    detachBase(); // The oldest entries may be inherited ones
+
+    // Labels grow monotonically, so the first ones are the oldest entries
+    std::vector<hnswlib::labeltype> labels = texts.labels();
+    size_t removeCount = labels.size() - keepNewest;
+    size_t graphDeletions = 0;
+    for (size_t i = 0; i < removeCount; ++i) {
+        if (indexType == IndexType::IvfPq) {
+            archiveIndex->removePoint(labels[i]);
+        } else if (diskIndex && diskIndex->contains(labels[i])) {
+            diskIndex->markDelete(labels[i]);
+        } else {
+            index->markDelete(labels[i]);
+            graphDeletions++;
+        }
+        lexicalIndex.remove(labels[i], texts.get(labels[i]));
+        texts.remove(labels[i]);
+    }
+    if (graphDeletions == 0) {
+        return removeCount;
+    }
+    deletionsSinceCompaction += graphDeletions;
+    scheduleCompaction();
+    return removeCount;
+}
+
+void Workspace::clearEmbeddings() {
+    waitForBackgroundTasks();
+    texts.clear();
+    lexicalIndex.clear();
+    base = nullptr;
+    hiddenBaseLabels = std::make_shared<std::unordered_set<hnswlib::labeltype>>();
+    baseDepth = 0;
+    baseEntryCount = 0;
+    deletionsSinceCompaction = 0;
+    tunedElementCount = 0;
+    resetIndex();
+    if (indexType == IndexType::IvfPq) {
+        archiveIndex = std::make_unique<hnswlib::IvfPqIndex>(space.get(), archiveLists);
+        archiveIndex->setSearchThreads(searchThreads);
+    }
+    diskIndex.reset();
+}
+
+size_t Workspace::getEmbeddingCount() const {
+    return texts.size() + baseEntryCount;
+}
+
+const float* Workspace::getStoredEmbedding(hnswlib::labeltype label) const {
+    if (isInherited(label)) {
+        return hiddenBaseLabels->count(label) == 0 ? base->getStoredEmbedding(label) : nullptr;
+    }
+    if (indexType == IndexType::IvfPq) {
+        return nullptr; // Only codes are kept
+    }
+    return reinterpret_cast<const float*>(index->getDataPointerByLabel(label));
+}
+
+QString Workspace::getText(hnswlib::labeltype label) const {
+    if (isInherited(label)) {
+        return hiddenBaseLabels->count(label) == 0 ? base->getText(label) : QString();
+    }
+    return texts.get(label);
+}
+
+void Workspace::setIndexType(IndexType type) {
+    if (type == indexType) {
+        return;
+    }
+    detachBase(); // Only this branch's copy is converted
+    waitForBackgroundTasks();
+
+    // Every entry moves into the graph first, then out of it for IvfPq
+    std::vector<hnswlib::labeltype> labels = texts.labels();
+    std::vector<float> vector(embeddingDim);
+    if (indexType == IndexType::IvfPq) {
+        // The graph is rebuilt from decoded vectors, so it keeps the quantization error
+        resetIndex();
+        ensureIndexCapacity(*index, labels.size());
+        for (hnswlib::labeltype label : labels) {
+            if (archiveIndex->reconstruct(label, vector.data())) {
+                index->addPoint(vector.data(), label, true);
+            }
+        }
+        archiveIndex.reset();
+        tunedElementCount = 0;
+    } else if (diskIndex) {
+        // The graph already holds the entries added since the last save
+        ensureIndexCapacity(*index, diskIndex->getCurrentElementCount());
+        for (hnswlib::labeltype label : labels) {
+            if (diskIndex->readVector(label, vector.data())) {
+                index->addPoint(vector.data(), label, true);
+            }
+        }
+        diskIndex.reset();
+        tunedElementCount = 0;
+    }
+    if (type == IndexType::IvfPq) {
+        // Entries stay uncompressed until there are enough to train the quantizers on
+        archiveIndex = std::make_unique<hnswlib::IvfPqIndex>(space.get(), archiveLists);
+        archiveIndex->setSearchThreads(searchThreads);
+        for (hnswlib::labeltype label : labels) {
+            const char* stored = index->getDataPointerByLabel(label);
+            if (stored != nullptr) {
+                archiveIndex->addPoint(stored, label);
+            }
+        }
+        resetIndex();
+    }
+    deletionsSinceCompaction = 0;
+    indexType = type;
+}
+
+Workspace::IndexType Workspace::getIndexType() const {
+    return indexType;
+}
+
+void Workspace::setCompactionThreshold(double threshold) {
+    compactionThreshold = threshold;
+}
+
+void Workspace::setTargetRecall(double recall, size_t k) {
+    targetRecall = recall;
+    recallK = k;
+    tunedElementCount = 0; // Re-tune on the next insert
+}
+
+size_t Workspace::getSearchEf() const {
+    return searchEf;
+}
+
+void Workspace::setExactSearchThreshold(size_t threshold) {
+    exactSearchThreshold = threshold;
+}
+
+void Workspace::setAdaptiveSearch(size_t patience) {
+    adaptivePatience = patience;
+    tunedElementCount = 0; // The ef was tuned for the other search, re-tune on the next insert
+}
+
+bool Workspace::useExactSearch() const {
+    // The graph is always maintained, so switching either way needs no rebuild
+    return texts.size() < exactSearchThreshold;
 }
 
 QString Workspace::getNearestText(const std::vector<float>& queryEmbedding) {
-    std::priority_queue<std::pair<float, hnswlib::labeltype>> result = index->searchKnn(queryEmbedding.data(), 1);
+    applyTuningResult();
+    std::vector<std::pair<float, hnswlib::labeltype>> result = searchNearest(queryEmbedding, 1, searchThreads);
     if (!result.empty()) {
-        hnswlib::labeltype label = result.top().second;
-        return texts[label];
+        return getText(result.front().second);
     }
     return "";
 }
 
+std::vector<std::pair<float, hnswlib::labeltype>> Workspace::searchNearest(const std::vector<float>& queryEmbedding, size_t k,
+                                                                           size_t numThreads) const {
+    if (k == 0 || queryEmbedding.size() != static_cast<size_t>(embeddingDim)) {
+        return std::vector<std::pair<float, hnswlib::labeltype>>();
+    }
+    return searchFiltered(queryEmbedding, k, numThreads, nullptr);
+}
+
+std::vector<std::pair<float, hnswlib::labeltype>> Workspace::searchFiltered(const std::vector<float>& queryEmbedding, size_t k,
+                                                                            size_t numThreads, hnswlib::BaseFilterFunctor* filter) const {
+    std::vector<std::pair<float, hnswlib::labeltype>> result;
+    if (indexType != IndexType::IvfPq && !useExactSearch() && adaptivePatience != 0) {
+        // Explores up to the tuned ef, but easy queries stop as soon as the best matches settle
+        hnswlib::AdaptiveSearchStopCondition<float> stopCondition(k, std::max(index->ef_, k), adaptivePatience);
+        result = index->searchStopConditionClosest(queryEmbedding.data(), stopCondition, filter);
+    } else {
+        std::priority_queue<std::pair<float, hnswlib::labeltype>> nearest = indexType == IndexType::IvfPq
+            ? archiveIndex->searchKnn(queryEmbedding.data(), k, filter)
+            : useExactSearch() ? index->searchKnnExact(queryEmbedding.data(), k, numThreads, filter)
+                               : index->searchKnn(queryEmbedding.data(), k, filter);
+        result.resize(nearest.size());
+        for (size_t i = result.size(); i > 0; --i) {
+            result[i - 1] = nearest.top();
+            nearest.pop();
+        }
+    }
+    if (diskIndex) {
+        // Entries written by the last save are only in the disk graph
+        std::priority_queue<std::pair<float, hnswlib::labeltype>> written = diskIndex->searchKnn(queryEmbedding.data(), k, filter);
+        size_t graphCount = result.size();
+        result.resize(graphCount + written.size());
+        for (size_t i = result.size(); i > graphCount; --i) {
+            result[i - 1] = written.top();
+            written.pop();
+        }
+        std::inplace_merge(result.begin(), result.begin() + graphCount, result.end());
+        if (result.size() > k) {
+            result.resize(k);
+        }
+    }
+    if (!base) {
+        return result;
+    }
+
+    // Inherited entries are found in the parent's index, which also holds entries this branch must not see
+    InheritedEntryFilter inherited(baseLabelLimit, *hiddenBaseLabels, filter);
+    std::vector<std::pair<float, hnswlib::labeltype>> shared = base->searchFiltered(queryEmbedding, k, numThreads, &inherited);
+    size_t ownCount = result.size();
+    result.insert(result.end(), shared.begin(), shared.end());
+    std::inplace_merge(result.begin(), result.begin() + ownCount, result.end());
+    if (result.size() > k) {
+        result.resize(k);
+    }
+    return result;
+}
+
+size_t Workspace::searchRange(const std::vector<float>& queryEmbedding, float maxDistance, size_t maxCount,
+                              size_t tokenBudget, const RangeResultCallback& onResult) {
+    // maxDistance uses the index metric (squared L2); a tokenBudget of 0 means unlimited
+    applyTuningResult();
+    if (maxCount == 0 || queryEmbedding.size() != static_cast<size_t>(embeddingDim)) {
+        return 0;
+    }
+
+    std::vector<std::pair<float, hnswlib::labeltype>> entries;
+    // A branch's radius cannot be walked in one graph, so it is cut from its nearest entries
+    if (indexType == IndexType::IvfPq || useExactSearch() || base || diskIndex) {
+        entries = searchNearest(queryEmbedding, maxCount, searchThreads);
+        while (!entries.empty() && entries.back().first > maxDistance) {
+            entries.pop_back();
+        }
+    } else {
+        // Explore at least a small neighborhood before giving up on the radius, so a query
+        // whose entry point lands just outside it still finds the entries inside
+        size_t minCandidates = std::min<size_t>(maxCount, 32);
+        hnswlib::EpsilonSearchStopCondition<float> stopCondition(maxDistance, minCandidates, maxCount);
+        entries = index->searchStopConditionClosest(queryEmbedding.data(), stopCondition);
+    }
+
+    size_t delivered = 0;
+    size_t tokensUsed = 0;
+    for (const auto& entry : entries) {
+        QString text = getText(entry.second);
+        size_t tokens = estimateTokens(text);
+        if (tokenBudget != 0 && tokensUsed + tokens > tokenBudget) {
+            continue; // Too big for what is left, a later shorter entry may still fit
+        }
+        tokensUsed += tokens;
+        delivered++;
+        if (!onResult(entry.second, entry.first, text)) {
+            break;
+        }
+    }
+    return delivered;
+}
+
+size_t Workspace::estimateTokens(const QString& text) {
+    // Roughly four characters per token for English text with common BPE vocabularies
+    return (static_cast<size_t>(text.size()) + 3) / 4;
+}
+
+std::vector<LexicalMatch> Workspace::searchLexical(const QString& query, size_t k) const {
+    std::vector<LexicalMatch> matches = lexicalIndex.search(query, k, searchThreads);
+    if (!base) {
+        return matches;
+    }
+
+    // The parent scores against its own corpus, which is close enough to rank against this
+    // branch's; it is asked for more hits since later and hidden entries are dropped here
+    for (const LexicalMatch& match : base->searchLexical(query, 2 * k + hiddenBaseLabels->size())) {
+        if (match.label < baseLabelLimit && hiddenBaseLabels->count(match.label) == 0) {
+            matches.push_back(match);
+        }
+    }
+    std::stable_sort(matches.begin(), matches.end(), [](const LexicalMatch& a, const LexicalMatch& b) {
+        return a.score > b.score;
+    });
+    if (matches.size() > k) {
+        matches.resize(k);
+    }
+    return matches;
+}
+
+std::vector<HybridMatch> Workspace::searchHybrid(const QString& query, size_t k, const EmbeddingProvider& embedQuery) {
+    std::vector<HybridMatch> matches;
+    if (k == 0) {
+        return matches;
+    }
+    // Both lists go deeper than k so entries ranked moderately by both can rise to the top
+    const size_t depth = std::max<size_t>(4 * k, 40);
+    std::vector<LexicalMatch> lexical = searchLexical(query, depth);
+
+    std::vector<std::pair<float, hnswlib::labeltype>> nearest;
+    if (!lexicalHitsSuffice(query, lexical)) {
+        std::vector<float> queryEmbedding = embedQuery ? embedQuery() : std::vector<float>();
+        if (!queryEmbedding.empty()) {
+            nearest = searchNearest(queryEmbedding, depth, searchThreads);
+        }
+    }
+
+    // Reciprocal-rank fusion: only ranks are combined, so BM25 and distance scales never meet
+    const float rrfK = 60.0f;
+    std::unordered_map<hnswlib::labeltype, float> fused;
+    for (size_t rank = 0; rank < lexical.size(); ++rank) {
+        fused[lexical[rank].label] += 1.0f / (rrfK + rank + 1);
+    }
+    for (size_t rank = 0; rank < nearest.size(); ++rank) {
+        fused[nearest[rank].second] += 1.0f / (rrfK + rank + 1);
+    }
+
+    std::vector<std::pair<float, hnswlib::labeltype>> ranked;
+    ranked.reserve(fused.size());
+    for (const auto& entry : fused) {
+        ranked.emplace_back(entry.second, entry.first);
+    }
+    size_t count = std::min(k, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(),
+                      [](const std::pair<float, hnswlib::labeltype>& a, const std::pair<float, hnswlib::labeltype>& b) {
+                          return a.first != b.first ? a.first > b.first : a.second > b.second;
+                      });
+    for (size_t i = 0; i < count; ++i) {
+        matches.push_back({ranked[i].second, ranked[i].first, getText(ranked[i].second)});
+    }
+    return matches;
+}
+
+bool Workspace::lexicalHitsSuffice(const QString& query, const std::vector<LexicalMatch>& hits) {
+    // An identifier-like query (error code, function name, path) that occurs verbatim is
+    // answered better by the lexical hits than by an embedding, so the embedding call is skipped
+    QString trimmed = query.trimmed();
+    if (hits.empty() || trimmed.isEmpty()) {
+        return false;
+    }
+    bool identifierLike = false;
+    for (int i = 0; i < trimmed.size(); ++i) {
+        QChar c = trimmed[i];
+        if (c.isSpace()) {
+            return false; // Several words, let the embedding weigh in
+        }
+        if (c.isDigit() || c == '_' || c == '.' || c == ':' || c == '/' || (i > 0 && c.isUpper() && trimmed[i - 1].isLower())) {
+            identifierLike = true;
+            break;
+        }
+    }
+    if (!identifierLike) {
+        return false;
+    }
+    QStringList terms = LexicalIndex::tokenize(trimmed);
+    terms.removeDuplicates();
+    return hits.front().matchedTerms == static_cast<size_t>(terms.size());
+}
+
+hnswlib::labeltype Workspace::addDocument(const std::vector<std::vector<float>>& chunkEmbeddings, const QStringList& chunkTexts) {
+    if (chunkEmbeddings.size() != static_cast<size_t>(chunkTexts.size())) {
+        qWarning() << "Document has" << chunkEmbeddings.size() << "chunk embeddings but" << chunkTexts.size() << "chunk texts";
+    }
+    size_t chunkCount = std::min(chunkEmbeddings.size(), static_cast<size_t>(chunkTexts.size()));
+
+    if (!documentIndex) {
+        documentSpace = std::make_unique<hnswlib::MultiVectorL2Space<hnswlib::labeltype>>(embeddingDim);
+        documentIndex = std::make_unique<hnswlib::HierarchicalNSW<float>>(documentSpace.get(), 10000, 16, 200, 100, true);
+    }
+    ensureIndexCapacity(*documentIndex, chunkCount);
+
+    hnswlib::labeltype documentId = nextDocumentId++;
+    hnswlib::labeltype firstChunk = nextChunkLabel;
+    // Each point is the chunk vector followed by the document id the stop condition groups on
+    std::vector<char> point(documentSpace->get_data_size());
+    for (size_t i = 0; i < chunkCount; ++i) {
+        if (chunkEmbeddings[i].size() != static_cast<size_t>(embeddingDim)) {
+            qWarning() << "Skipping document chunk with embedding size" << chunkEmbeddings[i].size();
+            continue;
+        }
+        std::memcpy(point.data(), chunkEmbeddings[i].data(), embeddingDim * sizeof(float));
+        documentSpace->set_doc_id(point.data(), documentId);
+
+        hnswlib::labeltype label = nextChunkLabel++;
+        documentTexts.append(label, chunkTexts[i]);
+        documentIndex->addPoint(point.data(), label, true);
+    }
+    documentChunks[documentId] = std::make_pair(firstChunk, nextChunkLabel);
+    return documentId;
+}
+
+bool Workspace::removeDocument(hnswlib::labeltype documentId) {
+    auto it = documentChunks.find(documentId);
+    if (it == documentChunks.end()) {
+        return false;
+    }
+    for (hnswlib::labeltype label = it->second.first; label < it->second.second; ++label) {
+        if (documentTexts.remove(label)) {
+            documentIndex->markDelete(label);
+        }
+    }
+    documentChunks.erase(it);
+    return true;
+}
+
+size_t Workspace::getDocumentCount() const {
+    return documentChunks.size();
+}
+
+std::vector<DocumentMatch> Workspace::searchDocuments(const std::vector<float>& queryEmbedding, size_t numDocuments) {
+    std::vector<DocumentMatch> matches;
+    if (!documentIndex || numDocuments == 0 || queryEmbedding.size() != static_cast<size_t>(embeddingDim)) {
+        return matches;
+    }
+
+    // Collect a few more documents than requested so a long document cannot crowd out
+    // the runner-up candidates while the graph is explored
+    hnswlib::MultiVectorSearchStopCondition<hnswlib::labeltype, float> stopCondition(
+        *documentSpace, numDocuments, std::max<size_t>(2 * numDocuments, 10));
+    std::vector<std::pair<float, hnswlib::labeltype>> chunks =
+        documentIndex->searchStopConditionClosest(queryEmbedding.data(), stopCondition);
+
+    // Chunks come closest first, so the first chunk seen for a document is its best match
+    std::unordered_set<hnswlib::labeltype> seen;
+    for (const auto& chunk : chunks) {
+        const char* point = documentIndex->getDataPointerByLabel(chunk.second);
+        if (point == nullptr) {
+            continue;
+        }
+        hnswlib::labeltype documentId = documentSpace->get_doc_id(point);
+        if (!seen.insert(documentId).second) {
+            continue;
+        }
+        matches.push_back({documentId, chunk.first, documentTexts.get(chunk.second)});
+        if (matches.size() == numDocuments) {
+            break;
+        }
+    }
+    return matches;
+}
+
 void Workspace::saveIndex(const std::string& filename) {
+    if (indexType == IndexType::IvfPq) {
+        archiveIndex->saveIndex(filename);
+        return;
+    }
+    if (indexType == IndexType::DiskVamana) {
+        writeDiskIndex(filename);
+        return;
+    }
     index->saveIndex(filename);
 }
 
 void Workspace::loadIndex(const std::string& filename) {
-    auto space = std::make_unique<hnswlib::L2Space>(embeddingDim);
-    index = std::make_unique<hnswlib::HierarchicalNSW<float>>(space.get(), 100000);
+    waitForBackgroundTasks();
+    if (indexType == IndexType::IvfPq) {
+        archiveIndex = std::make_unique<hnswlib::IvfPqIndex>(space.get(), filename);
+        archiveIndex->setSearchThreads(searchThreads);
+        return;
+    }
+    resetIndex();
+    if (indexType == IndexType::DiskVamana) {
+        diskIndex = std::make_unique<hnswlib::DiskVamana>(space.get(), filename);
+        return;
+    }
     index->loadIndex(filename, space.get());
+    if (searchEf != 0) {
+        index->setEf(searchEf);
+    }
 }
 
 std::vector<float> Workspace::getEmbedding(const std::string& text) {
@@ -156,8 +836,263 @@ void Workspace::setEnableStreaming(bool enableStreaming) {
     this->enableStreaming = enableStreaming;
 }
 
-void Workspace::streamAddEmbedding(const std::vector<float>& embedding, const QString& text) {
-    embeddings.push_back(embedding);
-    texts.push_back(text);
-    index->addPoint(embedding.data(), texts.size() - 1);
+hnswlib::labeltype Workspace::streamAddEmbedding(const std::vector<float>& embedding, const QString& text) {
+    return addEmbedding(embedding, text);
+}
+
+bool Workspace::isInherited(hnswlib::labeltype label) const {
+    return base != nullptr && label < baseLabelLimit;
+}
+
+bool Workspace::hasEntry(hnswlib::labeltype label) const {
+    if (isInherited(label)) {
+        return hiddenBaseLabels->count(label) == 0 && base->hasEntry(label);
+    }
+    return texts.contains(label);
+}
+
+std::vector<hnswlib::labeltype> Workspace::visibleLabels(hnswlib::labeltype limit) const {
+    std::vector<hnswlib::labeltype> labels;
+    if (base) {
+        for (hnswlib::labeltype label : base->visibleLabels(std::min(limit, baseLabelLimit))) {
+            if (hiddenBaseLabels->count(label) == 0) {
+                labels.push_back(label);
+            }
+        }
+    }
+    for (hnswlib::labeltype label : texts.labels()) {
+        if (label >= limit) {
+            break;
+        }
+        labels.push_back(label);
+    }
+    return labels;
+}
+
+bool Workspace::readEmbedding(hnswlib::labeltype label, float* vector) const {
+    if (isInherited(label)) {
+        return hiddenBaseLabels->count(label) == 0 && base->readEmbedding(label, vector);
+    }
+    if (indexType == IndexType::IvfPq) {
+        return archiveIndex->reconstruct(label, vector);
+    }
+    if (diskIndex && diskIndex->readVector(label, vector)) {
+        return true;
+    }
+    const char* data = index->getDataPointerByLabel(label);
+    if (data == nullptr) {
+        return false;
+    }
+    std::memcpy(vector, data, embeddingDim * sizeof(float));
+    return true;
+}
+
+void Workspace::freezeEntries() {
+    if (texts.size() == 0) {
+        return; // Everything visible is already frozen in base, which the branch can share as is
+    }
+    // Every search of either side goes through each frozen layer, so once the chain is deep it
+    // is folded into the own entries first and frozen again as a single layer
+    if (baseDepth >= maxBaseDepth) {
+        detachBase();
+    }
+
+    // The snapshot takes over the own entries with the index and space they live in, and the
+    // base below them; this workspace continues on top of it with empty ones. With DiskVamana the
+    // snapshot keeps the written graph, and the next saveIndex() here writes every visible entry.
+    std::shared_ptr<Workspace> frozen(new Workspace(name, id, nullptr, apiType, branchIndexCapacity));
+    std::swap(frozen->space, space);
+    std::swap(frozen->index, index);
+    std::swap(frozen->archiveIndex, archiveIndex);
+    std::swap(frozen->diskIndex, diskIndex);
+    std::swap(frozen->texts, texts);
+    std::swap(frozen->lexicalIndex, lexicalIndex);
+    std::swap(frozen->hiddenBaseLabels, hiddenBaseLabels);
+    // Background passes keep running on the moved index; the snapshot joins them when it goes
+    std::swap(frozen->compactionTask, compactionTask);
+    std::swap(frozen->tuningTask, tuningTask);
+    frozen->base = std::move(base);
+    frozen->baseDepth = baseDepth;
+    frozen->baseLabelLimit = baseLabelLimit;
+    frozen->baseEntryCount = baseEntryCount;
+    frozen->nextLabel = nextLabel;
+    frozen->indexType = indexType;
+    frozen->exactSearchThreshold = exactSearchThreshold;
+    frozen->searchThreads = searchThreads;
+    frozen->searchEf = searchEf;
+
+    if (searchEf != 0) {
+        index->setEf(searchEf);
+    }
+    if (indexType == IndexType::IvfPq) {
+        archiveIndex = std::make_unique<hnswlib::IvfPqIndex>(space.get(), archiveLists);
+        archiveIndex->setSearchThreads(searchThreads);
+    }
+    deletionsSinceCompaction = 0;
+    tunedElementCount = 0;
+    baseLabelLimit = nextLabel;
+    baseEntryCount = frozen->getEmbeddingCount();
+    baseDepth = frozen->baseDepth + 1;
+    base = std::move(frozen);
+}
+
+void Workspace::detachBase(bool moveVectors) {
+    if (!base) {
+        return;
+    }
+    waitForBackgroundTasks();
+
+    // Inherited labels are all below this branch's own, so both stores are rebuilt in label order
+    std::vector<hnswlib::labeltype> inherited = base->visibleLabels(baseLabelLimit);
+    TextArena mergedTexts;
+    LexicalIndex mergedLexicalIndex;
+    if (moveVectors && indexType != IndexType::IvfPq) {
+        ensureIndexCapacity(*index, inherited.size());
+    }
+    std::vector<float> vector(embeddingDim);
+    for (hnswlib::labeltype label : inherited) {
+        if (hiddenBaseLabels->count(label) != 0 || (moveVectors && !base->readEmbedding(label, vector.data()))) {
+            continue;
+        }
+        QString text = base->getText(label);
+        mergedTexts.append(label, text);
+        mergedLexicalIndex.add(label, text);
+        if (!moveVectors) {
+            continue;
+        }
+        if (indexType == IndexType::IvfPq) {
+            archiveIndex->addPoint(vector.data(), label);
+        } else {
+            index->addPoint(vector.data(), label, true);
+        }
+    }
+    for (hnswlib::labeltype label : texts.labels()) {
+        QString text = texts.get(label);
+        mergedTexts.append(label, text);
+        mergedLexicalIndex.add(label, text);
+    }
+    texts = std::move(mergedTexts);
+    lexicalIndex = std::move(mergedLexicalIndex);
+    base = nullptr;
+    hiddenBaseLabels = std::make_shared<std::unordered_set<hnswlib::labeltype>>();
+    baseDepth = 0;
+    baseEntryCount = 0;
+}
+
+void Workspace::writeDiskIndex(const std::string& filename) {
+    waitForBackgroundTasks();
+    // Inherited entries are written too, so the file holds everything this workspace shows and
+    // the frozen snapshot is no longer needed once it is written
+    std::vector<hnswlib::labeltype> labels = base ? visibleLabels(nextLabel) : texts.labels();
+    if (labels.empty() && !diskIndex) {
+        qWarning() << "Workspace" << name << "has no entries to write a disk index of";
+        return;
+    }
+
+    std::vector<float> vector(embeddingDim);
+    // With no entries left there is nothing to build from, but the file must still learn the deletions
+    if (diskIndex && (labels.empty() || diskIndex->getDeletedCount() * 2 <= diskIndex->getCurrentElementCount())) {
+        // Only the entries added since the last save are merged into the written graph
+        for (hnswlib::labeltype label : labels) {
+            if (!diskIndex->contains(label) && readEmbedding(label, vector.data())) {
+                diskIndex->addPoint(vector.data(), label);
+            }
+        }
+        diskIndex->saveIndex(filename);
+    } else {
+        // A first save, or most of the file is tombstones: the graph is built over every entry,
+        // which holds all their vectors in memory
+        std::unique_ptr<hnswlib::DiskVamana> written = std::make_unique<hnswlib::DiskVamana>(space.get());
+        for (hnswlib::labeltype label : labels) {
+            if (readEmbedding(label, vector.data())) {
+                written->addPoint(vector.data(), label);
+            }
+        }
+        written->saveIndex(filename);
+        diskIndex = std::move(written);
+    }
+    detachBase(false);
+    resetIndex();
+    deletionsSinceCompaction = 0;
+    tunedElementCount = 0;
+}
+
+void Workspace::resetIndex() {
+    index = std::make_unique<hnswlib::HierarchicalNSW<float>>(space.get(), defaultIndexCapacity, 16, efConstruction, 100, true);
+    if (searchEf != 0) {
+        index->setEf(searchEf);
+    }
+}
+
+void Workspace::ensureIndexCapacity(hnswlib::HierarchicalNSW<float>& target, size_t incoming) {
+    // Growing only raises the limit; the index appends storage segments lazily,
+    // so searches running on other threads are not paused.
+    size_t required = target.getCurrentElementCount() + incoming;
+    if (required > target.getMaxElements()) {
+        target.resizeIndex(std::max(required, target.getMaxElements() * 2));
+    }
+}
+
+void Workspace::scheduleCompaction() {
+    if (compactionTask.valid() && compactionTask.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return; // Already running, it will pick up the latest deletions
+    }
+
+    size_t elementCount = index->getCurrentElementCount();
+    if (elementCount == 0 || deletionsSinceCompaction < compactionThreshold * elementCount) {
+        return;
+    }
+    deletionsSinceCompaction = 0;
+
+    // Searches and inserts keep running on the index while neighborhoods are rebuilt;
+    // the pass covers the elements fully inserted when it starts
+    hnswlib::HierarchicalNSW<float>* target = index.get();
+    compactionTask = std::async(std::launch::async, [target]() { target->repairDeletedConnections(); });
+}
+
+void Workspace::scheduleTuning() {
+    applyTuningResult();
+    if (tuningTask.valid()) {
+        return; // Still running
+    }
+
+    // Small indexes are searched almost exhaustively at any ef, or not through the graph at all
+    const size_t minTuningElements = std::max<size_t>(1000, exactSearchThreshold);
+    size_t elementCount = index->getCurrentElementCount();
+    if (elementCount < minTuningElements || elementCount < 2 * tunedElementCount) {
+        return;
+    }
+    tunedElementCount = elementCount;
+
+    // Both the snapshot and the probing searches run in the background while the index keeps
+    // serving; the probes search the way searchFiltered() does
+    hnswlib::HierarchicalNSW<float>* target = index.get();
+    hnswlib::L2Space* targetSpace = space.get();
+    size_t k = recallK;
+    float recall = static_cast<float>(targetRecall);
+    size_t patience = adaptivePatience;
+    tuningTask = std::async(std::launch::async, [target, targetSpace, k, recall, patience]() {
+        hnswlib::EfTuner<float> tuner(*target, targetSpace, k);
+        return tuner.tune(*target, recall, 1024, patience);
+    });
+}
+
+void Workspace::applyTuningResult() {
+    if (!tuningTask.valid() || tuningTask.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+    hnswlib::EfTuner<float>::Result result = tuningTask.get();
+    searchEf = result.ef;
+    efConstruction = result.ef_construction;
+    index->setEf(searchEf);
+}
+
+void Workspace::waitForBackgroundTasks() {
+    if (compactionTask.valid()) {
+        compactionTask.wait();
+    }
+    if (tuningTask.valid()) {
+        tuningTask.wait();
+        tuningTask.get(); // Measured on the index about to be replaced
+    }
 }
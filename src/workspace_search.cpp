@@ -0,0 +1,124 @@
+// workspace_search.cpp
+#include "workspace_search.h"
+#include <QRunnable>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <tuple>
+
+namespace {
+
+using Neighbors = std::vector<std::pair<float, hnswlib::labeltype>>;
+
+// Shared by the caller and the pool tasks of one search
+struct SearchState {
+    std::vector<float> query;
+    size_t k = 0;
+    std::vector<Neighbors> results; // One slot per workspace, closest first
+    std::vector<char> answered;
+    std::mutex lock;
+    std::condition_variable finished; // Notified whenever a search is done
+    size_t running = 0;
+};
+
+class WorkspaceSearchTask : public QRunnable {
+public:
+    WorkspaceSearchTask(std::shared_ptr<SearchState> state, const Workspace* workspace, size_t slot)
+        : state(std::move(state)), workspace(workspace), slot(slot) {}
+
+    void run() override {
+        Neighbors nearest = workspace->searchNearest(state->query, state->k);
+
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->results[slot] = std::move(nearest);
+        state->answered[slot] = 1;
+        state->running--;
+        state->finished.notify_all();
+    }
+
+private:
+    std::shared_ptr<SearchState> state;
+    const Workspace* workspace;
+    size_t slot;
+};
+
+} // namespace
+
+WorkspaceSearch::WorkspaceSearch(int maxThreads) {
+    pool.setMaxThreadCount(std::max(1, maxThreads));
+}
+
+WorkspaceSearchResult WorkspaceSearch::search(const std::vector<Workspace*>& workspaces, const std::vector<float>& queryEmbedding,
+                                              size_t k, int latencyBudgetMs) {
+    WorkspaceSearchResult result;
+    if (workspaces.empty() || k == 0) {
+        return result;
+    }
+
+    auto state = std::make_shared<SearchState>();
+    state->query = queryEmbedding;
+    state->k = k;
+    state->results.resize(workspaces.size());
+    state->answered.assign(workspaces.size(), 0);
+
+    // No more searches are started than there are threads, so none waits in the pool's queue.
+    // Once the budget runs out no new ones start, but those running are waited for (each is a
+    // single index lookup), so no task touches a workspace after this returns
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(latencyBudgetMs);
+    size_t maxRunning = static_cast<size_t>(std::max(1, pool.maxThreadCount()));
+    size_t next = 0;
+    {
+        std::unique_lock<std::mutex> guard(state->lock);
+        for (;;) {
+            bool inTime = std::chrono::steady_clock::now() < deadline;
+            while (inTime && next < workspaces.size() && state->running < maxRunning) {
+                state->running++;
+                pool.start(new WorkspaceSearchTask(state, workspaces[next], next));
+                next++;
+            }
+            if (state->running == 0) {
+                break;
+            }
+            if (inTime && next < workspaces.size()) {
+                state->finished.wait_until(guard, deadline);
+            } else {
+                state->finished.wait(guard);
+            }
+        }
+    }
+
+    // k-way merge of the per-workspace lists, which are already sorted closest first
+    using Head = std::tuple<float, size_t, size_t>; // Distance, workspace slot, position in its list
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    for (size_t i = 0; i < workspaces.size(); ++i) {
+        if (!state->answered[i]) {
+            result.skippedWorkspaces++;
+            continue;
+        }
+        result.searchedWorkspaces++;
+        if (!state->results[i].empty()) {
+            heads.emplace(state->results[i][0].first, i, 0);
+        }
+    }
+
+    while (!heads.empty() && result.hits.size() < k) {
+        float distance;
+        size_t slot;
+        size_t position;
+        std::tie(distance, slot, position) = heads.top();
+        heads.pop();
+
+        const Workspace* workspace = workspaces[slot];
+        hnswlib::labeltype label = state->results[slot][position].second;
+        result.hits.push_back({workspace->getId(), workspace->getName(), label, distance, workspace->getText(label)});
+
+        if (position + 1 < state->results[slot].size()) {
+            heads.emplace(state->results[slot][position + 1].first, slot, position + 1);
+        }
+    }
+    return result;
+}
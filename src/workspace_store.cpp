@@ -0,0 +1,926 @@
+// workspace_store.cpp
+#include "workspace_store.h"
+#include "chat_journal.h"
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QPair>
+#include <QSqlError>
+#include <QTextDocument>
+#include <QVariant>
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+namespace {
+// 2: messages can be compressed, 3: workspaces can be forked, 4: messages are all markdown
+constexpr int schemaVersion = 4;
+// How QTextDocument::toHtml() starts; replies were stored that way before they were kept as markdown
+const char* const legacyHtmlPrefix = "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.0//EN\"";
+// Samples of at most this many messages and bytes train the compression dictionary
+constexpr int dictionarySamples = 4000;
+constexpr int dictionarySampleBytes = 8 << 20;
+// After training fails for too little history, it is tried again once this many messages are added
+constexpr int dictionaryRetryMessages = 256;
+// Characters of context on each side of the first match in snippets made here
+constexpr int snippetContext = 60;
+
+QStringList words(const QString& text) {
+    QStringList result;
+    QString word;
+    for (QChar c : text) {
+        if (c.isLetterOrNumber() || c == '_') {
+            word.append(c);
+        } else if (!word.isEmpty()) {
+            result.append(word);
+            word.clear();
+        }
+    }
+    if (!word.isEmpty()) {
+        result.append(word);
+    }
+    return result;
+}
+
+// A word, or a phrase of words that must follow each other; a prefix term also matches words
+// that start with its last word
+struct SearchTerm {
+    QStringList words;
+    bool prefix;
+};
+
+// Quoted parts of the query are phrases, and a part ending in * is a prefix. A quote left open
+// runs to the end, so a phrase still being typed is searched for as well.
+std::vector<SearchTerm> searchTerms(const QString& query) {
+    std::vector<SearchTerm> terms;
+    QStringList parts = query.split('"');
+    for (int i = 0; i < parts.size(); ++i) {
+        QString part = parts.at(i).trimmed();
+        bool quoted = i % 2 == 1;
+        if (quoted) {
+            bool prefix = part.endsWith('*') || (i + 1 < parts.size() && parts.at(i + 1).startsWith('*'));
+            QStringList phrase = words(part);
+            if (!phrase.isEmpty()) {
+                terms.push_back({phrase, prefix});
+            }
+            continue;
+        }
+        for (const QString& token : part.split(' ', Qt::SkipEmptyParts)) {
+            QStringList tokenWords = words(token);
+            for (int j = 0; j < tokenWords.size(); ++j) {
+                terms.push_back({QStringList(tokenWords.at(j)), j == tokenWords.size() - 1 && token.endsWith('*')});
+            }
+        }
+    }
+    return terms;
+}
+
+QStringList searchWords(const std::vector<SearchTerm>& terms) {
+    QStringList result;
+    for (const SearchTerm& term : terms) {
+        result += term.words;
+    }
+    return result;
+}
+} // namespace
+
+WorkspaceStore::WorkspaceStore(const QString& path, const QString& legacyDirectory, QObject* parent)
+    : QObject(parent), path(path), legacyDirectory(legacyDirectory),
+      connectionName("WorkspaceStore-" + QString::number(reinterpret_cast<quintptr>(this), 16)) {
+}
+
+WorkspaceStore::~WorkspaceStore() {
+    close();
+}
+
+bool WorkspaceStore::open() {
+    if (isOpen()) {
+        return true;
+    }
+    if (!QDir().mkpath(QFileInfo(path).absolutePath())) {
+        qCritical() << "Failed to create directory for workspace database" << path;
+        return false;
+    }
+
+    database = QSqlDatabase::addDatabase("QSQLITE", connectionName);
+    database.setDatabaseName(path);
+    if (!database.open()) {
+        qCritical() << "Failed to open workspace database" << path << ":" << database.lastError().text();
+        close();
+        return false;
+    }
+
+    // Appends only write the WAL; it is synced on checkpoints, so a crash loses nothing that
+    // was committed and a power cut at most the last moments
+    QSqlQuery walQuery(database);
+    if (!walQuery.exec("PRAGMA journal_mode = WAL") || !walQuery.next() || walQuery.value(0).toString() != "wal") {
+        qWarning() << "Workspace database is not in WAL mode, appends will be slower";
+    }
+    exec("PRAGMA synchronous = NORMAL");
+    // Lets archiving hand the pages freed by compression back to the file system; only takes
+    // effect on a new database
+    exec("PRAGMA auto_vacuum = INCREMENTAL");
+
+    // A new database has no dictionaries table yet, and nothing to read
+    QSqlQuery dictionaryQuery(database);
+    dictionaryQuery.setForwardOnly(true);
+    if (dictionaryQuery.exec("SELECT id, data FROM compressionDictionaries ORDER BY id")) {
+        while (dictionaryQuery.next()) {
+            compressor.addDictionary(dictionaryQuery.value(0).toUInt(), dictionaryQuery.value(1).toByteArray());
+        }
+    }
+    dictionaryQuery.finish();
+
+    // After the dictionaries, which converting archived messages needs
+    if (!createSchema()) {
+        close();
+        return false;
+    }
+
+    insertMessage.reset(new QSqlQuery(database));
+    upsertWorkspace.reset(new QSqlQuery(database));
+    selectMessages.reset(new QSqlQuery(database));
+    if (!prepare(*insertMessage, "INSERT INTO messages(workspaceId, position, content) VALUES (?, ?, ?)") ||
+        !prepare(*selectMessages, "SELECT content FROM messages WHERE workspaceId = ? AND position < ? "
+                                  "ORDER BY position DESC LIMIT ?") ||
+        !prepare(*upsertWorkspace,
+                 "INSERT INTO workspaces(id, name, apiType, agentType, json, parentId, forkPosition) "
+                 "VALUES (?, ?, ?, ?, ?, ?, ?) "
+                 "ON CONFLICT(id) DO UPDATE SET name = excluded.name, apiType = excluded.apiType, "
+                 "agentType = excluded.agentType, json = excluded.json")) {
+        close();
+        return false;
+    }
+
+    // After the dictionaries, which rebuilding the index needs to read archived messages
+    createSearchIndex();
+
+    if (!importLegacyWorkspaces()) {
+        qCritical() << "Failed to import workspaces.json, it is left in place for the next start";
+    }
+    return true;
+}
+
+void WorkspaceStore::close() {
+    insertMessage.reset();
+    upsertWorkspace.reset();
+    selectMessages.reset();
+    if (database.isValid()) {
+        database.close();
+        database = QSqlDatabase();
+        QSqlDatabase::removeDatabase(connectionName);
+    }
+    nextPosition.clear();
+    savedJson.clear();
+    forkOrigins.clear();
+}
+
+bool WorkspaceStore::isOpen() const {
+    return database.isValid() && database.isOpen();
+}
+
+std::vector<WorkspaceRecord> WorkspaceStore::loadWorkspaces() {
+    std::vector<WorkspaceRecord> records;
+    if (!isOpen()) {
+        return records;
+    }
+
+    QSqlQuery workspaceQuery(database);
+    workspaceQuery.setForwardOnly(true);
+    if (!workspaceQuery.exec("SELECT id, agentType, json, parentId, forkPosition FROM workspaces ORDER BY id")) {
+        qCritical() << "Failed to load workspaces:" << workspaceQuery.lastError().text();
+        return records;
+    }
+    while (workspaceQuery.next()) {
+        WorkspaceRecord record;
+        record.id = workspaceQuery.value(0).toInt();
+        record.agentType = workspaceQuery.value(1).toString();
+        QByteArray json = workspaceQuery.value(2).toByteArray();
+        record.json = QJsonDocument::fromJson(json).object();
+        if (!workspaceQuery.isNull(3)) {
+            record.parentId = workspaceQuery.value(3).toInt();
+            record.forkPosition = workspaceQuery.value(4).toLongLong();
+            forkOrigins[record.id] = ForkOrigin{record.parentId, record.forkPosition};
+        }
+        savedJson[record.id] = json;
+        records.push_back(std::move(record));
+    }
+
+    // One lookup at the end of the (workspaceId, position) index per workspace; no message is read
+    QSqlQuery countQuery(database);
+    if (!prepare(countQuery, "SELECT MAX(position) FROM messages WHERE workspaceId = ?")) {
+        return records;
+    }
+    for (auto& record : records) {
+        countQuery.addBindValue(record.id);
+        qint64 ownCount = 0;
+        if (countQuery.exec() && countQuery.next() && !countQuery.isNull(0)) {
+            ownCount = countQuery.value(0).toLongLong() + 1;
+        }
+        countQuery.finish();
+        // A branch that has added nothing yet is as long as its fork point
+        record.messageCount = std::max(ownCount, record.forkPosition);
+        nextPosition[record.id] = record.messageCount;
+    }
+
+    // Messages of a workspace whose row was never saved would show up in the next one given its id;
+    // the distinct ids are found by hopping along the index rather than scanning it
+    QSqlQuery nextId(database);
+    if (!prepare(nextId, "SELECT MIN(workspaceId) FROM messages WHERE workspaceId > ?")) {
+        return records;
+    }
+    qint64 lastId = std::numeric_limits<qint64>::min();
+    while (true) {
+        nextId.addBindValue(lastId);
+        if (!nextId.exec() || !nextId.next() || nextId.isNull(0)) {
+            break;
+        }
+        lastId = nextId.value(0).toLongLong();
+        nextId.finish();
+        if (savedJson.count(static_cast<int>(lastId)) == 0) {
+            qWarning() << "Dropping the messages of unsaved workspace" << lastId;
+            QSqlQuery orphans(database);
+            if (prepare(orphans, "DELETE FROM messages WHERE workspaceId = ?")) {
+                orphans.addBindValue(lastId);
+                orphans.exec();
+            }
+        }
+    }
+    return records;
+}
+
+QVector<QString> WorkspaceStore::loadMessages(int workspaceId, qint64 beforePosition, int limit) {
+    QVector<QString> messages;
+    if (!isOpen() || limit <= 0 || beforePosition <= 0) {
+        return messages;
+    }
+    // A backwards range scan of the index, so a page costs the same at any depth of history
+    selectMessages->addBindValue(workspaceId);
+    selectMessages->addBindValue(beforePosition);
+    selectMessages->addBindValue(limit);
+    if (!selectMessages->exec()) {
+        qWarning() << "Failed to load messages of workspace" << workspaceId << ":" << selectMessages->lastError().text();
+        return messages;
+    }
+    while (selectMessages->next()) {
+        messages.append(decodeMessage(selectMessages->value(0)));
+    }
+    selectMessages->finish();
+    std::reverse(messages.begin(), messages.end());
+
+    // A branch's own rows start at its fork point, so a short page continues in the parent
+    auto origin = forkOrigins.find(workspaceId);
+    if (messages.size() < limit && origin != forkOrigins.end()) {
+        QVector<QString> older = loadMessages(origin->second.parentId, std::min(beforePosition, origin->second.position),
+                                              limit - messages.size());
+        older += messages;
+        messages = std::move(older);
+    }
+    return messages;
+}
+
+bool WorkspaceStore::saveWorkspaces(const std::vector<WorkspaceRecord>& records) {
+    if (!isOpen() || !database.transaction()) {
+        return false;
+    }
+    std::map<int, QByteArray> written;
+    if (!writeWorkspaceRows(records, written) || !database.commit()) {
+        qCritical() << "Failed to save workspaces:" << database.lastError().text();
+        database.rollback();
+        return false;
+    }
+    for (auto& entry : written) {
+        savedJson[entry.first] = std::move(entry.second);
+    }
+    return true;
+}
+
+bool WorkspaceStore::forkWorkspace(const WorkspaceRecord& record) {
+    if (!isOpen() || !database.transaction()) {
+        return false;
+    }
+    std::map<int, QByteArray> written;
+    savedJson.erase(record.id);
+    if (!writeWorkspaceRows({record}, written) || !database.commit()) {
+        qCritical() << "Failed to store fork" << record.id << "of workspace" << record.parentId << ":" << database.lastError().text();
+        database.rollback();
+        return false;
+    }
+    savedJson.insert(written.begin(), written.end());
+    forkOrigins[record.id] = ForkOrigin{record.parentId, record.forkPosition};
+    nextPosition[record.id] = record.forkPosition;
+    return true;
+}
+
+bool WorkspaceStore::removeWorkspace(int workspaceId) {
+    if (!isOpen() || !database.transaction()) {
+        return false;
+    }
+    auto ownOrigin = forkOrigins.find(workspaceId);
+    ForkOrigin origin = ownOrigin != forkOrigins.end() ? ownOrigin->second : ForkOrigin{-1, 0};
+    std::vector<std::pair<int, ForkOrigin>> reparented;
+    bool ok = true;
+    for (const auto& branch : forkOrigins) {
+        if (branch.second.parentId == workspaceId) {
+            reparented.emplace_back(branch.first, ForkOrigin{-1, 0});
+        }
+    }
+    for (auto& branch : reparented) {
+        ok = ok && reparentBranch(branch.first, workspaceId, origin, branch.second);
+    }
+
+    QSqlQuery deleteMessages(database);
+    QSqlQuery deleteWorkspace(database);
+    ok = ok && prepare(deleteMessages, "DELETE FROM messages WHERE workspaceId = ?") &&
+         prepare(deleteWorkspace, "DELETE FROM workspaces WHERE id = ?");
+    if (ok && fullTextSearch) {
+        // The delete trigger cannot see the text of compressed messages, so their search
+        // entries are removed here
+        QSqlQuery compressed(database);
+        QSqlQuery unindex(database);
+        compressed.setForwardOnly(true);
+        ok = prepare(compressed, "SELECT id, content FROM messages WHERE workspaceId = ? AND typeof(content) = 'blob'") &&
+             prepare(unindex, "INSERT INTO messageSearch(messageSearch, rowid, content) VALUES ('delete', ?, ?)");
+        compressed.addBindValue(workspaceId);
+        ok = ok && compressed.exec();
+        while (ok && compressed.next()) {
+            unindex.addBindValue(compressed.value(0));
+            unindex.addBindValue(decodeMessage(compressed.value(1)));
+            ok = unindex.exec();
+        }
+    }
+    if (ok) {
+        deleteMessages.addBindValue(workspaceId);
+        deleteWorkspace.addBindValue(workspaceId);
+        ok = deleteMessages.exec() && deleteWorkspace.exec();
+    }
+    if (!ok || !database.commit()) {
+        qCritical() << "Failed to remove workspace" << workspaceId << ":" << database.lastError().text();
+        database.rollback();
+        return false;
+    }
+    nextPosition.erase(workspaceId);
+    savedJson.erase(workspaceId);
+    forkOrigins.erase(workspaceId);
+    for (const auto& branch : reparented) {
+        if (branch.second.parentId >= 0) {
+            forkOrigins[branch.first] = branch.second;
+        } else {
+            forkOrigins.erase(branch.first);
+        }
+    }
+    return true;
+}
+
+bool WorkspaceStore::appendMessage(int workspaceId, const QString& message) {
+    if (!isOpen()) {
+        return false;
+    }
+    qint64& position = nextPosition[workspaceId];
+    insertMessage->addBindValue(workspaceId);
+    insertMessage->addBindValue(position);
+    insertMessage->addBindValue(message);
+    if (!insertMessage->exec()) {
+        qWarning() << "Failed to store message of workspace" << workspaceId << ":" << insertMessage->lastError().text();
+        return false;
+    }
+    ++position;
+    ++messagesSinceDictionaryFailure;
+    return true;
+}
+
+void WorkspaceStore::searchNewestMessages(const QString& query, int limit, int batchSize,
+                                          const std::function<bool(const std::vector<MessageMatch>&)>& onMatches) {
+    std::vector<MessageMatch> batch;
+    bool wanted = runSearch(query, limit, [&batch, batchSize, &onMatches](MessageMatch& match) {
+        batch.push_back(std::move(match));
+        if (static_cast<int>(batch.size()) < batchSize) {
+            return true;
+        }
+        bool more = onMatches(batch);
+        batch.clear();
+        return more;
+    });
+    if (wanted) {
+        onMatches(batch); // Also when empty, so the caller learns the search is over
+    }
+}
+
+bool WorkspaceStore::runSearch(const QString& query, int limit, const std::function<bool(MessageMatch&)>& onMatch) {
+    std::vector<SearchTerm> terms = searchTerms(query);
+    if (!isOpen() || terms.empty() || limit <= 0) {
+        return true;
+    }
+
+    QSqlQuery search(database);
+    search.setForwardOnly(true);
+    if (fullTextSearch) {
+        // FTS5 walks its index backwards by rowid, so the newest matches need no sort. They are
+        // not ranked either: bm25() counts every matching message first, which for a common
+        // word costs more than reading the newest ones
+        if (!prepare(search, "SELECT messages.workspaceId, messages.position, "
+                             "snippet(messageSearch, 0, '[', ']', '...', 16), messages.content "
+                             "FROM messageSearch JOIN messages ON messages.id = messageSearch.rowid "
+                             "WHERE messageSearch MATCH ? ORDER BY messageSearch.rowid DESC LIMIT ?")) {
+            return true;
+        }
+        search.addBindValue(ftsQuery(query));
+    } else {
+        // Without FTS5 every message is scanned, and compressed ones cannot be matched
+        QString statement = "SELECT workspaceId, position, content, NULL FROM messages WHERE 1";
+        for (size_t i = 0; i < terms.size(); ++i) {
+            statement += " AND content LIKE ? ESCAPE '\\'";
+        }
+        statement += " ORDER BY id DESC LIMIT ?";
+        if (!prepare(search, statement)) {
+            return true;
+        }
+        for (const SearchTerm& term : terms) {
+            QString pattern = term.words.join(' ');
+            pattern.replace("\\", "\\\\").replace("%", "\\%").replace("_", "\\_");
+            search.addBindValue("%" + pattern + "%");
+        }
+    }
+    search.addBindValue(limit);
+    if (!search.exec()) {
+        qWarning() << "Message search failed:" << search.lastError().text();
+        return true;
+    }
+    while (search.next()) {
+        MessageMatch match;
+        match.workspaceId = search.value(0).toInt();
+        match.position = search.value(1).toLongLong();
+        match.snippet = search.value(2).toString();
+        if (isCompressedValue(search.value(3))) {
+            // snippet() only sees the compressed bytes
+            match.snippet = makeSnippet(decodeMessage(search.value(3)), searchWords(terms));
+        }
+        if (!onMatch(match)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+qint64 WorkspaceStore::archiveHistory(int workspaceId) {
+    if (!isOpen()) {
+        return 0;
+    }
+    // Sampling scans every message, so a failed training is not repeated on each archive
+    if (!compressor.hasDictionary() && (!dictionaryFailed || messagesSinceDictionaryFailure >= dictionaryRetryMessages)) {
+        dictionaryFailed = !trainDictionary();
+        messagesSinceDictionaryFailure = 0;
+    }
+
+    QSqlQuery plain(database);
+    plain.setForwardOnly(true);
+    if (!prepare(plain, "SELECT id, content FROM messages WHERE workspaceId = ? AND typeof(content) = 'text'")) {
+        return 0;
+    }
+    plain.addBindValue(workspaceId);
+    if (!plain.exec()) {
+        return 0;
+    }
+    std::vector<std::pair<qint64, QByteArray>> compressed;
+    qint64 savedBytes = 0;
+    while (plain.next()) {
+        QByteArray text = plain.value(1).toString().toUtf8();
+        QByteArray packed = compressor.compress(text);
+        if (!packed.isEmpty()) {
+            savedBytes += text.size() - packed.size();
+            compressed.emplace_back(plain.value(0).toLongLong(), packed);
+        }
+    }
+    plain.finish();
+    if (compressed.empty()) {
+        return 0;
+    }
+
+    // No trigger fires on update, so the search index keeps the words of the original text
+    QSqlQuery update(database);
+    if (!database.transaction() || !prepare(update, "UPDATE messages SET content = ? WHERE id = ?")) {
+        return 0;
+    }
+    for (const auto& entry : compressed) {
+        update.addBindValue(entry.second);
+        update.addBindValue(entry.first);
+        if (!update.exec()) {
+            qWarning() << "Failed to archive messages of workspace" << workspaceId << ":" << update.lastError().text();
+            database.rollback();
+            return 0;
+        }
+    }
+    if (!database.commit()) {
+        database.rollback();
+        return 0;
+    }
+    exec("PRAGMA incremental_vacuum");
+    return savedBytes;
+}
+
+bool WorkspaceStore::checkpoint() {
+    if (!isOpen()) {
+        return false;
+    }
+    QSqlQuery query(database);
+    // Returns (busy, log frames, checkpointed frames); busy is set if a reader held it up
+    if (!query.exec("PRAGMA wal_checkpoint(TRUNCATE)") || !query.next() || query.value(0).toInt() != 0) {
+        qWarning() << "Workspace database checkpoint did not complete";
+        return false;
+    }
+    return true;
+}
+
+bool WorkspaceStore::createSchema() {
+    QSqlQuery versionQuery(database);
+    int version = versionQuery.exec("PRAGMA user_version") && versionQuery.next() ? versionQuery.value(0).toInt() : 0;
+    versionQuery.finish();
+    if (!database.transaction()) {
+        return false;
+    }
+    bool ok = exec("CREATE TABLE IF NOT EXISTS workspaces(id INTEGER PRIMARY KEY, name TEXT NOT NULL, "
+                   "apiType TEXT NOT NULL, agentType TEXT, json TEXT NOT NULL)") &&
+              exec("CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY AUTOINCREMENT, "
+                   "workspaceId INTEGER NOT NULL, position INTEGER NOT NULL, content TEXT NOT NULL, "
+                   "UNIQUE(workspaceId, position))") &&
+              exec("CREATE TABLE IF NOT EXISTS compressionDictionaries(id INTEGER PRIMARY KEY, data BLOB NOT NULL)");
+    if (ok && version < 2) {
+        // Recreated below to skip compressed messages
+        ok = exec("DROP TRIGGER IF EXISTS messagesDeleted");
+    }
+    if (ok && version < 3) {
+        ok = exec("ALTER TABLE workspaces ADD COLUMN parentId INTEGER") &&
+             exec("ALTER TABLE workspaces ADD COLUMN forkPosition INTEGER NOT NULL DEFAULT 0");
+    }
+    if (ok && version < 4) {
+        ok = convertHtmlMessages();
+    }
+    ok = ok && exec("PRAGMA user_version = " + QString::number(schemaVersion));
+    if (!ok || !database.commit()) {
+        database.rollback();
+        return false;
+    }
+
+    return true;
+}
+
+void WorkspaceStore::createSearchIndex() {
+    QSqlQuery existing(database);
+    QString definition = existing.exec("SELECT sql FROM sqlite_master WHERE name = 'messageSearch'") && existing.next()
+                             ? existing.value(0).toString()
+                             : QString();
+    existing.finish();
+    // Indexes made without prefixes of one to three characters, which keep the word being typed
+    // fast from its first letter, are rebuilt once; so is one missing because SQLite had no FTS5 before
+    bool create = !definition.contains("prefix='1 2 3'");
+
+    // Kept in sync by triggers; an external-content table stores no second copy of the text
+    fullTextSearch = database.transaction() &&
+                     (!create || definition.isEmpty() || exec("DROP TABLE messageSearch")) &&
+                     exec("CREATE VIRTUAL TABLE IF NOT EXISTS messageSearch USING fts5("
+                          "content, content='messages', content_rowid='id', tokenize='unicode61', prefix='1 2 3')") &&
+                     exec("CREATE TRIGGER IF NOT EXISTS messagesInserted AFTER INSERT ON messages BEGIN "
+                          "INSERT INTO messageSearch(rowid, content) VALUES (new.id, new.content); END") &&
+                     exec("CREATE TRIGGER IF NOT EXISTS messagesDeleted AFTER DELETE ON messages "
+                          "WHEN typeof(old.content) = 'text' BEGIN "
+                          "INSERT INTO messageSearch(messageSearch, rowid, content) "
+                          "VALUES ('delete', old.id, old.content); END") &&
+                     (!create || indexStoredMessages()) &&
+                     database.commit();
+    if (!fullTextSearch) {
+        database.rollback();
+        qWarning() << "SQLite was built without FTS5, message search scans every message";
+    }
+}
+
+bool WorkspaceStore::indexStoredMessages() {
+    if (!exec("INSERT INTO messageSearch(rowid, content) SELECT id, content FROM messages WHERE typeof(content) = 'text'")) {
+        return false;
+    }
+    // Archived messages are indexed with the words of their original text
+    QSqlQuery compressed(database);
+    compressed.setForwardOnly(true);
+    QSqlQuery insert(database);
+    if (!compressed.exec("SELECT id, content FROM messages WHERE typeof(content) = 'blob'") ||
+        !prepare(insert, "INSERT INTO messageSearch(rowid, content) VALUES (?, ?)")) {
+        return false;
+    }
+    while (compressed.next()) {
+        insert.addBindValue(compressed.value(0).toLongLong());
+        insert.addBindValue(decodeMessage(compressed.value(1)));
+        if (!insert.exec()) {
+            qWarning() << "Failed to index an archived message:" << insert.lastError().text();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool WorkspaceStore::convertHtmlMessages() {
+    QSqlQuery select(database);
+    select.setForwardOnly(true);
+    // Archived messages can only be told apart once decompressed
+    if (!prepare(select, "SELECT id, content FROM messages WHERE typeof(content) = 'blob' OR content LIKE ?")) {
+        return false;
+    }
+    select.addBindValue(QString(legacyHtmlPrefix) + "%");
+    if (!select.exec()) {
+        return false;
+    }
+    std::vector<QPair<qint64, QString>> converted;
+    while (select.next()) {
+        QString text = decodeMessage(select.value(1));
+        if (text.startsWith(legacyHtmlPrefix)) {
+            converted.push_back(qMakePair(select.value(0).toLongLong(), markdownFromLegacy(text)));
+        }
+    }
+    select.finish();
+    if (converted.empty()) {
+        return true;
+    }
+
+    // Stored plain; the next archive compresses them again
+    QSqlQuery update(database);
+    if (!prepare(update, "UPDATE messages SET content = ? WHERE id = ?")) {
+        return false;
+    }
+    for (const auto& message : converted) {
+        update.addBindValue(message.second);
+        update.addBindValue(message.first);
+        if (!update.exec()) {
+            qWarning() << "Failed to convert a message to markdown:" << update.lastError().text();
+            return false;
+        }
+    }
+    // The search index holds the words of the HTML, so createSearchIndex() builds it anew
+    return exec("DROP TRIGGER IF EXISTS messagesInserted") && exec("DROP TRIGGER IF EXISTS messagesDeleted") &&
+           exec("DROP TABLE IF EXISTS messageSearch");
+}
+
+QString WorkspaceStore::markdownFromLegacy(const QString& message) {
+    if (!message.startsWith(legacyHtmlPrefix)) {
+        return message;
+    }
+    QTextDocument document;
+    document.setHtml(message);
+    return document.toMarkdown();
+}
+
+bool WorkspaceStore::importLegacyWorkspaces() {
+    QString jsonPath = legacyDirectory + "/workspaces.json";
+    QFile file(jsonPath);
+    if (!file.exists()) {
+        return true;
+    }
+    QSqlQuery count(database);
+    if (!count.exec("SELECT COUNT(*) FROM workspaces") || !count.next()) {
+        return false;
+    }
+    if (count.value(0).toInt() > 0) {
+        return true; // Imported before; the file was left behind by an older build
+    }
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qCritical() << "Failed to open workspaces file for reading:" << file.errorString();
+        return false;
+    }
+    QJsonDocument jsonDoc = QJsonDocument::fromJson(file.readAll());
+    file.close();
+    if (!jsonDoc.isArray()) {
+        qWarning() << "Invalid JSON format in workspaces file, nothing imported";
+        return true;
+    }
+
+    QString journalDirectory = legacyDirectory + "/journal";
+    std::unique_ptr<ChatJournal> journal;
+    if (QDir(journalDirectory).exists()) {
+        journal.reset(new ChatJournal(journalDirectory));
+    }
+
+    std::vector<WorkspaceRecord> records;
+    for (const auto& jsonValue : jsonDoc.array()) {
+        QJsonObject jsonObject = jsonValue.toObject();
+        WorkspaceRecord record;
+        record.id = jsonObject["id"].toInt();
+        record.agentType = jsonObject["agentType"].toString();
+        for (const auto& message : jsonObject["chatHistory"].toArray()) {
+            record.messages.append(message.toString());
+        }
+        if (journal) {
+            // Messages journaled after the snapshot was written
+            quint64 snapshotSequence = static_cast<quint64>(jsonObject["journalSequence"].toDouble());
+            record.messages += journal->replay(record.id, snapshotSequence);
+        }
+        for (QString& message : record.messages) {
+            message = markdownFromLegacy(message);
+        }
+        jsonObject.remove("chatHistory");
+        jsonObject.remove("journalSequence");
+        jsonObject.remove("agentType");
+        record.json = jsonObject;
+        records.push_back(std::move(record));
+    }
+    journal.reset();
+
+    // All or nothing, so a failed import is simply retried on the next start
+    if (!database.transaction()) {
+        return false;
+    }
+    std::map<int, QByteArray> written;
+    bool ok = writeWorkspaceRows(records, written);
+    for (size_t i = 0; ok && i < records.size(); ++i) {
+        for (const auto& message : records[i].messages) {
+            if (!appendMessage(records[i].id, message)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (!ok || !database.commit()) {
+        database.rollback();
+        nextPosition.clear();
+        return false;
+    }
+    savedJson.insert(written.begin(), written.end());
+
+    // Kept as a backup; the journal is fully contained in the database now
+    QFile::remove(jsonPath + ".migrated");
+    if (!QFile::rename(jsonPath, jsonPath + ".migrated")) {
+        qWarning() << "Could not rename" << jsonPath << "after importing it";
+    }
+    QDir(journalDirectory).removeRecursively();
+    return true;
+}
+
+bool WorkspaceStore::writeWorkspaceRows(const std::vector<WorkspaceRecord>& records, std::map<int, QByteArray>& written) {
+    for (const auto& record : records) {
+        QByteArray json = encodeJson(record.json);
+        auto saved = savedJson.find(record.id);
+        if (saved != savedJson.end() && saved->second == json) {
+            continue;
+        }
+        upsertWorkspace->addBindValue(record.id);
+        upsertWorkspace->addBindValue(record.json["name"].toString());
+        upsertWorkspace->addBindValue(record.json["apiType"].toString());
+        upsertWorkspace->addBindValue(record.agentType);
+        upsertWorkspace->addBindValue(QString::fromUtf8(json));
+        // Only set when the row is created; afterwards the store alone moves a branch
+        upsertWorkspace->addBindValue(record.parentId >= 0 ? QVariant(record.parentId) : QVariant());
+        upsertWorkspace->addBindValue(record.forkPosition);
+        if (!upsertWorkspace->exec()) {
+            qCritical() << "Failed to save workspace" << record.id << ":" << upsertWorkspace->lastError().text();
+            return false;
+        }
+        written[record.id] = json;
+    }
+    return true;
+}
+
+bool WorkspaceStore::reparentBranch(int branchId, int parentId, const ForkOrigin& parentOrigin, ForkOrigin& moved) {
+    ForkOrigin origin = forkOrigins[branchId];
+    moved = ForkOrigin{parentOrigin.parentId, std::min(origin.position, parentOrigin.position)};
+
+    // Read first; the copies go into the same table. Archived messages are stored plain again
+    // so the insert trigger indexes their text
+    QVector<QPair<qint64, QString>> shared;
+    if (origin.position > parentOrigin.position) {
+        QSqlQuery select(database);
+        select.setForwardOnly(true);
+        if (!prepare(select, "SELECT position, content FROM messages WHERE workspaceId = ? AND position >= ? AND position < ? "
+                             "ORDER BY position")) {
+            return false;
+        }
+        select.addBindValue(parentId);
+        select.addBindValue(parentOrigin.position);
+        select.addBindValue(origin.position);
+        if (!select.exec()) {
+            return false;
+        }
+        while (select.next()) {
+            shared.append(qMakePair(select.value(0).toLongLong(), decodeMessage(select.value(1))));
+        }
+    }
+    for (const auto& message : shared) {
+        insertMessage->addBindValue(branchId);
+        insertMessage->addBindValue(message.first);
+        insertMessage->addBindValue(message.second);
+        if (!insertMessage->exec()) {
+            return false;
+        }
+    }
+
+    QSqlQuery update(database);
+    if (!prepare(update, "UPDATE workspaces SET parentId = ?, forkPosition = ? WHERE id = ?")) {
+        return false;
+    }
+    update.addBindValue(moved.parentId >= 0 ? QVariant(moved.parentId) : QVariant());
+    update.addBindValue(moved.position);
+    update.addBindValue(branchId);
+    return update.exec();
+}
+
+bool WorkspaceStore::exec(const QString& statement) {
+    QSqlQuery query(database);
+    if (!query.exec(statement)) {
+        qWarning() << "Workspace database statement failed:" << statement << ":" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool WorkspaceStore::prepare(QSqlQuery& query, const QString& statement) {
+    if (!query.prepare(statement)) {
+        qCritical() << "Failed to prepare" << statement << ":" << query.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+bool WorkspaceStore::trainDictionary() {
+    // A random sample across all workspaces; scans the messages once, the first time anything is archived
+    QSqlQuery sampleQuery(database);
+    sampleQuery.setForwardOnly(true);
+    if (!prepare(sampleQuery, "SELECT content FROM messages WHERE typeof(content) = 'text' ORDER BY random() LIMIT ?")) {
+        return false;
+    }
+    sampleQuery.addBindValue(dictionarySamples);
+    if (!sampleQuery.exec()) {
+        return false;
+    }
+    std::vector<QByteArray> samples;
+    int sampleBytes = 0;
+    while (sampleQuery.next() && sampleBytes < dictionarySampleBytes) {
+        samples.push_back(sampleQuery.value(0).toString().toUtf8());
+        sampleBytes += samples.back().size();
+    }
+    sampleQuery.finish();
+
+    QByteArray dictionary = MessageCompressor::trainDictionary(samples);
+    if (dictionary.isEmpty()) {
+        return false; // Too little history yet; messages are compressed without a dictionary
+    }
+    QSqlQuery insert(database);
+    if (!prepare(insert, "INSERT INTO compressionDictionaries(data) VALUES (?)")) {
+        return false;
+    }
+    insert.addBindValue(dictionary);
+    if (!insert.exec()) {
+        qWarning() << "Failed to store compression dictionary:" << insert.lastError().text();
+        return false;
+    }
+    compressor.addDictionary(insert.lastInsertId().toUInt(), dictionary);
+    return true;
+}
+
+QString WorkspaceStore::decodeMessage(const QVariant& value) {
+    if (!isCompressedValue(value)) {
+        return value.toString();
+    }
+    QByteArray text;
+    if (!compressor.decompress(value.toByteArray(), text)) {
+        qWarning() << "Failed to decompress an archived message";
+        return QString();
+    }
+    return QString::fromUtf8(text);
+}
+
+bool WorkspaceStore::isCompressedValue(const QVariant& value) {
+    // Plain messages are stored as TEXT, compressed ones as BLOB
+    return value.userType() == QMetaType::QByteArray;
+}
+
+QString WorkspaceStore::makeSnippet(const QString& text, const QStringList& terms) {
+    int first = -1;
+    for (const QString& term : terms) {
+        int at = text.indexOf(term, 0, Qt::CaseInsensitive);
+        if (at >= 0 && (first < 0 || at < first)) {
+            first = at;
+        }
+    }
+    int start = std::max(0, first - snippetContext);
+    QString snippet = text.mid(start, 2 * snippetContext);
+    for (const QString& term : terms) {
+        int at = 0;
+        while ((at = snippet.indexOf(term, at, Qt::CaseInsensitive)) >= 0) {
+            snippet.insert(at + term.size(), ']');
+            snippet.insert(at, '[');
+            at += term.size() + 2;
+        }
+    }
+    return (start > 0 ? "..." : "") + snippet + (start + 2 * snippetContext < text.size() ? "..." : "");
+}
+
+QByteArray WorkspaceStore::encodeJson(const QJsonObject& json) {
+    return QJsonDocument(json).toJson(QJsonDocument::Compact);
+}
+
+QString WorkspaceStore::ftsQuery(const QString& query) {
+    // Each term as a quoted string, so words like AND or NEAR are searched for, not applied
+    QStringList quoted;
+    for (const SearchTerm& term : searchTerms(query)) {
+        quoted.append('"' + term.words.join(' ') + '"' + (term.prefix ? "*" : ""));
+    }
+    return quoted.join(' ');
+}